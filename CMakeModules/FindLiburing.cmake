@@ -0,0 +1,22 @@
+
+find_path ( Liburing_INCLUDE_DIRS liburing.h PATH_SUFFIXES include )
+mark_as_advanced ( Liburing_INCLUDE_DIRS )
+
+find_library ( uring_LIBRARY uring DOC "io_uring library location" )
+mark_as_advanced ( uring_LIBRARY )
+if ( uring_LIBRARY )
+  set ( Liburing_LIBRARIES ${uring_LIBRARY} )
+endif ( uring_LIBRARY )
+
+if ( Liburing_INCLUDE_DIRS AND Liburing_LIBRARIES )
+  set ( Liburing_FOUND true )
+endif ( Liburing_INCLUDE_DIRS AND Liburing_LIBRARIES )
+
+if ( NOT Liburing_FOUND )
+  if ( NOT Liburing_FIND_QUIETLY )
+    message ( STATUS "io_uring library (liburing) not found." )
+  endif ( NOT Liburing_FIND_QUIETLY )
+  if ( Liburing_FIND_REQUIRED )
+    message ( FATAL_ERROR "" )
+  endif ( Liburing_FIND_REQUIRED )
+endif ( NOT Liburing_FOUND )
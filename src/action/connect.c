@@ -17,6 +17,7 @@
 
 #include "obexpushd.h"
 #include "net.h"
+#include "scheduler.h"
 #include "core.h"
 
 static uint8_t obex_uuid_ftp[] = {
@@ -96,7 +97,9 @@ static int check_headers(file_data_t* data, obex_object_t* obj) {
 			break;
 
 		case OBEX_HDR_AUTHRESP:
-			data->net_data->auth_success = auth_verify(data->auth,value,vsize);
+			/* the password is checked later, see connect_resume() */
+			data->net_data->auth_success =
+				(auth_verify_defer(data->auth,value,vsize) == 1);
 			break;
 
 		default:
@@ -132,11 +135,42 @@ static void add_who_header(obex_t* handle, obex_object_t* obj,
 	}
 }
 
+/* The non-header data of CONNECT contains the maximum packet size
+ * that the client can receive.
+ */
+static void check_mtu(file_data_t* data, obex_object_t* obj)
+{
+	uint8_t *ptr = NULL;
+	int len = OBEX_ObjectGetNonHdrData(obj, &ptr);
+
+	data->mtu = OBEX_DEFAULT_MTU;
+	if (len >= 4 && ptr) {
+		uint16_t mtu = (ptr[2] << 8) | ptr[3];
+
+		/* OBEX_MAXIMUM_MTU is the maximum of the 16bit value */
+		if (mtu >= OBEX_MINIMUM_MTU)
+			data->mtu = mtu;
+	}
+	dbg_printf(data, "Client accepts packets up to %u bytes\n", data->mtu);
+}
+
+/* Called at the end of the scheduler round, with the checks of
+ * all other CONNECT requests of that round.
+ */
+static void connect_resume(file_data_t* data, obex_object_t* obj)
+{
+	data->net_data->auth_success = (data->auth->state == AUTH_STATE_SUCCESS);
+	obex_send_response(data, obj,
+			   net_security_init(data->net_data, data->auth, obj));
+}
+
 static void connect_request(file_data_t* data, obex_object_t* obj)
 {
 	obex_t* handle = data->net_data->obex;	
 	uint8_t respCode = 0;
 
+	check_mtu(data, obj);
+
 	/* Default to ObjectPush */
 	data->target = OBEX_TARGET_OPP;
 	data->target_ops = &obex_target_ops_opp;
@@ -154,6 +188,12 @@ static void connect_request(file_data_t* data, obex_object_t* obj)
 			free(data->transfer.path);
 			data->transfer.path = NULL;
 		}
+		if (data->auth &&
+		    data->auth->state == AUTH_STATE_RESPONSE_PENDING)
+		{
+			sched_session_defer(data, obj, connect_resume);
+			return;
+		}
 		respCode = net_security_init(data->net_data, data->auth, obj);
 	}
 
@@ -119,6 +119,73 @@ static int obex_obj_hdr_descr (file_data_t* data,
 	return 1;
 }
 
+/* Application parameters are tag-length-value triplets. The paging
+ * tags are the same as in PBAP, the others are our own.
+ */
+#define OBEX_APPARAM_MAXCOUNT 0x04 /* 2 bytes */
+#define OBEX_APPARAM_OFFSET   0x05 /* 2 bytes */
+#define OBEX_APPARAM_PREFIX   0x80 /* UTF-8 string */
+#define OBEX_APPARAM_SINCE    0x81 /* 4 bytes, seconds since Januar 1st, 1970 */
+
+static int obex_obj_hdr_apparam (file_data_t* data,
+				 obex_headerdata_t *value, uint32_t vsize)
+{
+	struct io_listing_filter *filter = &data->transfer.filter;
+	const uint8_t *ptr = value->bs;
+	const uint8_t *end = ptr + vsize;
+
+	while (end - ptr >= 2) {
+		uint8_t tag = ptr[0];
+		uint8_t len = ptr[1];
+		const uint8_t *v = ptr + 2;
+
+		if (end - v < len)
+			break;
+		ptr = v + len;
+
+		switch (tag) {
+		case OBEX_APPARAM_MAXCOUNT:
+			if (len != 2)
+				return 0;
+			filter->max = (v[0] << 8) | v[1];
+			dbg_printf(data, "max. entries: %u\n", filter->max);
+			break;
+
+		case OBEX_APPARAM_OFFSET:
+			if (len != 2)
+				return 0;
+			filter->offset = (v[0] << 8) | v[1];
+			dbg_printf(data, "offset: %u\n", filter->offset);
+			break;
+
+		case OBEX_APPARAM_PREFIX:
+			if (filter->prefix)
+				free(filter->prefix);
+			filter->prefix = strndup((const char*)v, len);
+			if (!filter->prefix)
+				return 0;
+			dbg_printf(data, "prefix: \"%s\"\n", filter->prefix);
+			if (!check_name((uint8_t*)filter->prefix)) {
+				dbg_printf(data, "CHECK FAILED: %s\n", "Invalid prefix string");
+				return 0;
+			}
+			break;
+
+		case OBEX_APPARAM_SINCE:
+			if (len != 4)
+				return 0;
+			filter->since = ((uint32_t)v[0] << 24) | ((uint32_t)v[1] << 16) |
+					((uint32_t)v[2] << 8) | v[3];
+			break;
+
+		default:
+			/* parameters of other profiles */
+			break;
+		}
+	}
+	return (ptr == end);
+}
+
 int obex_object_headers (file_data_t* data, obex_object_t* obj) {
 	uint8_t id = 0;
 	obex_headerdata_t value;
@@ -162,6 +229,10 @@ int obex_object_headers (file_data_t* data, obex_object_t* obj) {
 			err &= obex_obj_hdr_descr(data, &value, vsize);
 			break;
 
+		case OBEX_HDR_APPARAM:
+			err &= obex_obj_hdr_apparam(data, &value, vsize);
+			break;
+
 		default:
 			/* some unexpected header, may be a bug */
 			break;
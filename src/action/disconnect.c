@@ -18,10 +18,9 @@
 #include "obexpushd.h"
 #include "net.h"
 #include "core.h"
+#include "scheduler.h"
 #include "compiler.h"
 
-#include <unistd.h>
-
 static void disconnect_reqhint(file_data_t *data, obex_object_t *obj)
 {
 	/* A new request is coming in */
@@ -38,8 +37,8 @@ static void disconnect_request(file_data_t *data, obex_object_t __unused *obj)
 
 static void disconnect_done(file_data_t *data, obex_object_t __unused *obj)
 {
-	sleep(1);
-	net_disconnect(data->net_data);
+	/* the response must reach the client before the link is closed */
+	sched_session_disconnect(data);
 }
 
 const struct obex_target_event_ops obex_action_disconnect = {
@@ -20,8 +20,10 @@
 #include "io.h"
 #include "net.h"
 #include "action.h"
+#include "scheduler.h"
 
 #include "core.h"
+#include "bufpool.h"
 
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -133,7 +135,8 @@ static void add_headers(file_data_t *data, obex_object_t *obj)
 		add_type_header(data, obj);
 	}
 
-	add_length_header(data, obj);
+	if (transfer->length != IO_LENGTH_UNKNOWN)
+		add_length_header(data, obj);
 
 	if (transfer->time) {
 		add_time_header(data, obj);
@@ -195,6 +198,13 @@ static int get_open (file_data_t* data)
 	return err;
 }
 
+static void get_clear_filter(struct io_transfer_data *transfer)
+{
+	if (transfer->filter.prefix)
+		free(transfer->filter.prefix);
+	memset(&transfer->filter, 0, sizeof(transfer->filter));
+}
+
 static void get_reqhint(file_data_t *data, obex_object_t __unused *obj)
 {
 	/* A new request is coming in */
@@ -214,6 +224,7 @@ static void get_reqhint(file_data_t *data, obex_object_t __unused *obj)
 	data->error = 0;
 	transfer->length = 0;
 	transfer->time = 0;
+	get_clear_filter(transfer);
 }
 
 static void get_request(file_data_t *data, obex_object_t *obj)
@@ -239,28 +250,88 @@ static void get_request(file_data_t *data, obex_object_t *obj)
 	obex_send_response(data, obj, data->error);
 }
 
+/* packet header (opcode, length) and body header (id, length) */
+#define GET_PACKET_OVERHEAD 6
+
+/* Each body chunk fills a whole packet of the client's size */
+static size_t get_chunk_size(file_data_t *data)
+{
+	size_t size = OBEX_DEFAULT_MTU - GET_PACKET_OVERHEAD;
+
+	if (data->mtu > GET_PACKET_OVERHEAD)
+		size = data->mtu - GET_PACKET_OVERHEAD;
+
+	if (data->buffer && data->buffer_size < size) {
+		bufpool_put(data->buffer, data->buffer_size);
+		data->buffer = NULL;
+	}
+	if (!data->buffer) {
+		data->buffer = bufpool_get(size);
+		if (!data->buffer)
+			return 0;
+		data->buffer_size = size;
+	}
+
+	return size;
+}
+
+/* The last packet is sent when the I/O handler is done, so closing it
+ * does not have to wait later.
+ */
+static void get_stream_end(file_data_t *data, obex_object_t *obj)
+{
+	obex_t* handle = data->net_data->obex;
+	obex_headerdata_t hv;
+	int err = io_finish(data->io, &data->transfer);
+
+	if (err == -EINPROGRESS) {
+		int timeout;
+		int fd = io_wait_fd(data->io, &timeout);
+
+		if (sched_session_wait(data, obj, fd, timeout, get_stream_end) == 0)
+			return;
+		/* io_close() waits instead */
+	} else if (err < 0) {
+		dbg_printf(data, "%s\n", strerror(-err));
+	}
+
+	hv.bs = data->buffer;
+	(void)OBEX_ObjectAddHeader(handle, obj, OBEX_HDR_BODY, hv, 0,
+				   OBEX_FL_STREAM_DATAEND);
+	obex_send_response(data, obj, data->error);
+}
+
 static void get_stream_out(file_data_t *data, obex_object_t *obj)
 {
 	struct io_transfer_data *transfer = &data->transfer;
 
 	if (!data->error) {
-		size_t tLen = sizeof(data->buffer);
+		size_t tLen = get_chunk_size(data);
 		int len;
 
-		if (transfer->length < tLen)
+		if (tLen == 0) {
+			data->error = OBEX_RSP_INTERNAL_SERVER_ERROR;
+			obex_send_response(data, obj, data->error);
+			return;
+		}
+		if (transfer->length != IO_LENGTH_UNKNOWN &&
+		    transfer->length < tLen)
 			tLen = transfer->length;
 
 		len = (int)io_read(data->io, data->buffer, tLen);
-		if (len >= 0) {
+		if (len == 0) {
+			get_stream_end(data, obj);
+			return;
+
+		} else if (len > 0) {
 			obex_headerdata_t hv;
 			unsigned int flags = OBEX_FL_STREAM_DATA;
 			obex_t* handle = data->net_data->obex;
 
 			hv.bs = data->buffer;
-			if (len == 0)
-				flags = OBEX_FL_STREAM_DATAEND;
 			(void)OBEX_ObjectAddHeader(handle, obj, OBEX_HDR_BODY, hv, len, flags);
-			transfer->length -= len;
+			if (transfer->length != IO_LENGTH_UNKNOWN)
+				transfer->length -= len;
 
 		} else {
 			perror("Reading script output failed");
@@ -270,10 +341,14 @@ static void get_stream_out(file_data_t *data, obex_object_t *obj)
 	obex_send_response(data, obj, data->error);
 }
 
-static void get_done(file_data_t *data, obex_object_t __unused *obj)
+static void get_close(file_data_t *data, bool keep)
 {
 	struct io_transfer_data *transfer = &data->transfer;
-	int err = io_close(data->io, &data->transfer, true);;
+	int err;
+
+	/* an aborted request may still wait for the I/O handler */
+	sched_session_cancel(data);
+	err = io_close(data->io, &data->transfer, keep);
 
 	if (err)
 		dbg_printf(data, "%s\n", strerror(-err));
@@ -290,12 +365,19 @@ static void get_done(file_data_t *data, obex_object_t __unused *obj)
 
 	transfer->length = 0;
 	transfer->time = 0;
+	get_clear_filter(transfer);
+}
+
+static void get_done(file_data_t *data, obex_object_t __unused *obj)
+{
+	get_close(data, true);
 }
 
 static void get_abort(file_data_t *data, obex_object_t __unused *obj,
 		      int __unused event)
 {
-	get_done(data, obj);
+	/* a script does not have to finish its output */
+	get_close(data, false);
 }
 
 const struct obex_target_event_ops obex_action_get = {
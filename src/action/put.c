@@ -20,6 +20,7 @@
 #include "utf.h"
 #include "net.h"
 #include "action.h"
+#include "scheduler.h"
 
 #include "core.h"
 
@@ -56,6 +57,23 @@ static int put_write (file_data_t* data, const uint8_t* buf, int len)
 	return io_write(data->io, buf,(size_t)len);
 }
 
+/* Delay the response until the I/O handler is ready again */
+static void put_wait (file_data_t *data, obex_object_t *obj, sched_resume_t cb)
+{
+	int timeout;
+	int fd = io_wait_fd(data->io, &timeout);
+
+	if (sched_session_wait(data, obj, fd, timeout, cb) < 0) {
+		data->error = OBEX_RSP_INTERNAL_SERVER_ERROR;
+		obex_send_response(data, obj, data->error);
+	}
+}
+
+static void put_continue (file_data_t *data, obex_object_t *obj)
+{
+	obex_send_response(data, obj, data->error);
+}
+
 static void put_reqhint(file_data_t *data, obex_object_t *obj)
 {
 	obex_t* handle = data->net_data->obex;
@@ -95,15 +113,32 @@ static void put_stream_in(file_data_t *data, obex_object_t *obj)
 
 		dbg_printf(data, "got %d bytes of streamed data\n", len);
 		if (len) {
-			if (put_write(data, buf, len))
+			if (put_write(data, buf, len) < 0)
 				data->error = OBEX_RSP_FORBIDDEN;
 		}
+		/* the client sends more data after the response */
+		if (!data->error && (io_state(data->io) & IO_STATE_BUSY)) {
+			put_wait(data, obj, put_continue);
+			return;
+		}
 	}
 	obex_send_response(data, obj, data->error);
 }
 
 static void put_request(file_data_t *data, obex_object_t *obj)
 {
+	/* The file is committed before the final response, so the
+	 * client learns about late write errors */
+	if (!data->error && (io_state(data->io) & IO_STATE_OPEN)) {
+		int err = io_finish(data->io, &data->transfer);
+
+		if (err == -EINPROGRESS) {
+			put_wait(data, obj, put_request);
+			return;
+		}
+		if (err < 0 || io_close(data->io, &data->transfer, true) < 0)
+			data->error = OBEX_RSP_INTERNAL_SERVER_ERROR;
+	}
 	obex_send_response(data, obj, data->error);
 }
 
@@ -123,6 +158,8 @@ static void put_done(file_data_t *data, obex_object_t __unused *obj)
 {
 	struct io_transfer_data *transfer = &data->transfer;
 
+	/* an aborted request may still wait for the I/O handler */
+	sched_session_cancel(data);
 	if (io_state(data->io) & IO_STATE_OPEN) {
 		int keep = (data->error == 0);
 		(void)io_close(data->io, &data->transfer, keep);
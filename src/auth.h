@@ -33,7 +33,7 @@ struct auth_handler_ops {
 
 	/** Verify a user/password pair in a given realm
 	 *
-	 * @param realm the realm to verify in
+	 * @param id the realm to verify in, as for get_realm_name()
 	 * @param user the user value (no format implied)
 	 * @param ulen size of the user data
 	 * @param cb callback function to verify the password
@@ -41,7 +41,7 @@ struct auth_handler_ops {
 	 * @return 0 is verification failed, else 1
 	 */
 	int (*verify)(struct auth_handler *self,
-		      const uint16_t *realm,
+		      int id,
 		      const uint8_t *user, size_t ulen,
 		      auth_verify_cb cb, void *cb_data);
 
@@ -52,23 +52,47 @@ struct auth_handler_ops {
 enum auth_state {
 	AUTH_STATE_NONE = 0,
 	AUTH_STATE_REQUEST_SENT,
+	AUTH_STATE_RESPONSE_PENDING,
 	AUTH_STATE_SUCCESS,
 };
 
 struct auth_handler {
 	struct auth_handler_ops *ops;
 	enum auth_state state;
-	struct {
-		uint8_t nonce[16];
-	} *session;
+
+	/* the challenge for each realm, allocated with the handler */
+	struct obex_auth_challenge *challenge;
+	unsigned int count;
+
+	/* the response that waits for auth_verify_pending() */
+	struct obex_auth_response resp;
+	uint8_t *pass;
+	size_t plen;
+
 	void *private_data;
 };
 
+/** Allocate a handler with a challenge for each realm of ops */
+struct auth_handler* auth_new (struct auth_handler_ops *ops, void *private_data);
+
 struct auth_handler* auth_file_init (char* file, uint16_t *realm, uint8_t opts);
+struct auth_handler* auth_file_config (const char *config);
 struct auth_handler* auth_copy (struct auth_handler *h);
 void auth_destroy (struct auth_handler *h);
 
 int auth_init (struct auth_handler *self, obex_t *handle, obex_object_t *obj);
 int auth_verify (struct auth_handler *self, obex_headerdata_t h, uint32_t size);
 
+/** Like auth_verify() but the password check is left to the next call
+ * of auth_verify_pending() in this thread, so that many responses can
+ * be checked at once.
+ * @return -EINPROGRESS if the check is pending, else see auth_verify()
+ */
+int auth_verify_defer (struct auth_handler *self, obex_headerdata_t h, uint32_t size);
+
+/** Check all pending responses of this thread
+ * The state of each handler tells the result.
+ */
+void auth_verify_pending (void);
+
 #endif /* OBEXPUSHD_AUTH_H */
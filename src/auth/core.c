@@ -31,112 +31,234 @@
 
 #if defined(USE_LIBGCRYPT)
 #include <gcrypt.h>
+#else
+#include <sys/random.h>
+#include <pthread.h>
 #endif
 
 #include "compiler.h"
+#include "closexec.h"
+
+struct auth_handler* auth_new (struct auth_handler_ops *ops, void *private_data)
+{
+	struct auth_handler tmp = {
+		.ops = ops,
+		.private_data = private_data,
+	};
+	struct auth_handler *h;
+	int count = 0;
+	int i;
+
+	if (ops && ops->get_realm_count)
+		count = ops->get_realm_count(&tmp);
+	if (count < 0)
+		count = 0;
+
+	/* the realm names and options do not change for a session,
+	 * only the nonces are set when the challenge is sent
+	 */
+	h = calloc(1, sizeof(*h) + count * sizeof(*h->challenge));
+	if (!h)
+		return NULL;
+	*h = tmp;
+	h->challenge = (struct obex_auth_challenge*)(h + 1);
+	h->count = count;
+
+	for (i = 0; i < count; ++i) {
+		struct obex_auth_challenge *chal = &h->challenge[i];
+
+		if (ops->get_realm_name) {
+			const uint16_t *r = ops->get_realm_name(h, i);
+			chal->realm.data = r;
+			chal->realm.len = ucs2len(r) * sizeof(*r);
+			chal->realm.charset = 0xFF;
+		}
+		if (ops->get_realm_opts)
+			chal->opts = ops->get_realm_opts(h, chal->realm.data);
+	}
+
+	return h;
+}
 
 struct auth_handler* auth_copy (struct auth_handler *h)
 {
 	if (!h)
 		return NULL;
 
-	if (h->ops && h->ops->copy) {
+	if (h->ops && h->ops->copy)
 		/* deep copy */
 		return h->ops->copy(h);
-
-	} else {
+	else
 		/* flat copy */
-		struct auth_handler *hnew = malloc(sizeof(*h));
-		if (hnew) {
-			int count = 0;
-			if (h->ops && h->ops->get_realm_count)
-				count = h->ops->get_realm_count(h);
-			memcpy(hnew, h, sizeof(*h));
-			hnew->session = calloc(count, sizeof(*hnew->session));
-			if (!hnew->session) {
-				free(hnew);
-				hnew = NULL;
-			}
+		return auth_new(h->ops, h->private_data);
+}
+
+/* Responses are checked in batches, see auth_verify_pending().
+ * One scheduler round does not deliver more than 64 events.
+ */
+#define AUTH_BATCH 64
+
+static __thread struct auth_handler *auth_batch[AUTH_BATCH];
+static __thread unsigned int auth_batch_count;
+
+static void auth_clear_pass (struct auth_handler *h)
+{
+	if (h->pass) {
+		memset(h->pass, 0, h->plen);
+		free(h->pass);
+		h->pass = NULL;
+	}
+	h->plen = 0;
+}
+
+static void auth_batch_remove (struct auth_handler *h)
+{
+	unsigned int i;
+
+	for (i = 0; i < auth_batch_count; ++i) {
+		if (auth_batch[i] == h) {
+			auth_batch[i] = auth_batch[--auth_batch_count];
+			break;
 		}
-		return hnew;
 	}
+	auth_clear_pass(h);
 }
 
 void auth_destroy (struct auth_handler* h)
 {
 	if (h) {
+		if (h->state == AUTH_STATE_RESPONSE_PENDING)
+			auth_batch_remove(h);
 		if (h->ops && h->ops->cleanup)
 			h->ops->cleanup(h);
 		free(h);
 	}
 }
 
+#if defined(USE_LIBGCRYPT)
 static int auth_get_nonce (uint8_t nonce[16])
 {
-#if defined(USE_LIBGCRYPT)
 	gcry_create_nonce(nonce, 16);
 	return 0;
+}
 
 #else
+/* Nonces are taken from a per-thread pool of random bytes that is
+ * refilled in one call when it is used up. A forked child must not
+ * use the same bytes as its parent, so the pool is dropped then.
+ */
+#define AUTH_NONCE_POOL_SIZE 4096
+
+static __thread struct {
+	uint8_t buf[AUTH_NONCE_POOL_SIZE];
+	size_t pos;
+	int valid;
+} auth_nonce_pool;
+
+static int auth_nonce_atfork = 0;
+
+static void auth_nonce_pool_drop (void)
+{
+	memset(&auth_nonce_pool, 0, sizeof(auth_nonce_pool));
+}
+
 #define RANDOM_FILE "/dev/urandom"
-	int status;
-	int fd = open(RANDOM_FILE, O_RDONLY);
+static int auth_random_file (uint8_t *buf, size_t len)
+{
+	int err = 0;
+	int fd = open_closexec(RANDOM_FILE, O_RDONLY, 0);
 
 	if (fd < 0)
 		return -errno;
-	status = (int)read(fd, nonce, 16);
+	while (len) {
+		ssize_t status = read(fd, buf, len);
+
+		if (status == -1 && errno == EINTR)
+			continue;
+		if (status <= 0) {
+			err = (status == 0)? -EIO: -errno;
+			break;
+		}
+		buf += status;
+		len -= status;
+	}
 	(void)close(fd);
 
-	if (status < 0)
-		return -errno;
-	else if (status != 16)
-		return -EIO;
-	else
-		return 0;
-#endif
+	return err;
 }
 
-int auth_init (struct auth_handler *self, obex_t *handle, obex_object_t *obj)
+static int auth_nonce_pool_fill (void)
 {
-	struct obex_auth_challenge *chal;
-	int count = 0;
-	int i;
+	uint8_t *buf = auth_nonce_pool.buf;
+	size_t len = sizeof(auth_nonce_pool.buf);
 
-	if (!(self && self->ops && self->ops->get_realm_count))
-		return 0;
+	if (!__atomic_exchange_n(&auth_nonce_atfork, 1, __ATOMIC_SEQ_CST))
+		(void)pthread_atfork(NULL, NULL, auth_nonce_pool_drop);
+
+	while (len) {
+		ssize_t status = getrandom(buf, len, 0);
+
+		if (status == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOSYS) {
+				int err = auth_random_file(buf, len);
+				if (err)
+					return err;
+				break;
+			}
+			return -errno;
+		}
+		buf += status;
+		len -= status;
+	}
+	auth_nonce_pool.pos = 0;
+	auth_nonce_pool.valid = 1;
+
+	return 0;
+}
+
+static int auth_get_nonce (uint8_t nonce[16])
+{
+	if (!auth_nonce_pool.valid ||
+	    auth_nonce_pool.pos + 16 > sizeof(auth_nonce_pool.buf))
+	{
+		int err = auth_nonce_pool_fill();
+		if (err)
+			return err;
+	}
+
+	memcpy(nonce, auth_nonce_pool.buf + auth_nonce_pool.pos, 16);
+	/* a nonce is never handed out twice */
+	memset(auth_nonce_pool.buf + auth_nonce_pool.pos, 0, 16);
+	auth_nonce_pool.pos += 16;
 
-	count = self->ops->get_realm_count(self);
-	if (count == 0)
+	return 0;
+}
+#endif
+
+int auth_init (struct auth_handler *self, obex_t *handle, obex_object_t *obj)
+{
+	unsigned int i;
+
+	if (!self || self->count == 0)
 		return 0;
 
 	switch (self->state) {
 	case AUTH_STATE_NONE:
-		for (i = 0; i < count; ++i) {
-			if (auth_get_nonce(self->session[i].nonce) < 0)
+		for (i = 0; i < self->count; ++i) {
+			if (auth_get_nonce(self->challenge[i].nonce) < 0)
 				return 0;
 		}
 		self->state = AUTH_STATE_REQUEST_SENT;
 		/* no break */
 
 	case AUTH_STATE_REQUEST_SENT:
-		chal = calloc(count, sizeof(*chal));
-		if (!chal)
+		if (OBEX_AuthAddChallenges(handle, obj, self->challenge, self->count) < 0)
 			return 0;
-		for (i = 0; i < count; ++i) {
-			memcpy(chal[i].nonce, self->session[i].nonce, sizeof(chal->nonce));
-			if (self->ops && self->ops->get_realm_name) {
-				const uint16_t *r = self->ops->get_realm_name(self, i);
-				chal[i].realm.data = r;
-				chal[i].realm.len = ucs2len(r) * sizeof(*r);
-				chal[i].realm.charset = 0xFF;
-			}
-			if (self->ops && self->ops->get_realm_opts)
-				chal[i].opts = self->ops->get_realm_opts(self, chal[i].realm.data);
-		}
-		(void)OBEX_AuthAddChallenges(handle, obj, chal, count);
-		free(chal);
 		/* no break */
 		
+	case AUTH_STATE_RESPONSE_PENDING:
 	case AUTH_STATE_SUCCESS:
 		return 1;
 	}
@@ -149,40 +271,50 @@ static int obex_auth_verify_cb(void* resp, const uint8_t *pass, size_t plen)
 	return OBEX_AuthCheckResponse(resp, pass, plen);
 }
 
+/* @return the realm that the response is for or -1 */
+static int auth_find_realm (struct auth_handler *self,
+			    obex_headerdata_t h, uint32_t size,
+			    struct obex_auth_response *resp)
+{
+	unsigned int i;
+
+	if (!(self && self->ops && self->ops->verify))
+		return -1;
+	if (self->count == 0)
+		return -1;
+	memset(resp,0,sizeof(*resp));
+	if (OBEX_AuthUnpackResponse(h,size,resp) < 0)
+		return -1;
+	/* the nonce tells which realm the response is for */
+	for (i = 0; i < self->count; ++i) {
+		if (memcmp(self->challenge[i].nonce, resp->nonce, sizeof(resp->nonce)) == 0)
+			return (int)i;
+	}
+	return -1;
+}
+
 int auth_verify (struct auth_handler *self,
 		 obex_headerdata_t h,
 		 uint32_t size)
 {
 	struct obex_auth_response resp;
-	int count = 0;
 	int i;
 
 	switch (self->state) {
 	case AUTH_STATE_NONE:
+	case AUTH_STATE_RESPONSE_PENDING:
 	default:
 		return 0;
 
 	case AUTH_STATE_REQUEST_SENT:
-		if (!(self && self->ops && self->ops->verify))
-			return 0;
-		if (self->ops->get_realm_count)
-			count = self->ops->get_realm_count(self);
-		if (count == 0)
+		i = auth_find_realm(self, h, size, &resp);
+		if (i < 0)
 			return 0;
-		memset(&resp,0,sizeof(resp));
-		if (OBEX_AuthUnpackResponse(h,size,&resp) < 0)
+		if (!self->ops->verify(self, i,
+				       resp.user, resp.ulen,
+				       obex_auth_verify_cb, &resp))
+		{
 			return 0;
-		for (i = 0; i < count; ++i) {
-			if (memcmp(self->session[i].nonce, resp.nonce, sizeof(resp.nonce)) == 0)
-			{
-				if (!self->ops->verify(self,
-						       self->ops->get_realm_name(self, i),
-						       resp.user, resp.ulen,
-						       obex_auth_verify_cb, &resp))
-				{
-					return 0;
-				}
-			}
 		}
 		self->state = AUTH_STATE_SUCCESS;
 		/* no break */
@@ -191,3 +323,75 @@ int auth_verify (struct auth_handler *self,
 		return 1;
 	}
 }
+
+/* keeps the password for auth_verify_pending() */
+static int auth_defer_cb (void* arg, const uint8_t *pass, size_t plen)
+{
+	struct auth_handler *self = arg;
+
+	self->pass = malloc(plen? plen: 1);
+	if (!self->pass)
+		return 0;
+	memcpy(self->pass, pass, plen);
+	self->plen = plen;
+	return 1;
+}
+
+int auth_verify_defer (struct auth_handler *self,
+		       obex_headerdata_t h,
+		       uint32_t size)
+{
+	int i;
+
+	/* a full batch is not waited for */
+	if (self->state != AUTH_STATE_REQUEST_SENT ||
+	    auth_batch_count == AUTH_BATCH)
+		return auth_verify(self, h, size);
+
+	i = auth_find_realm(self, h, size, &self->resp);
+	if (i < 0)
+		return 0;
+	if (!self->ops->verify(self, i,
+			       self->resp.user, self->resp.ulen,
+			       auth_defer_cb, self))
+	{
+		auth_clear_pass(self);
+		return 0;
+	}
+	/* the user data belongs to the request */
+	self->resp.user = NULL;
+	self->resp.ulen = 0;
+	self->state = AUTH_STATE_RESPONSE_PENDING;
+	auth_batch[auth_batch_count++] = self;
+
+	return -EINPROGRESS;
+}
+
+void auth_verify_pending (void)
+{
+	struct obex_auth_check check[AUTH_BATCH];
+	unsigned int i;
+
+	if (auth_batch_count == 0)
+		return;
+
+	for (i = 0; i < auth_batch_count; ++i) {
+		check[i].resp = &auth_batch[i]->resp;
+		check[i].pass = auth_batch[i]->pass;
+		check[i].len = auth_batch[i]->plen;
+		check[i].result = 0;
+	}
+	if (OBEX_AuthCheckResponses(check, auth_batch_count) < 0)
+		memset(check, 0, sizeof(check));
+
+	for (i = 0; i < auth_batch_count; ++i) {
+		struct auth_handler *h = auth_batch[i];
+
+		if (check[i].result)
+			h->state = AUTH_STATE_SUCCESS;
+		else
+			h->state = AUTH_STATE_REQUEST_SENT;
+		auth_clear_pass(h);
+	}
+	auth_batch_count = 0;
+}
@@ -1,23 +1,25 @@
 #include "auth.h"
+#include "passwd.h"
 #include "utf.h"
 
-#include <sys/mman.h>
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <fcntl.h>
 
 #include "compiler.h"
-#include "closexec.h"
 
+/* The realms are shared by all copies of a handler */
 struct auth_file_data {
+	unsigned int refs;
+	unsigned int count;
 	struct {
 		char* filename;
+		struct auth_passwd *db;
 		uint16_t *name;
 		uint8_t opts;
-	} realm[1];
+	} realm[];
 };
 
 static int get_realm_count (struct auth_handler *self)
@@ -27,29 +29,40 @@ static int get_realm_count (struct auth_handler *self)
 	if (!data)
 		return 0;
 
-	return sizeof(data->realm)/sizeof(data->realm[0]);
+	return data->count;
 }
 
-static int get_realm_id (struct auth_handler *self,
-			 const uint16_t *realm)
+static int get_realm_id_data (struct auth_file_data *data,
+			      const uint16_t *realm)
 {
-	struct auth_file_data *data = self->private_data;
-	unsigned int count = get_realm_count(self);
 	unsigned int i = 0;
 
-	for (; i < count; ++i) {
-		if (realm == NULL) {
-			if (data->realm[i].name == NULL)
+	for (; i < data->count; ++i) {
+		const uint16_t *name = data->realm[i].name;
+
+		if (realm == NULL || name == NULL) {
+			if (realm == name)
 				return i;
 		} else {
-			size_t size = ucs2len(data->realm[i].name) * sizeof(*realm);
-			if (memcmp(realm, data->realm[i].name, size) == 0)
+			size_t size = (ucs2len(name) + 1) * sizeof(*realm);
+			if (memcmp(realm, name, size) == 0)
 				return i;
 		}
 	}
 	return -EINVAL;
 }
 
+static int get_realm_id (struct auth_handler *self,
+			 const uint16_t *realm)
+{
+	struct auth_file_data *data = self->private_data;
+
+	if (!data)
+		return -EINVAL;
+
+	return get_realm_id_data(data, realm);
+}
+
 static const uint16_t* get_realm_name (struct auth_handler *self,
 				       int id)
 {
@@ -74,105 +87,53 @@ static uint8_t get_realm_opts(struct auth_handler *self,
 }
 
 static int verify (struct auth_handler *self,
-		   const uint16_t *realm,
+		   int id,
 		   const uint8_t *user, size_t ulen,
 		   auth_verify_cb cb, void *cb_data)
 {
 	struct auth_file_data *data = self->private_data;
-	int id = get_realm_id(self, realm);
-	int fd = -1;
-	struct stat fdinfo;
-	const uint8_t *start = MAP_FAILED;
-	size_t mapsize = 0;
-	int ret = 0;
 
-	if (id < 0)
-		goto out;
-
-	fd = open_closexec(data->realm[id].filename, O_RDONLY, 0);
-	if (fd == -1)
-		goto out;
-
-	/* user + separator ':' + pass (minimum length 1) + line end */
-	if (fstat(fd, &fdinfo) != 0)
-		goto out;
-	mapsize =  (size_t)fdinfo.st_size;
-	if (mapsize < ulen)
-		goto out;
-
-	start = mmap(NULL, mapsize, PROT_READ, MAP_SHARED, fd, 0);
-	if (start != MAP_FAILED) {
-		const uint8_t *cur = start;
-		const uint8_t *end = start + mapsize;
-		
-		while ((cur + ulen + 1) <= end) {
-			if (memcmp(cur, user, ulen) != 0 || cur[ulen] != ':') {
-				/* no match, skip current line or go to end of file */
-				while (cur != end && *cur != '\n')
-					++cur;
-				if (cur != end)
-					++cur;
-
-			} else {
-				/* user matched */
-				const uint8_t *pass = cur + ulen + 1;
-				size_t plen = 0;
-
-				/* forward to end of line or end of file */
-				cur = pass;
-				while (cur != end && *cur != '\n')
-					++cur;
-				if (cur != end)
-					++cur;
-
-				/* remove line end characters */
-				plen = cur - pass;
-				if (pass[plen] == '\n') {
-					if (pass[--plen] == '\r')
-						--plen;
-				}
-
-				/* verify using callback function */
-				ret = cb(cb_data, pass, plen);
-				break;
-			}
-		}
-	}
+	if (id < 0 || id >= get_realm_count(self))
+		return 0;
 
-out:
-	if (start != MAP_FAILED)
-		(void)munmap((void*)start, mapsize);
-	if (fd >= 0)
-		close(fd);
-	return ret;
+	return auth_passwd_verify(data->realm[id].db, user, ulen, cb, cb_data);
 }
 
+static struct auth_handler_ops auth_file_ops;
+
 static struct auth_handler* auth_file_copy (struct auth_handler *self)
 {
 	struct auth_file_data *data = self->private_data;
+	struct auth_handler *h = auth_new(&auth_file_ops, data);
 
-	return auth_file_init(data->realm[0].filename,
-			      data->realm[0].name,
-			      data->realm[0].opts);
+	if (h)
+		__atomic_add_fetch(&data->refs, 1, __ATOMIC_SEQ_CST);
+
+	return h;
 }
 
-static void auth_file_cleanup (struct auth_handler *self)
+static void auth_file_data_free (struct auth_file_data *data)
 {
-	struct auth_file_data *data = self->private_data;
-	unsigned int count = get_realm_count(self);
 	unsigned int i = 0;
 
-	if (!data)
-		return;
-
-	for (; i < count; ++i) {
+	for (; i < data->count; ++i) {
 		if (data->realm[i].filename)
 			free(data->realm[i].filename);
 		if (data->realm[i].name)
 			free(data->realm[i].name);
 	}
-	memset(data, 0, sizeof(*data));
 	free(data);
+}
+
+static void auth_file_cleanup (struct auth_handler *self)
+{
+	struct auth_file_data *data = self->private_data;
+
+	if (!data)
+		return;
+
+	if (__atomic_sub_fetch(&data->refs, 1, __ATOMIC_SEQ_CST) == 0)
+		auth_file_data_free(data);
 	self->private_data = NULL;
 }
 
@@ -185,48 +146,144 @@ static struct auth_handler_ops auth_file_ops = {
 	.cleanup = auth_file_cleanup,
 };
 
-struct auth_handler* auth_file_init (char* file, uint16_t *realm, uint8_t opts)
+static struct auth_file_data* auth_file_data_new (unsigned int count)
 {
-	struct auth_handler *h = malloc(sizeof(*h));
-	
-	if (h) {
-		struct auth_file_data *d = malloc(sizeof(*d));
-
-		memset(h, 0, sizeof(*h));
-		h->ops = &auth_file_ops;
-		h->private_data = d;
-
-		if (!d)
-			goto out;
-
-		memset(d, 0, sizeof(*d));
-		d->realm[0].filename = strdup(file);
-		if (!d->realm[0].filename)
-			goto out;
-
-		if (realm) {
-			d->realm[0].name = ucs2dup(realm);
-			if (!d->realm[0].name)
-				goto out;
-		}
-		
-		d->realm[0].opts = opts;	
+	struct auth_file_data *d;
+
+	d = calloc(1, sizeof(*d) + count * sizeof(d->realm[0]));
+	if (d)
+		d->refs = 1;
+	return d;
+}
+
+static int auth_file_add_realm (struct auth_file_data *d,
+				const char *file, uint16_t *realm, uint8_t opts)
+{
+	unsigned int i = d->count++;
 
-		h->session = calloc(get_realm_count(h), sizeof(*h->session));
-		if (!h->session)
-			goto out;
+	d->realm[i].filename = strdup(file);
+	if (!d->realm[i].filename)
+		return -errno;
+
+	d->realm[i].db = auth_passwd_get(file);
+	if (!d->realm[i].db)
+		return -errno;
+
+	if (realm) {
+		d->realm[i].name = ucs2dup(realm);
+		if (!d->realm[i].name)
+			return -errno;
 	}
 
+	d->realm[i].opts = opts;
+	return 0;
+}
+
+static struct auth_handler* auth_file_handler (struct auth_file_data *d)
+{
+	struct auth_handler *h = auth_new(&auth_file_ops, d);
+
+	if (!h)
+		auth_file_data_free(d);
 	return h;
+}
 
-out:
-	if (h) {
-		auth_file_cleanup(h);
-		if (h->session) {
-			free(h->session);
-			h->session = NULL;
+struct auth_handler* auth_file_init (char* file, uint16_t *realm, uint8_t opts)
+{
+	struct auth_file_data *d = auth_file_data_new(1);
+
+	if (!d)
+		return NULL;
+
+	if (auth_file_add_realm(d, file, realm, opts) < 0) {
+		auth_file_data_free(d);
+		return NULL;
+	}
+
+	return auth_file_handler(d);
+}
+
+/* Each line of the config file is a password file, optionally
+ * followed by white space and the name of the realm (UTF-8).
+ * Empty lines and lines starting with '#' are ignored.
+ * With more than one line, each realm needs a distinct name, else
+ * the client cannot tell the challenges apart.
+ */
+struct auth_handler* auth_file_config (const char *config)
+{
+	struct auth_file_data *d = NULL;
+	FILE *f = fopen(config, "r");
+	char *line = NULL;
+	size_t size = 0;
+	unsigned int count = 0;
+	int err = 0;
+
+	if (!f)
+		return NULL;
+
+	while (getline(&line, &size, f) != -1) {
+		char *file = line + strspn(line, " \t\r\n");
+
+		if (file[0] != '#' && file[0] != 0)
+			++count;
+	}
+	if (count == 0) {
+		err = -EINVAL;
+		goto out;
+	}
+	d = auth_file_data_new(count);
+	if (!d) {
+		err = -errno;
+		goto out;
+	}
+
+	rewind(f);
+	while (d->count < count && getline(&line, &size, f) != -1) {
+		char *file = line + strspn(line, " \t");
+		char *name;
+		uint16_t *realm = NULL;
+
+		file[strcspn(file, "\r\n")] = 0;
+		if (file[0] == '#' || file[0] == 0)
+			continue;
+
+		name = file + strcspn(file, " \t");
+		if (*name) {
+			*name++ = 0;
+			name += strspn(name, " \t");
+		}
+		if (*name) {
+			realm = utf8_to_ucs2((uint8_t*)name);
+			if (!realm) {
+				err = -errno;
+				break;
+			}
 		}
-		free(h);
+		if (count > 1 &&
+		    (!realm || get_realm_id_data(d, realm) >= 0))
+		{
+			fprintf(stderr, "%s: realm of %s needs a unique name\n",
+				config, file);
+			free(realm);
+			err = -EINVAL;
+			break;
+		}
+		err = auth_file_add_realm(d, file, realm, OBEX_AUTH_OPT_USER_REQ);
+		free(realm);
+		if (err)
+			break;
+	}
+	if (!err && d->count < count)
+		err = (ferror(f)? -EIO: -EINVAL);
+
+out:
+	free(line);
+	(void)fclose(f);
+	if (err) {
+		if (d)
+			auth_file_data_free(d);
+		errno = -err;
+		return NULL;
 	}
-	return NULL;
+	return auth_file_handler(d);
 }
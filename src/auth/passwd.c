@@ -0,0 +1,432 @@
+/* Copyright (C) 2006-2010 Hendrik Sattler <post@hendrik-sattler.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* Password file index:
+ * The file ("user:password" per line) is read once into a hash table.
+ * With threads, a separate thread watches the file with inotify and
+ * replaces the table when it changes. It is started by the first
+ * lookup in a process, as threads do not survive daemon() or fork().
+ * Readers do not take a lock: they announce themselves in a counter
+ * of the current epoch, and the old table is only freed when the
+ * counters of both epochs were seen at zero after the swap. Without
+ * threads, each lookup compares the status of the file and reloads
+ * it when needed.
+ * An index is never freed, there is usually only one password file.
+ */
+
+#include "passwd.h"
+#include "closexec.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(USE_THREADS)
+#include <sys/inotify.h>
+#include <pthread.h>
+#endif
+
+struct auth_passwd_entry {
+	uint64_t hash;
+	const uint8_t *user; /* NULL for an unused entry */
+	size_t ulen;
+	const uint8_t *pass;
+	size_t plen;
+};
+
+struct auth_passwd_index {
+	uint8_t *data; /* the file content */
+	struct auth_passwd_entry *table;
+	size_t mask;
+};
+
+struct auth_passwd {
+	char *filename;
+	struct auth_passwd_index *current; /* NULL if the file is not readable */
+	struct auth_passwd *next;
+#if defined(USE_THREADS)
+	unsigned long epoch;
+	unsigned long readers[2];
+	int ifd;
+	const char *base;
+	pid_t watcher; /* the process that runs the watch thread */
+#else
+	struct stat st;
+#endif
+};
+
+static struct auth_passwd *auth_passwd_list = NULL;
+
+#if defined(USE_THREADS)
+static pthread_mutex_t auth_passwd_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define auth_passwd_lock() pthread_mutex_lock(&auth_passwd_mutex)
+#define auth_passwd_unlock() pthread_mutex_unlock(&auth_passwd_mutex)
+#else
+#define auth_passwd_lock() do {} while (0)
+#define auth_passwd_unlock() do {} while (0)
+#endif
+
+/* FNV-1a */
+static uint64_t auth_passwd_hash (const uint8_t *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--) {
+		h ^= *s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static struct auth_passwd_entry* auth_passwd_find (const struct auth_passwd_index *idx,
+						   const uint8_t *user, size_t ulen,
+						   uint64_t hash)
+{
+	size_t i = hash & idx->mask;
+
+	while (idx->table[i].user) {
+		struct auth_passwd_entry *e = &idx->table[i];
+
+		if (e->hash == hash && e->ulen == ulen &&
+		    memcmp(e->user, user, ulen) == 0)
+			return e;
+		i = (i + 1) & idx->mask;
+	}
+	/* the free entry to use */
+	return &idx->table[i];
+}
+
+static void auth_passwd_free (struct auth_passwd_index *idx)
+{
+	if (idx) {
+		free(idx->table);
+		free(idx->data);
+		free(idx);
+	}
+}
+
+static int auth_passwd_read (int fd, uint8_t *buf, size_t size)
+{
+	size_t total = 0;
+
+	while (total < size) {
+		ssize_t status = read(fd, buf + total, size - total);
+
+		if (status == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (status == 0)
+			break;
+		total += status;
+	}
+	return total;
+}
+
+static struct auth_passwd_index* auth_passwd_load (const char *filename,
+						   struct stat *st)
+{
+	struct auth_passwd_index *idx = NULL;
+	const uint8_t *cur;
+	const uint8_t *end;
+	size_t lines = 1;
+	size_t size = 16;
+	int fd;
+	int err;
+
+	fd = open_closexec(filename, O_RDONLY, 0);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, st) == -1)
+		goto out;
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx)
+		goto out;
+	idx->data = malloc(st->st_size + 1);
+	if (!idx->data)
+		goto out_err;
+	err = auth_passwd_read(fd, idx->data, st->st_size);
+	if (err < 0)
+		goto out_err;
+	end = idx->data + err;
+
+	for (cur = idx->data; cur != end; ++cur)
+		if (*cur == '\n')
+			++lines;
+	/* keep the table at most half full */
+	while (size < 2 * lines)
+		size *= 2;
+	idx->table = calloc(size, sizeof(*idx->table));
+	if (!idx->table)
+		goto out_err;
+	idx->mask = size - 1;
+
+	for (cur = idx->data; cur < end; ) {
+		const uint8_t *eol = memchr(cur, '\n', end - cur);
+		const uint8_t *sep;
+
+		if (!eol)
+			eol = end;
+		sep = memchr(cur, ':', eol - cur);
+		if (sep) {
+			size_t ulen = sep - cur;
+			uint64_t hash = auth_passwd_hash(cur, ulen);
+			struct auth_passwd_entry *e = auth_passwd_find(idx, cur, ulen, hash);
+
+			/* the first line of a user is used */
+			if (!e->user) {
+				e->hash = hash;
+				e->user = cur;
+				e->ulen = ulen;
+				e->pass = sep + 1;
+				e->plen = eol - e->pass;
+				if (e->plen && e->pass[e->plen - 1] == '\r')
+					--e->plen;
+			}
+		}
+		cur = eol + 1;
+	}
+
+	(void)close(fd);
+	return idx;
+
+out_err:
+	auth_passwd_free(idx);
+	idx = NULL;
+out:
+	(void)close(fd);
+	return idx;
+}
+
+#if defined(USE_THREADS)
+/* wait until no reader can use an index that was replaced before */
+static void auth_passwd_synchronize (struct auth_passwd *p)
+{
+	int i;
+
+	/* a reader may have taken the epoch before the last change of it */
+	for (i = 0; i < 2; ++i) {
+		unsigned long e = __atomic_fetch_add(&p->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+		while (__atomic_load_n(&p->readers[e], __ATOMIC_SEQ_CST))
+			(void)usleep(1000);
+	}
+}
+
+static void auth_passwd_reload (struct auth_passwd *p)
+{
+	struct stat st;
+	struct auth_passwd_index *idx = auth_passwd_load(p->filename, &st);
+
+	idx = __atomic_exchange_n(&p->current, idx, __ATOMIC_SEQ_CST);
+	if (idx) {
+		auth_passwd_synchronize(p);
+		auth_passwd_free(idx);
+	}
+}
+
+static void* auth_passwd_watch (void *arg)
+{
+	struct auth_passwd *p = arg;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (1) {
+		ssize_t status = read(p->ifd, buf, sizeof(buf));
+		char *ptr = buf;
+		int changed = 0;
+
+		if (status == -1 && errno == EINTR)
+			continue;
+		if (status <= 0)
+			break;
+
+		while (ptr < buf + status) {
+			struct inotify_event *ev = (struct inotify_event*)ptr;
+
+			if ((ev->mask & IN_Q_OVERFLOW) ||
+			    (ev->len && strcmp(ev->name, p->base) == 0))
+				changed = 1;
+			ptr += sizeof(*ev) + ev->len;
+		}
+		if (changed)
+			auth_passwd_reload(p);
+	}
+
+	return NULL;
+}
+
+/* The directory is watched, so replacing the file by renaming
+ * another one is noticed, too.
+ */
+static int auth_passwd_start (struct auth_passwd *p)
+{
+	char *dir = strdup(p->filename);
+	char *sep;
+	pthread_t t;
+	pthread_attr_t attr;
+	int err = 0;
+
+	if (!dir)
+		return -errno;
+	sep = strrchr(dir, '/');
+	if (!sep) {
+		strcpy(dir, ".");
+		p->base = p->filename;
+	} else {
+		p->base = p->filename + (sep - dir) + 1;
+		sep[(sep == dir)? 1: 0] = 0;
+	}
+
+	p->ifd = inotify_init1(IN_CLOEXEC);
+	if (p->ifd == -1 ||
+	    inotify_add_watch(p->ifd, dir, IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+			      IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB) == -1)
+		err = -errno;
+	free(dir);
+
+	if (!err) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		err = -pthread_create(&t, &attr, auth_passwd_watch, p);
+		pthread_attr_destroy(&attr);
+	}
+	if (err && p->ifd != -1) {
+		(void)close(p->ifd);
+		p->ifd = -1;
+	}
+	return err;
+}
+
+static void auth_passwd_check_watch (struct auth_passwd *p)
+{
+	pid_t pid = getpid();
+	int err;
+
+	if (__atomic_load_n(&p->watcher, __ATOMIC_ACQUIRE) == pid)
+		return;
+
+	auth_passwd_lock();
+	if (p->watcher != pid) {
+		/* inherited from the parent, its thread is not here */
+		if (p->ifd != -1)
+			(void)close(p->ifd);
+		p->ifd = -1;
+		err = auth_passwd_start(p);
+		if (err)
+			fprintf(stderr, "Warning: changes of %s are not noticed: %s\n",
+				p->filename, strerror(-err));
+		else
+			/* it may have changed before the watch was added */
+			auth_passwd_reload(p);
+		__atomic_store_n(&p->watcher, pid, __ATOMIC_RELEASE);
+	}
+	auth_passwd_unlock();
+}
+
+#else
+static struct auth_passwd_index* auth_passwd_check (struct auth_passwd *p)
+{
+	struct stat st;
+	int changed;
+
+	if (stat(p->filename, &st) == -1)
+		changed = (p->current != NULL);
+	else
+		changed = (p->current == NULL ||
+			   st.st_ino != p->st.st_ino || st.st_dev != p->st.st_dev ||
+			   st.st_size != p->st.st_size ||
+			   st.st_mtim.tv_sec != p->st.st_mtim.tv_sec ||
+			   st.st_mtim.tv_nsec != p->st.st_mtim.tv_nsec);
+
+	if (changed) {
+		auth_passwd_free(p->current);
+		p->current = auth_passwd_load(p->filename, &p->st);
+	}
+	return p->current;
+}
+#endif
+
+struct auth_passwd* auth_passwd_get (const char *filename)
+{
+	struct auth_passwd *p;
+
+	auth_passwd_lock();
+	for (p = auth_passwd_list; p; p = p->next)
+		if (strcmp(p->filename, filename) == 0)
+			goto out;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		goto out;
+	p->filename = strdup(filename);
+	if (!p->filename) {
+		free(p);
+		p = NULL;
+		goto out;
+	}
+#if defined(USE_THREADS)
+	{
+		struct stat st;
+
+		p->current = auth_passwd_load(filename, &st);
+		p->ifd = -1;
+	}
+#else
+	p->current = auth_passwd_load(filename, &p->st);
+#endif
+	p->next = auth_passwd_list;
+	auth_passwd_list = p;
+
+out:
+	auth_passwd_unlock();
+	return p;
+}
+
+int auth_passwd_verify (struct auth_passwd *p,
+			const uint8_t *user, size_t ulen,
+			auth_verify_cb cb, void *cb_data)
+{
+	struct auth_passwd_index *idx;
+	struct auth_passwd_entry *e;
+	int ret = 0;
+#if defined(USE_THREADS)
+	unsigned long epoch;
+
+	auth_passwd_check_watch(p);
+	epoch = __atomic_load_n(&p->epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_add_fetch(&p->readers[epoch], 1, __ATOMIC_SEQ_CST);
+	idx = __atomic_load_n(&p->current, __ATOMIC_SEQ_CST);
+#else
+	idx = auth_passwd_check(p);
+#endif
+
+	if (idx) {
+		e = auth_passwd_find(idx, user, ulen, auth_passwd_hash(user, ulen));
+		if (e->user)
+			ret = cb(cb_data, e->pass, e->plen);
+	}
+
+#if defined(USE_THREADS)
+	__atomic_sub_fetch(&p->readers[epoch], 1, __ATOMIC_SEQ_CST);
+#endif
+	return ret;
+}
@@ -0,0 +1,18 @@
+#include "auth.h"
+
+#include <sys/types.h>
+
+/* In-memory index of a password file, see passwd.c */
+struct auth_passwd;
+
+/** Get the index of a password file, it is shared by all callers
+ * @return the index or NULL on error (errno is set)
+ */
+struct auth_passwd* auth_passwd_get (const char *filename);
+
+/** Look up a user and pass its password to cb
+ * @return the result of cb or 0 if the user is unknown
+ */
+int auth_passwd_verify (struct auth_passwd *p,
+			const uint8_t *user, size_t ulen,
+			auth_verify_cb cb, void *cb_data);
@@ -0,0 +1,106 @@
+/* Copyright (C) 2006-2010 Hendrik Sattler <post@hendrik-sattler.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "bufpool.h"
+
+#include <stdlib.h>
+#if defined(USE_THREADS)
+#include <pthread.h>
+#endif
+
+/* size classes from 1KiB to 64KiB */
+#define BUFPOOL_MIN_SHIFT 10
+#define BUFPOOL_MAX_SHIFT 16
+#define BUFPOOL_CLASSES (BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+
+/* do not keep more than this number of unused buffers per class */
+#define BUFPOOL_MAX_FREE 64
+
+struct bufpool_entry {
+	struct bufpool_entry *next;
+};
+
+struct bufpool_class {
+	struct bufpool_entry *free;
+	unsigned int count;
+};
+
+static struct bufpool_class bufpool[BUFPOOL_CLASSES];
+#if defined(USE_THREADS)
+static pthread_mutex_t bufpool_lock = PTHREAD_MUTEX_INITIALIZER;
+#define bufpool_lock()   (void)pthread_mutex_lock(&bufpool_lock)
+#define bufpool_unlock() (void)pthread_mutex_unlock(&bufpool_lock)
+#else
+#define bufpool_lock()
+#define bufpool_unlock()
+#endif
+
+static int bufpool_class (size_t size)
+{
+	int i;
+
+	for (i = 0; i < BUFPOOL_CLASSES; ++i) {
+		if (size <= ((size_t)1 << (BUFPOOL_MIN_SHIFT + i)))
+			return i;
+	}
+
+	return -1;
+}
+
+void* bufpool_get (size_t size)
+{
+	int i = bufpool_class(size);
+	struct bufpool_entry *e;
+
+	if (i < 0)
+		return NULL;
+
+	bufpool_lock();
+	e = bufpool[i].free;
+	if (e) {
+		bufpool[i].free = e->next;
+		--bufpool[i].count;
+	}
+	bufpool_unlock();
+
+	if (e)
+		return e;
+	else
+		return malloc((size_t)1 << (BUFPOOL_MIN_SHIFT + i));
+}
+
+void bufpool_put (void *buf, size_t size)
+{
+	int i = bufpool_class(size);
+	struct bufpool_entry *e = buf;
+
+	if (!buf)
+		return;
+
+	if (i >= 0) {
+		bufpool_lock();
+		if (bufpool[i].count < BUFPOOL_MAX_FREE) {
+			e->next = bufpool[i].free;
+			bufpool[i].free = e;
+			++bufpool[i].count;
+			e = NULL;
+		}
+		bufpool_unlock();
+	}
+
+	free(e);
+}
@@ -0,0 +1,16 @@
+#ifndef OBEXPUSHD_BUFPOOL_H
+#define OBEXPUSHD_BUFPOOL_H
+
+#include <stddef.h>
+
+/* Pool of transfer buffers, sorted by power-of-two size classes */
+
+/** Get a buffer with at least size bytes
+ * @return the buffer or NULL if size is too large or no memory is available
+ */
+void* bufpool_get (size_t size);
+
+/** Return a buffer that was requested with the same size */
+void bufpool_put (void *buf, size_t size);
+
+#endif /* OBEXPUSHD_BUFPOOL_H */
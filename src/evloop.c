@@ -0,0 +1,267 @@
+/* Copyright (C) 2006-2010 Hendrik Sattler <post@hendrik-sattler.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "evloop.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define EVLOOP_MAX_EVENTS 64
+
+struct evloop_watch {
+	struct evloop *loop;
+	int fd;
+	evloop_cb_t cb;
+	void *arg;
+	int timer; /* fd is a timerfd owned by the watch */
+
+	/* list of removed watches that are still referenced by
+	 * the current dispatch round */
+	struct evloop_watch *next_dead;
+};
+
+struct evloop {
+	int epfd;
+	unsigned int count;
+	struct evloop_watch *dead;
+
+	evloop_round_t round;
+	void *round_arg;
+};
+
+/* the loop that is dispatched by this thread */
+static __thread struct evloop *evloop_running = NULL;
+
+struct evloop* evloop_new (void)
+{
+	struct evloop *loop = malloc(sizeof(*loop));
+
+	if (!loop)
+		return NULL;
+
+	memset(loop, 0, sizeof(*loop));
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd == -1) {
+		int err = errno;
+		free(loop);
+		errno = err;
+		return NULL;
+	}
+
+	return loop;
+}
+
+static void evloop_release_dead (struct evloop *loop)
+{
+	while (loop->dead) {
+		struct evloop_watch *w = loop->dead;
+
+		loop->dead = w->next_dead;
+		free(w);
+	}
+}
+
+void evloop_destroy (struct evloop *loop)
+{
+	if (!loop)
+		return;
+
+	evloop_release_dead(loop);
+	if (loop->epfd != -1)
+		(void)close(loop->epfd);
+	free(loop);
+}
+
+struct evloop_watch* evloop_add (
+	struct evloop *loop,
+	int fd,
+	uint32_t events,
+	evloop_cb_t cb,
+	void *arg
+)
+{
+	struct evloop_watch *w;
+	struct epoll_event ev;
+
+	if (!loop || fd < 0 || !cb) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return NULL;
+
+	w->loop = loop;
+	w->fd = fd;
+	w->cb = cb;
+	w->arg = arg;
+	w->timer = 0;
+	w->next_dead = NULL;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = w;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		int err = errno;
+		free(w);
+		errno = err;
+		return NULL;
+	}
+	++loop->count;
+
+	return w;
+}
+
+int evloop_mod (struct evloop_watch *w, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = w;
+	if (epoll_ctl(w->loop->epfd, EPOLL_CTL_MOD, w->fd, &ev) == -1)
+		return -errno;
+
+	return 0;
+}
+
+void evloop_del (struct evloop_watch *w)
+{
+	struct evloop *loop;
+
+	if (!w || !w->cb)
+		return;
+
+	loop = w->loop;
+	/* the descriptor may already be closed by its owner which
+	 * also removed it from the epoll set */
+	(void)epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+	--loop->count;
+	if (w->timer)
+		(void)close(w->fd);
+
+	w->cb = NULL;
+	w->next_dead = loop->dead;
+	loop->dead = w;
+}
+
+struct evloop_watch* evloop_add_timer (
+	struct evloop *loop,
+	unsigned int interval,
+	evloop_cb_t cb,
+	void *arg
+)
+{
+	struct itimerspec t;
+	struct evloop_watch *w;
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+
+	if (fd == -1)
+		return NULL;
+
+	memset(&t, 0, sizeof(t));
+	t.it_interval.tv_sec = interval / 1000;
+	t.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+	t.it_value = t.it_interval;
+	if (interval == 0)
+		t.it_value.tv_nsec = 1; /* fire once, immediately */
+
+	if (timerfd_settime(fd, 0, &t, NULL) == -1) {
+		int err = errno;
+		(void)close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	/* level triggered, the expiration count is read before dispatching */
+	w = evloop_add(loop, fd, EPOLLIN, cb, arg);
+	if (!w) {
+		int err = errno;
+		(void)close(fd);
+		errno = err;
+		return NULL;
+	}
+	w->timer = 1;
+
+	return w;
+}
+
+struct evloop* evloop_current (void)
+{
+	return evloop_running;
+}
+
+int evloop_watch_fd (struct evloop_watch *w)
+{
+	return w->fd;
+}
+
+struct evloop* evloop_watch_loop (struct evloop_watch *w)
+{
+	return w->loop;
+}
+
+void evloop_set_round (struct evloop *loop, evloop_round_t cb, void *arg)
+{
+	loop->round = cb;
+	loop->round_arg = arg;
+}
+
+unsigned int evloop_count (struct evloop *loop)
+{
+	return loop->count;
+}
+
+int evloop_dispatch (struct evloop *loop, int timeout)
+{
+	struct epoll_event ev[EVLOOP_MAX_EVENTS];
+	struct evloop *outer = evloop_running;
+	int n;
+	int i;
+
+	n = epoll_wait(loop->epfd, ev, EVLOOP_MAX_EVENTS, timeout);
+	if (n == -1) {
+		if (errno == EINTR)
+			return 0;
+		return -errno;
+	}
+
+	evloop_running = loop;
+	for (i = 0; i < n; ++i) {
+		struct evloop_watch *w = ev[i].data.ptr;
+
+		/* skip watches that were removed by an earlier callback */
+		if (!w->cb)
+			continue;
+		if (w->timer) {
+			uint64_t expired;
+			if (read(w->fd, &expired, sizeof(expired)) != sizeof(expired))
+				continue;
+		}
+		w->cb(w, ev[i].events, w->arg);
+	}
+	if (loop->round)
+		loop->round(loop, loop->round_arg);
+	evloop_running = outer;
+	evloop_release_dead(loop);
+
+	return n;
+}
@@ -0,0 +1,75 @@
+#ifndef OBEXPUSHD_EVLOOP_H
+#define OBEXPUSHD_EVLOOP_H
+
+#include <inttypes.h>
+#include <sys/epoll.h>
+
+struct evloop;
+struct evloop_watch;
+
+/** Called when a watched file descriptor is ready
+ *
+ * @param w the watch that triggered
+ * @param events the pending EPOLL* event bits
+ * @param arg the argument that was given to evloop_add()
+ */
+typedef void (*evloop_cb_t)(struct evloop_watch *w, uint32_t events, void *arg);
+typedef void (*evloop_round_t)(struct evloop *loop, void *arg);
+
+struct evloop* evloop_new (void);
+void evloop_destroy (struct evloop *loop);
+
+/** Register a file descriptor once
+ *
+ * @param events EPOLL* event bits, usually EPOLLIN|EPOLLET
+ * @return the watch or NULL on error (errno is set)
+ */
+struct evloop_watch* evloop_add (struct evloop *loop, int fd, uint32_t events,
+				 evloop_cb_t cb, void *arg);
+
+/** Change the events of a watch
+ *
+ * @return 0 or a negative error number
+ */
+int evloop_mod (struct evloop_watch *w, uint32_t events);
+
+/** Unregister a watch
+ * This is safe to call from within any callback of the same loop,
+ * the watch memory is released after the current dispatch round.
+ * Call it before closing the file descriptor.
+ */
+void evloop_del (struct evloop_watch *w);
+
+/** Register a periodic timer
+ * The callback is called with EPOLLIN every interval milliseconds
+ * until the watch is removed with evloop_del().
+ * @return the watch or NULL on error (errno is set)
+ */
+struct evloop_watch* evloop_add_timer (struct evloop *loop, unsigned int interval,
+				       evloop_cb_t cb, void *arg);
+
+/** The loop that runs callbacks in the calling thread
+ * Code that is called from a callback can add its own watches here.
+ * @return the loop or NULL outside of evloop_dispatch()
+ */
+struct evloop* evloop_current (void);
+
+int evloop_watch_fd (struct evloop_watch *w);
+struct evloop* evloop_watch_loop (struct evloop_watch *w);
+
+/** Number of currently registered watches */
+unsigned int evloop_count (struct evloop *loop);
+
+/** Set a callback that ends each dispatch round
+ * It is called after the callbacks of all ready watches.
+ */
+void evloop_set_round (struct evloop *loop, evloop_round_t cb, void *arg);
+
+/** Wait for events and run the callbacks of all ready watches
+ *
+ * @param timeout in milliseconds, -1 waits forever
+ * @return number of dispatched events or a negative error number
+ */
+int evloop_dispatch (struct evloop *loop, int timeout);
+
+#endif /* OBEXPUSHD_EVLOOP_H */
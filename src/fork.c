@@ -4,43 +4,36 @@
 #include <gcrypt.h>
 #endif
 
-#ifndef SIGCLD
-#define SIGCLD SIGCHLD
-#endif
-
-int obexpushd_create_instance (void* (*cb)(void*), void *cbdata) {
-	pid_t p = fork();
-	switch (p) {
-	case 0:
-		(void)signal(SIGCHLD, SIG_DFL);
-		(void)signal(SIGINT, SIG_DFL);
-		(void)signal(SIGTERM, SIG_DFL);
-		(void)cb(cbdata);
-		exit(EXIT_SUCCESS);
+/* All listeners and all accepted clients are driven from this
+ * single edge-triggered event loop. Every ready listener is drained
+ * completely with a zero timeout before going back to epoll_wait().
+ */
+static struct sched *sched = NULL;
 
-	case -1:
-		return -errno;
-	}
+int obexpushd_add_client (file_data_t *data) {
+	int err = sched_add(sched, data);
 
-	return 0;
+	if (err)
+		client_free(data);
+	return err;
 }
 
-static void obexpushd_wait (int sig) {
-	/* pid_t pidOfChild; */
-	int status;
-	if (sig != SIGCLD)
-		return;
+static void obexpushd_listen_cb (struct evloop_watch *w, uint32_t __unused events, void *arg) {
+	struct net_data *data = arg;
+	int err;
 
-	/* pidOfChild = */wait(&status);
-	if (WIFEXITED(status))
-		fprintf(stderr, "child exited with exit code %d\n", WEXITSTATUS(status));
-	else if (WIFSIGNALED(status))
-		fprintf(stderr, "child got signal %d\n", WTERMSIG(status));
+	do {
+		err = OBEX_HandleInput(data->obex, 0);
+	} while (err > 0);
+
+	if (err < 0 && net_get_life_status(data) == LIFE_STATUS_DEAD) {
+		evloop_del(w);
+		net_cleanup(data);
+	}
 }
 
 int obexpushd_start (struct net_data *data, unsigned int count) {
 	unsigned int i;
-	(void)signal(SIGCHLD, obexpushd_wait);
 
 #if defined(USE_LIBGCRYPT)
 	(void)gcry_check_version(NULL);
@@ -48,6 +41,10 @@ int obexpushd_start (struct net_data *data, unsigned int count) {
 	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
 #endif
 
+	sched = sched_new(client_free);
+	if (!sched)
+		return -errno;
+
 	/* initialize all enabled listeners */
 	for (i = 0; i < count; ++i) {
 		int fd = -1;
@@ -56,48 +53,26 @@ int obexpushd_start (struct net_data *data, unsigned int count) {
 		net_init(&data[i], eventcb);
 		if (!data[i].obex)
 			exit(EXIT_FAILURE);
-		fd = OBEX_GetFD(data[i].obex);
+		fd = net_get_listen_fd(&data[i]);
 		if (fd == -1) {
 			perror("OBEX_GetFD()");
 			exit(EXIT_FAILURE);
 		}
+		if (!evloop_add(sched_get_loop(sched), fd, EPOLLIN | EPOLLET, obexpushd_listen_cb, &data[i])) {
+			perror("epoll_ctl()");
+			exit(EXIT_FAILURE);
+		}
 	}
-	
+
 	/* run the multiplexer */
-	do {
-		int topfd = 0;
-		fd_set fds;
-		FD_ZERO(&fds);
-		for (i = 0; i < count; ++i) {
-			if (!data[i].handler)
-				continue;
-			if (data[i].obex) {
-				int fd = OBEX_GetFD(data[i].obex);
-				if (fd == -1) {
-					perror("OBEX_GetFD()");
-					exit(EXIT_FAILURE);
-				}
-				if (fd > topfd)
-					topfd = fd;
-				FD_SET(fd, &fds);
-			}
+	while (evloop_count(sched_get_loop(sched)) > 0) {
+		int err = sched_dispatch(sched, -1);
+		if (err < 0) {
+			sched_destroy(sched);
+			return err;
 		}
-		select(topfd+1, &fds, NULL, NULL, NULL);
-		for (i = 0; i < count; ++i) {
-			int fd = -1;
-			if (!data[i].handler)
-				continue;
-			if (!data[i].obex)
-				continue;
-			fd = net_get_listen_fd(&data[i]);
-			if (FD_ISSET(fd,&fds)) {
-				if (OBEX_HandleInput(data[i].obex,1) < 0) {
-					if (net_get_life_status(&data[i]) == LIFE_STATUS_DEAD) {
-						net_cleanup(&data[i]);
-						break;
-					}
-				}
-			}
-		}			
-	} while (1);
+	}
+
+	sched_destroy(sched);
+	exit(EXIT_SUCCESS);
 }
@@ -15,6 +15,16 @@ enum io_type {
 
 #define IO_STATE_OPEN (1 << 0)
 #define IO_STATE_EOF  (1 << 1)
+/* no more data can be written until io_wait_fd() is readable */
+#define IO_STATE_BUSY (1 << 2)
+
+/* paging and filtering of a folder listing, all zero for none */
+struct io_listing_filter {
+	unsigned int offset; /* number of matching entries to skip */
+	unsigned int max;    /* maximum number of entries, 0 for all */
+	char *prefix;        /* only names starting with it */
+	time_t since;        /* only entries modified at or after it */
+};
 
 struct io_transfer_data {
 	char *peername;
@@ -24,8 +34,13 @@ struct io_transfer_data {
 	char* type;
 	size_t length;
 	time_t time;
+
+	struct io_listing_filter filter;
 };
 
+/* transfer length of a GET that is generated while it is sent */
+#define IO_LENGTH_UNKNOWN ((size_t)-1)
+
 struct io_handler;
 struct io_handler_ops {
 	struct io_handler* (*dup)(struct io_handler *self);
@@ -33,33 +48,76 @@ struct io_handler_ops {
 
 	int (*open)(struct io_handler *self, struct io_transfer_data *transfer, enum io_type t);
 	int (*close)(struct io_handler *self, struct io_transfer_data *transfer, bool keep);
+
+	/* the part of a successful close that may have to wait,
+	 * returns -EINPROGRESS until it is done, see io_finish() */
+	int (*finish)(struct io_handler *self, struct io_transfer_data *transfer);
+	int (*wait_fd)(struct io_handler *self, int *timeout);
 	int (*delete)(struct io_handler *self, struct io_transfer_data *transfer);
 	ssize_t (*read)(struct io_handler *self, void *buf, size_t bufsize);
 	ssize_t (*write)(struct io_handler *self, const void *buf, size_t len);
 
+	/* like read but returns as soon as some data is available,
+	 * needed for io_readline() and io_peek() */
+	ssize_t (*fill)(struct io_handler *self, void *buf, size_t bufsize);
+
 	int (*check_dir)(struct io_handler *self, const uint8_t *dir);
 	int (*create_dir)(struct io_handler *self, const uint8_t *dir);
+
+	/* backend specific settings, value may be NULL */
+	int (*set_option)(struct io_handler *self, const char *name, const char *value);
 };
 
+#define IO_READBUF_SIZE 4096
+
 struct io_handler {
 	struct io_handler_ops *ops;
 	unsigned long state;
 	void *private_data;
+
+	/* data from fill that was not consumed yet */
+	uint8_t *rbuf;
+	size_t rbuf_pos;
+	size_t rbuf_len;
 };
 
 struct io_handler* io_script_init(const char *script);
 struct io_handler* io_file_init(const char *basedir);
+#if defined(USE_THREADS)
+struct io_handler* io_writebehind_init(struct io_handler *inner, size_t size);
+#endif
 struct io_handler* io_dup (struct io_handler *h);
 void io_destroy (struct io_handler *h);
 
 unsigned long io_state(struct io_handler *self);
 int io_open (struct io_handler *self, struct io_transfer_data *transfer, enum io_type t);
 int io_close (struct io_handler *self, struct io_transfer_data *transfer, bool keep);
+
+/** Complete a transfer without waiting
+ * This may be called before io_close() with keep set. io_close()
+ * does everything itself, but it may block on the way.
+ * @return 0, a negative error number or -EINPROGRESS if it must be
+ *         called again when io_wait_fd() says so
+ */
+int io_finish (struct io_handler *self, struct io_transfer_data *transfer);
+
+/** What to wait for after -EINPROGRESS or IO_STATE_BUSY
+ * @param timeout set to the milliseconds until trying again anyway,
+ *        -1 for no limit
+ * @return a file descriptor that gets readable or -1 for none
+ */
+int io_wait_fd (struct io_handler *self, int *timeout);
 int io_delete(struct io_handler *self, struct io_transfer_data *transfer);
 ssize_t io_readline(struct io_handler *self, void *buf, size_t bufsize);
+ssize_t io_peek(struct io_handler *self, void *buf, size_t bufsize);
+ssize_t io_fill(struct io_handler *self, void *buf, size_t bufsize);
 ssize_t io_read(struct io_handler *self, void *buf, size_t bufsize);
 ssize_t io_write(struct io_handler *self, const void *buf, size_t len);
 int io_check_dir(struct io_handler *self, const uint8_t *dir);
 int io_create_dir(struct io_handler *self, const uint8_t *dir);
+int io_set_option(struct io_handler *self, const char *name, const char *value);
+
+/* parses a number with optional k or M suffix */
+int io_parse_size(const char *value, size_t *size);
 
 #endif /* OBEXPUSH_IO_H */
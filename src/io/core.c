@@ -35,8 +35,11 @@ struct io_handler * io_dup (
 	} else {
 		/* flat copy */
 		struct io_handler *hnew = malloc(sizeof(*hnew));
-		if (hnew)
+		if (hnew) {
 			memcpy(hnew, h, sizeof(*hnew));
+			hnew->rbuf = NULL;
+			hnew->rbuf_pos = hnew->rbuf_len = 0;
+		}
 		return hnew;
 	}
 }
@@ -46,6 +49,7 @@ void io_destroy (struct io_handler* h)
 	if (h) {
 		if (h->ops && h->ops->cleanup)
 			h->ops->cleanup(h);
+		free(h->rbuf);
 		free(h);
 	}
 }
@@ -69,6 +73,8 @@ int io_open (
 	if (!self)
 		return -EBADF;
 
+	/* drop buffered data of the previous transfer */
+	self->rbuf_pos = self->rbuf_len = 0;
 	if (self->ops && self->ops->open)
 		return self->ops->open(self, transfer, t);
 	else
@@ -84,12 +90,39 @@ int io_close (
 	if (!self)
 		return -EBADF;
 
+	self->rbuf_pos = self->rbuf_len = 0;
 	if (self->ops && self->ops->close)
 		return self->ops->close(self, transfer, keep);
 	else
 		return 0;
 }
 
+int io_finish (
+	struct io_handler *self,
+	struct io_transfer_data *transfer
+)
+{
+	if (!self)
+		return -EBADF;
+
+	if (self->ops && self->ops->finish)
+		return self->ops->finish(self, transfer);
+	else
+		return 0;
+}
+
+int io_wait_fd (
+	struct io_handler *self,
+	int *timeout
+)
+{
+	*timeout = -1;
+	if (self && self->ops && self->ops->wait_fd)
+		return self->ops->wait_fd(self, timeout);
+	else
+		return -1;
+}
+
 int io_delete (
 	struct io_handler *self,
 	struct io_transfer_data *transfer
@@ -104,14 +137,100 @@ int io_delete (
 		return 0;
 }
 
-ssize_t io_readline(struct io_handler *self, void *buf, size_t bufsize) {
-	ssize_t retval = 0;
-	ssize_t err;
-	char *cbuf = buf;
+ssize_t io_fill(
+	struct io_handler *self,
+	void *buf,
+	size_t bufsize
+)
+{
+	if (!self)
+		return -EBADF;
 
 	if (bufsize == 0)
 		return 0;
 
+	if (self->ops && self->ops->fill)
+		return self->ops->fill(self, buf, bufsize);
+	else
+		return -ENOTSUP;
+}
+
+/* Get more data into the read buffer,
+ * returns 0 at end of data */
+static ssize_t io_buffer_fill (struct io_handler *self)
+{
+	ssize_t err;
+
+	if (!self->rbuf) {
+		self->rbuf = malloc(IO_READBUF_SIZE);
+		if (!self->rbuf)
+			return -errno;
+		self->rbuf_pos = self->rbuf_len = 0;
+	}
+
+	if (self->rbuf_pos == self->rbuf_len)
+		self->rbuf_pos = self->rbuf_len = 0;
+	else if (self->rbuf_len == IO_READBUF_SIZE) {
+		if (self->rbuf_pos == 0)
+			return -ENOBUFS;
+		memmove(self->rbuf, self->rbuf + self->rbuf_pos,
+			self->rbuf_len - self->rbuf_pos);
+		self->rbuf_len -= self->rbuf_pos;
+		self->rbuf_pos = 0;
+	}
+
+	err = io_fill(self, self->rbuf + self->rbuf_len,
+		      IO_READBUF_SIZE - self->rbuf_len);
+	if (err > 0)
+		self->rbuf_len += err;
+
+	return err;
+}
+
+/* take up to bufsize bytes from the read buffer */
+static size_t io_buffer_take (struct io_handler *self, void *buf, size_t bufsize)
+{
+	size_t n = self->rbuf_len - self->rbuf_pos;
+
+	if (n > bufsize)
+		n = bufsize;
+	memcpy(buf, self->rbuf + self->rbuf_pos, n);
+	self->rbuf_pos += n;
+
+	return n;
+}
+
+ssize_t io_peek(
+	struct io_handler *self,
+	void *buf,
+	size_t bufsize
+)
+{
+	size_t n;
+
+	if (!self)
+		return -EBADF;
+
+	if (!self->rbuf || self->rbuf_pos == self->rbuf_len) {
+		ssize_t err = io_buffer_fill(self);
+		if (err <= 0)
+			return err;
+	}
+
+	n = self->rbuf_len - self->rbuf_pos;
+	if (n > bufsize)
+		n = bufsize;
+	memcpy(buf, self->rbuf + self->rbuf_pos, n);
+
+	return n;
+}
+
+/* reads a line byte by byte for handlers without a fill function */
+static ssize_t io_readline_slow(struct io_handler *self, void *buf, size_t bufsize) {
+	ssize_t retval = 0;
+	ssize_t err;
+	char *cbuf = buf;
+
 	do {
 		char tmp;
 
@@ -127,6 +246,49 @@ ssize_t io_readline(struct io_handler *self, void *buf, size_t bufsize) {
 	return retval;
 }
 
+ssize_t io_readline(struct io_handler *self, void *buf, size_t bufsize) {
+	uint8_t *cbuf = buf;
+	size_t total = 0;
+
+	if (!self)
+		return -EBADF;
+
+	if (bufsize == 0)
+		return 0;
+
+	if (!self->ops || !self->ops->fill)
+		return io_readline_slow(self, buf, bufsize);
+
+	while (total < bufsize) {
+		size_t n = (self->rbuf? self->rbuf_len - self->rbuf_pos: 0);
+		uint8_t *eol;
+
+		if (n == 0) {
+			ssize_t err = io_buffer_fill(self);
+
+			/* e.g. a wrapper around a handler without fill */
+			if (err == -ENOTSUP && total == 0)
+				return io_readline_slow(self, buf, bufsize);
+			if (err < 0)
+				return (total? (ssize_t)total: err);
+			if (err == 0)
+				break;
+			continue;
+		}
+
+		if (n > bufsize - total)
+			n = bufsize - total;
+		eol = memchr(self->rbuf + self->rbuf_pos, '\n', n);
+		if (eol)
+			n = eol - (self->rbuf + self->rbuf_pos) + 1;
+		total += io_buffer_take(self, cbuf + total, n);
+		if (eol)
+			break;
+	}
+
+	return total;
+}
+
 ssize_t io_read(
 	struct io_handler *self,
 	void *buf,
@@ -139,6 +301,20 @@ ssize_t io_read(
 	if (bufsize == 0)
 		return 0;
 
+	/* data from io_readline() or io_peek() comes first */
+	if (self->rbuf && self->rbuf_pos < self->rbuf_len) {
+		size_t n = io_buffer_take(self, buf, bufsize);
+
+		if (n < bufsize && self->ops && self->ops->read &&
+		    !(self->state & IO_STATE_EOF))
+		{
+			ssize_t err = self->ops->read(self, (uint8_t*)buf + n, bufsize - n);
+			if (err > 0)
+				n += err;
+		}
+		return n;
+	}
+
 	if (self->ops && self->ops->read)
 		return self->ops->read(self, buf, bufsize);
 	else
@@ -190,3 +366,56 @@ int io_create_dir(
 	else
 		return -EFAULT;
 }
+
+int io_set_option(
+	struct io_handler *self,
+	const char *name,
+	const char *value
+)
+{
+	if (!self)
+		return -EBADF;
+
+	if (self->ops && self->ops->set_option)
+		return self->ops->set_option(self, name, value);
+	else
+		return -ENOTSUP;
+}
+
+int io_parse_size(
+	const char *value,
+	size_t *size
+)
+{
+	char *end = NULL;
+	unsigned long long n;
+	unsigned int shift = 0;
+
+	if (!value || *value == '-')
+		return -EINVAL;
+
+	errno = 0;
+	n = strtoull(value, &end, 10);
+	if (errno == ERANGE)
+		return -ERANGE;
+	switch (*end) {
+	case 'k':
+	case 'K':
+		shift = 10;
+		++end;
+		break;
+
+	case 'm':
+	case 'M':
+		shift = 20;
+		++end;
+		break;
+	}
+	if (end == value || *end != 0)
+		return -EINVAL;
+	if (n > (SIZE_MAX >> shift))
+		return -ERANGE;
+
+	*size = (size_t)n << shift;
+	return 0;
+}
@@ -1,7 +1,7 @@
 
 #include "common.h"
 #include "caps.h"
-#include "closexec.h"
+#include "dircache.h"
 #include "x-obex/obex-capability.h"
 
 #include <stdbool.h>
@@ -14,6 +14,10 @@
 #include <errno.h>
 #include <libgen.h>
 #include <unistd.h>
+#include <time.h>
+#if defined(USE_THREADS)
+#include <pthread.h>
+#endif
 
 static struct obex_capability caps = {
 	.general = {
@@ -47,12 +51,29 @@ static bool ismount (const char* path)
 	return result;
 }
 
-static bool set_memory_capability(const char *tpath, struct obex_caps_mem *mem)
+/* walk up the path until it is a mount point or our root,
+ * returns the result that must be freed */
+static char* find_mount (const char *tpath)
 {
-	bool result = false;
-	struct statvfs meminfo;
 	char *p = strdup(tpath);
 	char *path = p;
+	char *mount;
+
+	if (!p)
+		return NULL;
+
+	while (strcmp(path, ".") != 0 && !ismount(path))
+		path = dirname(path);
+
+	mount = strdup(path);
+	free(p);
+	return mount;
+}
+
+static bool set_memory_capability(const char *path, struct obex_caps_mem *mem)
+{
+	bool result = false;
+	struct statvfs meminfo;
 
 	memset(mem, 0, sizeof(*mem));
 	mem->file.size_max = ULONG_MAX;
@@ -61,10 +82,6 @@ static bool set_memory_capability(const char *tpath, struct obex_caps_mem *mem)
 	if (!path)
 		return false;
 
-	/* walk up the path until it is a mount point or our root */
-	while (strcmp(path, ".") != 0 && !ismount(path))
-		path = dirname(path);
-
 	if (statvfs(path, &meminfo) == 0)
 	{
 		if (strlen(path) &&
@@ -83,9 +100,6 @@ static bool set_memory_capability(const char *tpath, struct obex_caps_mem *mem)
 		result = true;
 	}
 
-	if (p)
-		free(p);
-
 	return result;
 }
 
@@ -96,35 +110,180 @@ static void clear_memory_capability(struct obex_caps_mem *mem)
 	mem->location = 0;
 }
 
-int io_internal_caps_open (struct io_handler *self,
-			   struct io_transfer_data *transfer,
-			   const char *name)
+/* Cache of capability documents:
+ * Everything but the memory element is written only once. The
+ * document for a directory is kept and only the memory element is
+ * written again when it is older than IO_CAPS_REFRESH seconds, so
+ * usually a request only takes a reference to the cached document.
+ */
+#define IO_CAPS_ENTRIES 16
+#define IO_CAPS_REFRESH 5
+
+struct io_caps_entry {
+	char *name;
+	char *mount;
+	time_t time;
+	unsigned long used;
+	struct io_internal_listing *doc;
+};
+
+static char *io_caps_head = NULL;
+static size_t io_caps_head_len = 0;
+static char *io_caps_tail = NULL;
+static size_t io_caps_tail_len = 0;
+static struct io_caps_entry io_caps_cache[IO_CAPS_ENTRIES];
+static unsigned long io_caps_clock = 0;
+
+#if defined(USE_THREADS)
+static pthread_mutex_t io_caps_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define io_caps_lock() pthread_mutex_lock(&io_caps_mutex)
+#define io_caps_unlock() pthread_mutex_unlock(&io_caps_mutex)
+#else
+#define io_caps_lock() do {} while (0)
+#define io_caps_unlock() do {} while (0)
+#endif
+
+/* must be called with the cache locked */
+static int io_caps_render_static (void)
 {
-	struct io_internal_data *data = self->private_data;
-	struct obex_caps_mem caps_mem;
+	FILE *f;
 	int err = 0;
 
-	data->in = tmpfile();
-	if (data->in == NULL)
-		return -errno;;
-	set_closexec_flag(fileno(data->in));
+	if (io_caps_tail)
+		return 0;
 
-	if (set_memory_capability(name, &caps_mem))
-	{
-		caps.general.mem = &caps_mem;
-		caps.general.mem_count = 1;
+	f = open_memstream(&io_caps_head, &io_caps_head_len);
+	if (!f)
+		return -errno;
+	err = obex_capability_head(f, &caps);
+	if (fclose(f) == EOF && !err)
+		err = -errno;
+
+	if (!err) {
+		f = open_memstream(&io_caps_tail, &io_caps_tail_len);
+		if (!f)
+			return -errno;
+		err = obex_capability_tail(f, &caps);
+		if (fclose(f) == EOF && !err)
+			err = -errno;
+	}
+
+	if (err) {
+		free(io_caps_head);
+		io_caps_head = NULL;
+		free(io_caps_tail);
+		io_caps_tail = NULL;
 	}
+	return err;
+}
+
+/* must be called with the cache locked */
+static int io_caps_render (struct io_caps_entry *e, time_t now)
+{
+	struct obex_caps_mem caps_mem;
+	struct io_internal_listing *doc;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+	int err = 0;
 
-	err = obex_capability(data->in, &caps);
+	f = open_memstream(&buf, &len);
+	if (f == NULL)
+		return -errno;
 
-	caps.general.mem = NULL;
-	caps.general.mem_count = 0;
+	if (fwrite(io_caps_head, io_caps_head_len, 1, f) != 1)
+		err = -errno;
+	if (!err && set_memory_capability(e->mount, &caps_mem))
+		obex_capability_mem(f, &caps_mem);
 	clear_memory_capability(&caps_mem);
+	if (!err && fwrite(io_caps_tail, io_caps_tail_len, 1, f) != 1)
+		err = -errno;
+	if (fclose(f) == EOF && !err)
+		err = -errno;
+	if (err) {
+		free(buf);
+		return err;
+	}
+
+	/* the document is not a listing, only the buffer handling is shared */
+	doc = io_internal_dircache_put(NULL, 0, 0, buf, len, 0);
+	if (!doc)
+		return -errno;
+	if (e->doc)
+		io_internal_dircache_release(e->doc);
+	e->doc = doc;
+	e->time = now;
+
+	return 0;
+}
+
+/* must be called with the cache locked */
+static struct io_caps_entry* io_caps_get (const char *name)
+{
+	struct io_caps_entry *e = NULL;
+	unsigned int i;
+
+	for (i = 0; i < IO_CAPS_ENTRIES; ++i) {
+		struct io_caps_entry *c = &io_caps_cache[i];
+
+		if (c->name && strcmp(c->name, name) == 0)
+			return c;
+		if (!e || !c->name || (e->name && c->used < e->used))
+			e = c;
+	}
 
+	/* replace the least recently used one */
+	if (e->doc)
+		io_internal_dircache_release(e->doc);
+	free(e->name);
+	free(e->mount);
+	memset(e, 0, sizeof(*e));
+
+	e->name = strdup(name);
+	if (e->name)
+		e->mount = find_mount(name);
+	if (!e->mount) {
+		free(e->name);
+		e->name = NULL;
+		return NULL;
+	}
+	return e;
+}
+
+int io_internal_caps_open (struct io_handler *self,
+			   struct io_transfer_data *transfer,
+			   const char *name)
+{
+	struct io_internal_data *data = self->private_data;
+	struct io_caps_entry *e;
+	time_t now = time(NULL);
+	int err;
+
+	io_caps_lock();
+	err = io_caps_render_static();
+	if (!err) {
+		e = io_caps_get(name);
+		if (!e)
+			err = -errno;
+	}
+	if (!err && (!e->doc || now - e->time >= IO_CAPS_REFRESH || now < e->time)) {
+		err = io_caps_render(e, now);
+		/* an older document is still good enough */
+		if (err && e->doc)
+			err = 0;
+	}
+	if (!err) {
+		e->used = ++io_caps_clock;
+		data->listing = io_internal_dircache_ref(e->doc);
+	}
+	io_caps_unlock();
 	if (err)
-		return err;;
+		return err;
+
+	data->in = fmemopen(data->listing->buf, data->listing->len, "r");
+	if (data->in == NULL)
+		return -errno;
 
-	transfer->length = ftell(data->in);
-	(void)fseek(data->in, 0L, SEEK_SET);
+	transfer->length = data->listing->len;
 	return 0;
 }
@@ -21,6 +21,9 @@
 #include "file.h"
 #include "dir.h"
 #include "caps.h"
+#include "dircache.h"
+#include "uring.h"
+#include "groupsync.h"
 
 #include <unistd.h>
 #include <errno.h>
@@ -35,6 +38,7 @@
 #include "io.h"
 #include "utf.h"
 #include "net.h"
+#include "compiler.h"
 
 char* io_internal_get_fullname(const char *basedir, const uint8_t *subdir,
 			       const uint8_t *namebase)
@@ -102,31 +106,109 @@ static int io_internal_close (struct io_handler *self,
 			return -errno;
 		data->in = NULL;
 	}
+	if (data->listing) {
+		io_internal_dircache_release(data->listing);
+		data->listing = NULL;
+	}
 
-	if (data->out) {
-		if (fclose(data->out) == EOF)
+	if (data->in_fd != -1) {
+#if defined(USE_LIBURING)
+		(void)io_internal_uring_stop(data);
+#endif
+		if (close(data->in_fd) == -1)
 			return -errno;
-		data->out = NULL;
+		data->in_fd = -1;
+	}
+
+	if (data->out_fd != -1) {
+		int done = data->out_done;
+		int err = 0;
+		int status;
+
+		if (data->group) {
+			/* the group sync from io_finish() is still running */
+			if (keep)
+				err = io_internal_file_synced(self, true);
+			done = 1;
+		} else if (!done) {
+			err = io_internal_file_finish(self);
+		}
 
 		if (transfer) {
 			char *name = io_internal_get_fullname(data->basedir,
 							      transfer->path,
 							      transfer->name);
-			if (!name)
-				return -errno;
-
-			if (!keep)
+			if (!name && !err)
+				err = -errno;
+
+			if (name && keep && !err && !done) {
+				err = io_internal_file_commit(self, transfer, name);
+				if (err == -EINPROGRESS)
+					err = io_internal_file_synced(self, true);
+			}
+			/* an unnamed file simply vanishes on release */
+			if (name && (!keep || err) && !data->out_tmp)
 				io_internal_file_delete(self, name);
-			else 
-				io_internal_file_close(self, transfer, name);
 			free(name);
 		}
+		status = io_internal_file_release(self);
+		if (!err)
+			err = status;
+		if (err) {
+			self->state = 0;
+			return err;
+		}
 	}
 	self->state = 0;
 
 	return 0;
 }
 
+static int io_internal_finish (struct io_handler *self,
+			       struct io_transfer_data *transfer)
+{
+	struct io_internal_data *data = self->private_data;
+	char *name;
+	int err;
+
+	if (data->out_fd == -1 || !transfer)
+		return 0;
+
+	/* called again after -EINPROGRESS */
+	if (data->group) {
+		err = io_internal_file_synced(self, false);
+		if (err == 0)
+			data->out_done = 1;
+		return err;
+	}
+	if (data->out_done)
+		return 0;
+
+	err = io_internal_file_finish(self);
+	if (err)
+		return err;
+
+	name = io_internal_get_fullname(data->basedir, transfer->path, transfer->name);
+	if (!name)
+		return -errno;
+	err = io_internal_file_commit(self, transfer, name);
+	free(name);
+	if (err == 0)
+		data->out_done = 1;
+
+	return err;
+}
+
+static int io_internal_wait_fd (struct io_handler *self, int __unused *timeout)
+{
+	struct io_internal_data *data = self->private_data;
+
+	if (data->group)
+		return io_internal_group_fd(data->group);
+	else
+		return -1;
+}
+
 static int io_internal_open (struct io_handler *self,
 			     struct io_transfer_data *transfer,
 			     enum io_type t)
@@ -169,7 +251,8 @@ static int io_internal_open (struct io_handler *self,
 
 	free(name);
 	if (err) {
-		(void)io_internal_close(self, transfer, (err != -EEXIST));
+		/* never leave a partially created file behind */
+		(void)io_internal_close(self, transfer, false);
 	} else {
 		self->state |= IO_STATE_OPEN;
 	}
@@ -188,8 +271,83 @@ static void io_internal_cleanup (struct io_handler *self)
 static struct io_handler* io_internal_dup(struct io_handler *self)
 {
 	struct io_internal_data *data = self->private_data;
+	struct io_handler *h = io_file_init(data->basedir);
+
+	if (h) {
+		struct io_internal_data *newdata = h->private_data;
+		newdata->opts = data->opts;
+	}
+	return h;
+}
+
+static int io_internal_set_option (struct io_handler *self,
+				   const char *name, const char *value)
+{
+	struct io_internal_data *data = self->private_data;
+
+	if (strcmp(name, "bufsize") == 0) {
+		size_t size;
+		int err = io_parse_size(value, &size);
+
+		if (err)
+			return err;
+		if (size < IO_INTERNAL_ALIGN || size > (64 << 20))
+			return -ERANGE;
+		/* round up to the alignment */
+		size = (size + IO_INTERNAL_ALIGN - 1) & ~((size_t)IO_INTERNAL_ALIGN - 1);
+		data->opts.bufsize = size;
+
+	} else if (strcmp(name, "direct") == 0) {
+		data->opts.direct = (!value || strcmp(value, "0") != 0);
+
+	} else if (strcmp(name, "tmpfile") == 0) {
+		data->opts.tmpfile = (!value || strcmp(value, "0") != 0);
+
+	} else if (strcmp(name, "sync") == 0) {
+		if (!value)
+			return -EINVAL;
+		if (strcmp(value, "none") == 0)
+			data->opts.sync = IO_INTERNAL_SYNC_NONE;
+		else if (strcmp(value, "file") == 0)
+			data->opts.sync = IO_INTERNAL_SYNC_FILE;
+		else if (strcmp(value, "group") == 0)
+			data->opts.sync = IO_INTERNAL_SYNC_GROUP;
+		else
+			return -EINVAL;
+
+	} else if (strcmp(name, "syncwindow") == 0) {
+		char *end = NULL;
+		unsigned long ms;
+
+		if (!value)
+			return -EINVAL;
+		ms = strtoul(value, &end, 10);
+		if (end == value || *end != 0)
+			return -EINVAL;
+		if (ms > 1000)
+			return -ERANGE;
+		data->opts.sync_window = ms;
+
+	} else if (strcmp(name, "listcache") == 0) {
+		data->opts.listcache = (!value || strcmp(value, "0") != 0);
+
+	} else if (strcmp(name, "engine") == 0) {
+		if (!value)
+			return -EINVAL;
+		if (strcmp(value, "sync") == 0)
+			data->opts.engine = IO_INTERNAL_ENGINE_SYNC;
+#if defined(USE_LIBURING)
+		else if (strcmp(value, "uring") == 0)
+			data->opts.engine = IO_INTERNAL_ENGINE_URING;
+#endif
+		else
+			return -ENOTSUP;
 
-	return io_file_init(data->basedir);
+	} else {
+		return -ENOTSUP;
+	}
+
+	return 0;
 }
 
 static struct io_handler_ops io_file_ops = {
@@ -198,12 +356,16 @@ static struct io_handler_ops io_file_ops = {
 
 	.open = io_internal_open,
 	.close = io_internal_close,
+	.finish = io_internal_finish,
+	.wait_fd = io_internal_wait_fd,
 	.delete = io_internal_delete,
 	.read = io_internal_file_read,
 	.write = io_internal_file_write,
 
 	.check_dir = io_internal_dir_check,
 	.create_dir = io_internal_dir_create,
+
+	.set_option = io_internal_set_option,
 };
 
 struct io_handler * io_file_init(const char *basedir) {
@@ -225,6 +387,12 @@ struct io_handler * io_file_init(const char *basedir) {
 	if (!data)
 		goto out_err;
 	memset(data, 0, sizeof(*data));
+	data->in_fd = -1;
+	data->out_fd = -1;
+	data->opts.bufsize = IO_INTERNAL_BUFSIZE;
+	data->opts.tmpfile = 1;
+	data->opts.sync_window = IO_INTERNAL_SYNC_WINDOW;
+	data->opts.listcache = 1;
 	data->basedir = strdup(basedir);
 	if (!data->basedir)
 		goto out_err;
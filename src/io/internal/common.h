@@ -2,11 +2,66 @@
 #include <stdio.h>
 #include <inttypes.h>
 
+#include <sys/types.h>
+
+/* default size of the write buffer and the alignment for O_DIRECT */
+#define IO_INTERNAL_BUFSIZE (256 * 1024)
+#define IO_INTERNAL_ALIGN   4096
+
+enum io_internal_engine {
+	IO_INTERNAL_ENGINE_SYNC = 0, /* plain read() and pwrite() */
+	IO_INTERNAL_ENGINE_URING,    /* see uring.c */
+};
+
+enum io_internal_sync {
+	IO_INTERNAL_SYNC_NONE = 0, /* leave it to the kernel */
+	IO_INTERNAL_SYNC_FILE,     /* fdatasync() each file before it gets its name */
+	IO_INTERNAL_SYNC_GROUP,    /* share syncs between clients, see groupsync.c */
+};
+
+/* default time in milliseconds to collect files for a group commit */
+#define IO_INTERNAL_SYNC_WINDOW 5
+
+/* settings from io_set_option(), copied to each duplicate */
+struct io_internal_options {
+	size_t bufsize; /* size of the write buffer */
+	int direct;     /* bypass the page cache when writing */
+	int tmpfile;    /* write to an unnamed file until the transfer is complete */
+	enum io_internal_engine engine;
+	enum io_internal_sync sync;
+	unsigned int sync_window; /* milliseconds */
+	int listcache;  /* keep folder listings in memory, see dircache.c */
+};
+
+struct io_internal_uring;
+struct io_internal_listing;
+struct io_group_member;
+
 struct io_internal_data {
 	char *basedir;
+	struct io_internal_options opts;
 
 	FILE *in;
-	FILE *out;
+	/* the document that is read through in, may be NULL */
+	struct io_internal_listing *listing;
+
+	/* regular files are read without stdio buffering */
+	int in_fd;
+
+	/* received files are written in large blocks */
+	int out_fd;
+	uint8_t *out_buf;
+	size_t out_len;
+	off_t out_pos;
+	int out_tmp; /* out_fd does not have its name yet */
+	char *out_tmpname; /* hidden name of out_fd until then, may be NULL */
+	int out_done; /* out_fd was committed by io_finish() */
+
+	/* pending group sync of out_fd, may be NULL */
+	struct io_group_member *group;
+
+	/* pending requests of the io_uring engine, may be NULL */
+	struct io_internal_uring *uring;
 };
 
 char* io_internal_get_fullname(const char *basedir, const uint8_t *subdir,
@@ -1,45 +1,247 @@
 
 #include "common.h"
 #include "dir.h"
-#include "closexec.h"
+#include "dircache.h"
 #include "utf.h"
 #include "x-obex/obex-folder-listing.h"
 
+#include <sys/stat.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
-int io_internal_dir_open(struct io_handler *self,
-			 struct io_transfer_data *transfer,
-			 char *name)
+/* number of directory entries that are listed at once */
+#define IO_INTERNAL_DIR_STEP 64
+
+/* A listing that is generated while it is sent. The document is
+ * collected in memory, so it can go to the cache when it is complete.
+ */
+struct io_internal_dirgen {
+	struct obex_folder_listing *gen;
+	FILE *out;
+	char *buf;
+	size_t len;
+	size_t pos;
+
+	char *name;
+	int flags;
+	unsigned long seq;
+	time_t time;
+	struct io_internal_listing *listing; /* owns buf when set */
+};
+
+static ssize_t io_internal_dirgen_read (void *cookie, char *buf, size_t size)
 {
-	struct io_internal_data *data = self->private_data;
-	int flags = OFL_FLAG_TIMES | OFL_FLAG_PERMS | OFL_FLAG_KEEP;
+	struct io_internal_dirgen *g = cookie;
+	size_t n;
+
+	while (g->pos == g->len && g->gen) {
+		if (obex_folder_listing_step(g->gen, g->out, IO_INTERNAL_DIR_STEP)) {
+			if (fflush(g->out) == EOF)
+				return -1;
+			continue;
+		}
+
+		obex_folder_listing_close(g->gen);
+		g->gen = NULL;
+		if (fclose(g->out) == EOF) {
+			g->out = NULL;
+			return -1;
+		}
+		g->out = NULL;
+		g->listing = io_internal_dircache_put(g->name, g->flags, g->seq,
+						      g->buf, g->len, g->time);
+		/* the cache is done with it either way */
+		g->seq = 0;
+		if (!g->listing) {
+			/* already freed */
+			g->buf = NULL;
+			g->len = 0;
+			return -1;
+		}
+	}
+
+	n = g->len - g->pos;
+	if (n > size)
+		n = size;
+	memcpy(buf, g->buf + g->pos, n);
+	g->pos += n;
+
+	return n;
+}
+
+static int io_internal_dirgen_close (void *cookie)
+{
+	struct io_internal_dirgen *g = cookie;
+
+	if (g->gen)
+		obex_folder_listing_close(g->gen);
+	if (g->out)
+		(void)fclose(g->out);
+	if (g->listing)
+		io_internal_dircache_release(g->listing);
+	else
+		free(g->buf);
+	/* the stream ended before the listing was complete */
+	if (g->name)
+		io_internal_dircache_abort(g->name, g->seq);
+	free(g->name);
+	free(g);
+
+	return 0;
+}
+
+static int io_internal_dir_stream (struct io_internal_data *data,
+				   struct io_transfer_data *transfer,
+				   char *name, int flags, unsigned long seq)
+{
+	cookie_io_functions_t fn = {
+		.read = io_internal_dirgen_read,
+		.close = io_internal_dirgen_close,
+	};
+	struct io_internal_dirgen *g;
 	struct stat s;
 	int err = 0;
 
-	data->in = tmpfile();
+	/* stating dir to get last modification time */
+	if (stat(name, &s) == -1) {
+		err = -errno;
+		io_internal_dircache_abort(name, seq);
+		return err;
+	}
+
+	g = calloc(1, sizeof(*g));
+	if (!g) {
+		err = -errno;
+		io_internal_dircache_abort(name, seq);
+		return err;
+	}
+	g->flags = flags;
+	g->seq = seq;
+	g->time = s.st_mtime;
+	g->name = strdup(name);
+	if (!g->name)
+		io_internal_dircache_abort(name, seq);
+	else
+		g->gen = obex_folder_listing_open(name, flags);
+	if (g->gen)
+		g->out = open_memstream(&g->buf, &g->len);
+	if (g->out)
+		data->in = fopencookie(g, "r", fn);
+	if (!data->in) {
+		err = -errno;
+		(void)io_internal_dirgen_close(g);
+		return err;
+	}
+
+	transfer->length = IO_LENGTH_UNKNOWN;
+	transfer->time = s.st_mtime;
+
+	return 0;
+}
+
+/* A page of the listing from the sorted index of the directory,
+ * the index is cached like a complete listing.
+ */
+static int io_internal_dir_filtered (struct io_internal_data *data,
+				     struct io_transfer_data *transfer,
+				     char *name, int flags)
+{
+	struct obex_folder_filter filter = {
+		.offset = transfer->filter.offset,
+		.max = transfer->filter.max,
+		.prefix = transfer->filter.prefix,
+		.since = transfer->filter.since,
+	};
+	struct io_internal_listing *l = NULL;
+	unsigned long seq = 0;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+	int err;
+
+	flags |= IO_INTERNAL_DIRCACHE_INDEX;
+	if (data->opts.listcache)
+		l = io_internal_dircache_get(name, flags, &seq);
+	if (!l) {
+		struct obex_folder_index *index;
+		struct stat s;
+
+		if (stat(name, &s) == -1) {
+			err = -errno;
+			io_internal_dircache_abort(name, seq);
+			return err;
+		}
+		index = obex_folder_index_new(name, flags & ~IO_INTERNAL_DIRCACHE_INDEX);
+		if (!index) {
+			err = -errno;
+			io_internal_dircache_abort(name, seq);
+			return err;
+		}
+		l = io_internal_dircache_put_index(name, flags, seq, index, s.st_mtime);
+		if (!l)
+			return -errno;
+	}
+
+	f = open_memstream(&buf, &len);
+	if (!f) {
+		err = -errno;
+		io_internal_dircache_release(l);
+		return err;
+	}
+	err = obex_folder_listing_index(f, l->index, &filter);
+	if (fclose(f) == EOF && !err)
+		err = -errno;
+	transfer->time = l->time;
+	io_internal_dircache_release(l);
+	if (err) {
+		free(buf);
+		return err;
+	}
+
+	data->listing = io_internal_dircache_put(NULL, 0, 0, buf, len, 0);
+	if (!data->listing)
+		return -errno;
+	data->in = fmemopen(buf, len, "r");
 	if (data->in == NULL)
 		return -errno;
-	set_closexec_flag(fileno(data->in));
+	transfer->length = len;
 
+	return 0;
+}
+
+int io_internal_dir_open(struct io_handler *self,
+			 struct io_transfer_data *transfer,
+			 char *name)
+{
+	struct io_internal_data *data = self->private_data;
+	int flags = OFL_FLAG_TIMES | OFL_FLAG_PERMS | OFL_FLAG_KEEP;
+	struct io_internal_listing *l = NULL;
+	unsigned long seq = 0;
 
 	if (utf8len((uint8_t*)transfer->path))
 		flags |= OFL_FLAG_PARENT;
-	err = obex_folder_listing(data->in, name, flags);
-	if (err)
-		return err;
 
-	/* stating dir to get last modification time */
-	if (fstat(err, &s) == -1)
-		return -errno;
+	if (transfer->filter.offset || transfer->filter.max ||
+	    transfer->filter.prefix || transfer->filter.since)
+		return io_internal_dir_filtered(data, transfer, name, flags);
 
-	transfer->length = ftell(data->in);
-	transfer->time = s.st_mtime;
+	if (data->opts.listcache)
+		l = io_internal_dircache_get(name, flags, &seq);
+	if (!l)
+		return io_internal_dir_stream(data, transfer, name, flags, seq);
 
-	/* rewinding to start of file */
-	(void)fseek(data->in, 0L, SEEK_SET);
+	/* served from memory, the length is known */
+	data->listing = l;
 
-	return err;
+	data->in = fmemopen(l->buf, l->len, "r");
+	if (data->in == NULL)
+		return -errno;
+
+	transfer->length = l->len;
+	transfer->time = l->time;
+
+	return 0;
 }
 
 int io_internal_dir_check(struct io_handler *self, const uint8_t *dir)
@@ -76,8 +278,11 @@ int io_internal_dir_create(struct io_handler *self, const uint8_t *dir)
 			fprintf(stderr, "Error: %s: %s\n",
 				"cannot create directory",
 				strerror(-err));
+		} else {
+			io_internal_dircache_changed(fulldir);
 		}
 	}
+	free(fulldir);
 	
 	return 0;
 }
@@ -0,0 +1,439 @@
+/* Copyright (C) 2006-2010 Hendrik Sattler <post@hendrik-sattler.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* Cache of folder listing documents:
+ * Each cached directory has an inotify watch. Pending events are read
+ * on each lookup and drop the listings of the changed directories, our
+ * own changes also drop them directly. A listing is only stored if no
+ * event arrived while it was generated. Without inotify, nothing is
+ * cached.
+ */
+
+#include "dircache.h"
+#include "x-obex/obex-folder-listing.h"
+
+#include <sys/inotify.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(USE_THREADS)
+#include <pthread.h>
+#endif
+
+#define IO_DIRCACHE_ENTRIES 64
+#define IO_DIRCACHE_BYTES   (16 << 20)
+
+#define IO_DIRCACHE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+			    IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE |		\
+			    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct io_dircache_slot {
+	char *dir;
+	int flags;
+	int wd;
+	unsigned long used;
+	struct io_internal_listing *listing;
+};
+
+static struct io_dircache_slot io_dircache[IO_DIRCACHE_ENTRIES];
+static size_t io_dircache_bytes = 0;
+static unsigned long io_dircache_clock = 0;
+/* incremented on each event, starts at 1 because 0 means "do not cache" */
+static unsigned long io_dircache_seq = 1;
+static int io_dircache_fd = -1;
+/* the process that owns the inotify descriptor */
+static pid_t io_dircache_pid = 0;
+
+#if defined(USE_THREADS)
+static pthread_mutex_t io_dircache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define io_dircache_lock() pthread_mutex_lock(&io_dircache_mutex)
+#define io_dircache_unlock() pthread_mutex_unlock(&io_dircache_mutex)
+#else
+#define io_dircache_lock() do {} while (0)
+#define io_dircache_unlock() do {} while (0)
+#endif
+
+/* must be called with the cache locked */
+static void io_dircache_unref (struct io_internal_listing *l)
+{
+	if (--l->refs == 0) {
+		if (l->index)
+			obex_folder_index_free(l->index);
+		free(l->buf);
+		free(l);
+	}
+}
+
+/* must be called with the cache locked */
+static void io_dircache_unwatch (int wd)
+{
+	unsigned int i;
+
+	for (i = 0; i < IO_DIRCACHE_ENTRIES; ++i)
+		if (io_dircache[i].dir && io_dircache[i].wd == wd)
+			return;
+	(void)inotify_rm_watch(io_dircache_fd, wd);
+}
+
+/* must be called with the cache locked */
+static void io_dircache_drop (struct io_dircache_slot *s)
+{
+	int wd = s->wd;
+
+	if (!s->dir)
+		return;
+
+	io_dircache_bytes -= s->listing->len;
+	io_dircache_unref(s->listing);
+	free(s->dir);
+	memset(s, 0, sizeof(*s));
+	/* the same directory may be cached under a different name */
+	io_dircache_unwatch(wd);
+}
+
+static void io_dircache_drop_wd (int wd)
+{
+	unsigned int i;
+
+	for (i = 0; i < IO_DIRCACHE_ENTRIES; ++i)
+		if (io_dircache[i].dir && io_dircache[i].wd == wd)
+			io_dircache_drop(&io_dircache[i]);
+}
+
+/* Read all pending events, must be called with the cache locked.
+ * Returns false if there is no usable inotify descriptor.
+ */
+static int io_dircache_update (void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	unsigned int i;
+
+	if (io_dircache_pid != getpid()) {
+		/* the descriptor and its events are shared with the
+		 * parent process, start over */
+		for (i = 0; i < IO_DIRCACHE_ENTRIES; ++i) {
+			if (io_dircache[i].dir) {
+				io_dircache_bytes -= io_dircache[i].listing->len;
+				io_dircache_unref(io_dircache[i].listing);
+				free(io_dircache[i].dir);
+				memset(&io_dircache[i], 0, sizeof(io_dircache[i]));
+			}
+		}
+		if (io_dircache_fd != -1)
+			(void)close(io_dircache_fd);
+		io_dircache_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		io_dircache_pid = getpid();
+		++io_dircache_seq;
+	}
+	if (io_dircache_fd == -1)
+		return 0;
+
+	while (1) {
+		ssize_t status = read(io_dircache_fd, buf, sizeof(buf));
+		char *ptr = buf;
+
+		if (status == -1 && errno == EINTR)
+			continue;
+		if (status <= 0)
+			break;
+
+		while (ptr < buf + status) {
+			struct inotify_event *ev = (struct inotify_event*)ptr;
+
+			++io_dircache_seq;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				for (i = 0; i < IO_DIRCACHE_ENTRIES; ++i)
+					io_dircache_drop(&io_dircache[i]);
+			} else {
+				io_dircache_drop_wd(ev->wd);
+			}
+			ptr += sizeof(*ev) + ev->len;
+		}
+	}
+	if (io_dircache_seq == 0)
+		++io_dircache_seq;
+
+	return 1;
+}
+
+/* length of a directory name without trailing slashes */
+static size_t io_dircache_keylen (const char *dir)
+{
+	size_t len = strlen(dir);
+
+	while (len > 1 && dir[len-1] == '/')
+		--len;
+	return len;
+}
+
+static int io_dircache_match (const struct io_dircache_slot *s,
+			      const char *dir, size_t len)
+{
+	return (s->dir && strlen(s->dir) == len && strncmp(s->dir, dir, len) == 0);
+}
+
+static struct io_dircache_slot* io_dircache_find (const char *dir, size_t len,
+						  int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < IO_DIRCACHE_ENTRIES; ++i) {
+		struct io_dircache_slot *s = &io_dircache[i];
+
+		if (io_dircache_match(s, dir, len) && s->flags == flags)
+			return s;
+	}
+	return NULL;
+}
+
+struct io_internal_listing* io_internal_dircache_get (const char *dir, int flags,
+						      unsigned long *seq)
+{
+	struct io_internal_listing *l = NULL;
+	struct io_dircache_slot *s;
+
+	*seq = 0;
+	io_dircache_lock();
+	if (io_dircache_update()) {
+		s = io_dircache_find(dir, io_dircache_keylen(dir), flags);
+		if (s) {
+			s->used = ++io_dircache_clock;
+			l = s->listing;
+			++l->refs;
+		} else if (inotify_add_watch(io_dircache_fd, dir, IO_DIRCACHE_EVENTS) != -1) {
+			/* changes while the listing is generated are
+			 * now counted */
+			*seq = io_dircache_seq;
+		}
+	}
+	io_dircache_unlock();
+
+	return l;
+}
+
+/* must be called with the cache locked */
+static void io_dircache_abort (const char *dir)
+{
+	int wd;
+
+	/* the watch of an earlier process is gone anyway */
+	if (io_dircache_pid != getpid() || io_dircache_fd == -1)
+		return;
+
+	/* this only returns the watch that io_internal_dircache_get()
+	 * added */
+	wd = inotify_add_watch(io_dircache_fd, dir, IO_DIRCACHE_EVENTS);
+	if (wd != -1)
+		io_dircache_unwatch(wd);
+	/* another listing of the directory that is generated right now
+	 * may have lost its watch */
+	if (++io_dircache_seq == 0)
+		++io_dircache_seq;
+}
+
+void io_internal_dircache_abort (const char *dir, unsigned long seq)
+{
+	if (!seq)
+		return;
+
+	io_dircache_lock();
+	io_dircache_abort(dir);
+	io_dircache_unlock();
+}
+
+/* must be called with the cache locked */
+static struct io_dircache_slot* io_dircache_slot (size_t len)
+{
+	struct io_dircache_slot *s = NULL;
+	unsigned int i;
+
+	while (1) {
+		struct io_dircache_slot *old = NULL;
+
+		for (i = 0; i < IO_DIRCACHE_ENTRIES; ++i) {
+			if (!io_dircache[i].dir)
+				s = &io_dircache[i];
+			else if (!old || io_dircache[i].used < old->used)
+				old = &io_dircache[i];
+		}
+		if (s && io_dircache_bytes + len <= IO_DIRCACHE_BYTES)
+			return s;
+		if (!old)
+			return NULL;
+		io_dircache_drop(old);
+	}
+}
+
+static void io_dircache_insert (const char *dir, int flags, unsigned long seq,
+				struct io_internal_listing *l)
+{
+	size_t keylen = io_dircache_keylen(dir);
+	struct io_dircache_slot *s;
+	char *key;
+	int wd;
+
+	if (l->len > IO_DIRCACHE_BYTES) {
+		io_internal_dircache_abort(dir, seq);
+		return;
+	}
+
+	key = strndup(dir, keylen);
+	if (!key) {
+		io_internal_dircache_abort(dir, seq);
+		return;
+	}
+
+	io_dircache_lock();
+	if (!io_dircache_update())
+		goto out;
+
+	/* the watch was added by io_internal_dircache_get(), this
+	 * only returns it */
+	wd = inotify_add_watch(io_dircache_fd, key, IO_DIRCACHE_EVENTS);
+	if (wd == -1)
+		goto out;
+
+	/* the directory changed while the listing was generated */
+	if (seq != io_dircache_seq) {
+		io_dircache_unwatch(wd);
+		goto out;
+	}
+
+	s = io_dircache_find(key, keylen, flags);
+	if (s) {
+		/* replace an older listing, the watch stays */
+		io_dircache_bytes -= s->listing->len;
+		io_dircache_unref(s->listing);
+		free(s->dir);
+	} else {
+		s = io_dircache_slot(l->len);
+		if (!s) {
+			io_dircache_unwatch(wd);
+			goto out;
+		}
+	}
+
+	s->dir = key;
+	s->flags = flags;
+	s->wd = wd;
+	s->used = ++io_dircache_clock;
+	s->listing = l;
+	++l->refs;
+	io_dircache_bytes += l->len;
+	key = NULL;
+
+out:
+	io_dircache_unlock();
+	free(key);
+}
+
+struct io_internal_listing* io_internal_dircache_put (const char *dir, int flags,
+						      unsigned long seq,
+						      char *buf, size_t len,
+						      time_t time)
+{
+	struct io_internal_listing *l = calloc(1, sizeof(*l));
+
+	if (!l) {
+		io_internal_dircache_abort(dir, seq);
+		free(buf);
+		return NULL;
+	}
+	l->refs = 1;
+	l->buf = buf;
+	l->len = len;
+	l->time = time;
+
+	if (seq)
+		io_dircache_insert(dir, flags, seq, l);
+
+	return l;
+}
+
+struct io_internal_listing* io_internal_dircache_put_index (const char *dir, int flags,
+							    unsigned long seq,
+							    struct obex_folder_index *index,
+							    time_t time)
+{
+	struct io_internal_listing *l = calloc(1, sizeof(*l));
+
+	if (!l) {
+		io_internal_dircache_abort(dir, seq);
+		obex_folder_index_free(index);
+		return NULL;
+	}
+	l->refs = 1;
+	l->index = index;
+	l->len = obex_folder_index_size(index);
+	l->time = time;
+
+	if (seq)
+		io_dircache_insert(dir, flags, seq, l);
+
+	return l;
+}
+
+struct io_internal_listing* io_internal_dircache_ref (struct io_internal_listing *l)
+{
+	io_dircache_lock();
+	++l->refs;
+	io_dircache_unlock();
+
+	return l;
+}
+
+void io_internal_dircache_release (struct io_internal_listing *l)
+{
+	io_dircache_lock();
+	io_dircache_unref(l);
+	io_dircache_unlock();
+}
+
+/* must be called with the cache locked */
+static void io_dircache_drop_name (const char *dir, size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < IO_DIRCACHE_ENTRIES; ++i)
+		if (io_dircache_match(&io_dircache[i], dir, len))
+			io_dircache_drop(&io_dircache[i]);
+}
+
+void io_internal_dircache_changed (const char *name)
+{
+	size_t len = io_dircache_keylen(name);
+	const char *sep;
+
+	io_dircache_lock();
+	if (io_dircache_pid == getpid()) {
+		io_dircache_drop_name(name, len);
+
+		/* the parent directory */
+		for (sep = name + len; sep > name && sep[-1] != '/'; --sep);
+		if (sep == name)
+			io_dircache_drop_name(".", 1);
+		else if (sep == name + 1)
+			io_dircache_drop_name("/", 1);
+		else
+			io_dircache_drop_name(name, sep - name - 1);
+		/* a listing that is generated right now may miss it */
+		if (++io_dircache_seq == 0)
+			++io_dircache_seq;
+	}
+	io_dircache_unlock();
+}
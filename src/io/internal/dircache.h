@@ -0,0 +1,57 @@
+#include <sys/types.h>
+#include <time.h>
+
+struct obex_folder_index;
+
+/* A generated folder listing document, see dircache.c */
+struct io_internal_listing {
+	unsigned int refs;
+	char *buf;
+	size_t len;
+	time_t time; /* modification time of the directory */
+
+	/* sorted entries instead of a document, len is its size */
+	struct obex_folder_index *index;
+};
+
+/* added to the flags to look up or store an index */
+#define IO_INTERNAL_DIRCACHE_INDEX (1 << 16)
+
+/** Look up the listing of a directory
+ * @param dir   directory name
+ * @param flags flags for obex_folder_listing()
+ * @param seq   set to the value to pass to io_internal_dircache_put()
+ * @return a reference to the listing or NULL if it must be generated
+ */
+struct io_internal_listing* io_internal_dircache_get (const char *dir, int flags,
+						      unsigned long *seq);
+
+/** Store a new listing, the cache takes ownership of buf
+ * @param dir   directory name, may be NULL if seq is 0
+ * @param seq   from io_internal_dircache_get() or 0 to not cache it
+ * @return a reference to the listing or NULL on error (errno is set)
+ */
+struct io_internal_listing* io_internal_dircache_put (const char *dir, int flags,
+						      unsigned long seq,
+						      char *buf, size_t len,
+						      time_t time);
+
+/** Give up a listing that was not stored, e.g. on an error
+ * @param dir   directory name
+ * @param seq   from io_internal_dircache_get(), nothing is done for 0
+ */
+void io_internal_dircache_abort (const char *dir, unsigned long seq);
+
+/** Store a new directory index, like io_internal_dircache_put() */
+struct io_internal_listing* io_internal_dircache_put_index (const char *dir, int flags,
+							    unsigned long seq,
+							    struct obex_folder_index *index,
+							    time_t time);
+
+/** @return another reference to the listing */
+struct io_internal_listing* io_internal_dircache_ref (struct io_internal_listing *l);
+
+void io_internal_dircache_release (struct io_internal_listing *l);
+
+/** Drop the listings of a changed file or directory and of its parent */
+void io_internal_dircache_changed (const char *name);
@@ -1,31 +1,44 @@
 #include "checks.h"
 #include "common.h"
 #include "file.h"
+#include "uring.h"
+#include "groupsync.h"
+#include "dircache.h"
 
 #ifdef USE_XATTR
 #include <attr/xattr.h>
 #endif
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <utime.h>
+#include <time.h>
 
 #include "closexec.h"
 #include "compiler.h"
 
-static void io_internal_file_set_time (const char *name, time_t time)
+#define IO_INTERNAL_FILE_MODE (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH)
+
+static void io_internal_file_set_time (int fd, time_t time)
 {
-	struct utimbuf times;
-					
-	times.actime = time;
-	times.modtime = time;
+	struct timespec times[2];
+
+	times[0].tv_sec = time;
+	times[0].tv_nsec = 0;
+	times[1] = times[0];
 	/* setting the time is non-critical */
-	(void)utime(name, &times);
+	(void)futimens(fd, times);
 }
 
 #ifdef USE_XATTR
-static void io_internal_file_set_type (const char *name, const char *type)
+static void io_internal_file_set_type (int fd, const char *type)
 {
-	(void)lsetxattr(name, "user.mime_type", type, strlen(type)+1, 0);
+	(void)fsetxattr(fd, "user.mime_type", type, strlen(type)+1, 0);
 }
 
 static char * io_internal_file_get_type (const char *name)
@@ -42,28 +55,180 @@ static char * io_internal_file_get_type (const char *name)
 }
 #endif
 
+/* returns the directory part of name, must be freed */
+static char* io_internal_file_dirname (const char *name)
+{
+	const char *sep = strrchr(name, '/');
+	size_t len;
+	char *dir;
+
+	if (!sep)
+		return strdup(".");
+
+	len = (sep == name)? 1: (size_t)(sep - name);
+	dir = malloc(len + 1);
+	if (dir) {
+		memcpy(dir, name, len);
+		dir[len] = 0;
+	}
+	return dir;
+}
+
+static int io_internal_file_create (struct io_internal_data *data,
+				    const char *path, int flags)
+{
+	int fd = -1;
+
+	if (data->opts.direct) {
+		fd = open_closexec(path, flags|O_DIRECT, IO_INTERNAL_FILE_MODE);
+		/* not all file systems support it */
+		if (fd == -1 && errno != EINVAL)
+			return -errno;
+	}
+	if (fd == -1)
+		fd = open_closexec(path, flags, IO_INTERNAL_FILE_MODE);
+	if (fd == -1)
+		return -errno;
+
+	return fd;
+}
+
+enum io_internal_link {
+	IO_INTERNAL_LINK_UNKNOWN = 0,
+	IO_INTERNAL_LINK_PROC,
+	IO_INTERNAL_LINK_EMPTY_PATH,
+	IO_INTERNAL_LINK_NONE,
+};
+
+/* how an unnamed file can be linked, see io_internal_file_probe_link() */
+static int io_internal_file_link_mode = IO_INTERNAL_LINK_UNKNOWN;
+
+static int io_internal_file_probe_link (const char *dir, const char *name);
+
+/* returns a hidden name ".name.XXXXXX" in the directory of name,
+ * must be freed */
+static char* io_internal_file_tmpname (const char *name)
+{
+	static unsigned int counter = 0;
+	const char *sep = strrchr(name, '/');
+	size_t dlen = (sep)? (size_t)(sep + 1 - name): 0;
+	char *tmp = malloc(strlen(name) + 9);
+	struct timespec now;
+	unsigned long r;
+
+	if (!tmp)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	r = (unsigned long)now.tv_nsec ^ ((unsigned long)getpid() << 12);
+	r += __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED) * 2654435761UL;
+	sprintf(tmp, "%.*s.%s.%06lx", (int)dlen, name, name + dlen, r & 0xffffff);
+
+	return tmp;
+}
+
+/* Create a file with a hidden name in the directory of name. It is
+ * renamed by io_internal_file_commit().
+ */
+static int io_internal_file_create_hidden (struct io_internal_data *data,
+					   const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < 100; ++i) {
+		char *tmp = io_internal_file_tmpname(name);
+		int fd;
+
+		if (!tmp)
+			return -errno;
+		fd = io_internal_file_create(data, tmp, O_WRONLY|O_CREAT|O_EXCL);
+		if (fd >= 0) {
+			data->out_tmpname = tmp;
+			return fd;
+		}
+		free(tmp);
+		if (fd != -EEXIST)
+			return fd;
+	}
+
+	return -EEXIST;
+}
+
+/* Create an unnamed file in the directory of name. It only becomes
+ * visible when io_internal_file_commit() links it to its name.
+ * Where it cannot be linked, a hidden file is used instead.
+ */
+static int io_internal_file_create_tmp (struct io_internal_data *data,
+					const char *name)
+{
+#ifdef O_TMPFILE
+	char *dir = io_internal_file_dirname(name);
+	int fd;
+
+	if (!dir)
+		return -errno;
+	fd = io_internal_file_create(data, dir, O_WRONLY|O_TMPFILE);
+	if (fd >= 0 &&
+	    io_internal_file_probe_link(dir, name) == IO_INTERNAL_LINK_NONE)
+	{
+		(void)close(fd);
+		fd = -EOPNOTSUPP;
+	}
+	free(dir);
+	if (fd >= 0 ||
+	    (fd != -EOPNOTSUPP && fd != -EISDIR && fd != -EINVAL))
+		return fd;
+#endif
+	/* older kernels, file systems without support or no way to link */
+	return io_internal_file_create_hidden(data, name);
+}
+
 int io_internal_open_put (struct io_handler *self,
 			  struct io_transfer_data *transfer,
 			  const char *name)
 {
 	struct io_internal_data *data = self->private_data;
+	struct stat s;
 	int err = 0;
 
 	if (!transfer->name)
 		return -EINVAL;
 
 	fprintf(stderr, "Creating file \"%s\"\n", name);
-	err = open_closexec(name, O_WRONLY|O_CREAT|O_EXCL,
-			    S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-	if (err == -1)
-		return -errno;
-
+	if (data->opts.tmpfile) {
+		/* the name is only taken on commit, that reports a file
+		 * that was created in the meantime */
+		if (fstatat(AT_FDCWD, name, &s, AT_SYMLINK_NOFOLLOW) == 0)
+			return -EEXIST;
+		err = io_internal_file_create_tmp(data, name);
+		data->out_tmp = (err >= 0);
+	} else {
+		err = io_internal_file_create(data, name, O_WRONLY|O_CREAT|O_EXCL);
+	}
+	if (err < 0)
+		return err;
+
+	data->out_fd = err;
+	data->out_len = 0;
+	data->out_pos = 0;
+
+	/* aligned for O_DIRECT */
+	err = posix_memalign((void**)&data->out_buf, IO_INTERNAL_ALIGN,
+			     data->opts.bufsize);
+	if (err) {
+		data->out_buf = NULL;
+		return -err;
+	}
+
+#if defined(USE_LIBURING)
+	if (data->opts.engine == IO_INTERNAL_ENGINE_URING) {
+		err = io_internal_uring_start_put(data, transfer->length);
+		if (err || data->uring)
+			return err;
+	}
+#endif
 	if (transfer->length)
-		(void)posix_fallocate(err, 0, transfer->length);
-
-	data->out = fdopen(err, "w");
-	if (data->out == NULL)
-		return -errno;
+		(void)posix_fallocate(data->out_fd, 0, transfer->length);
 
 	return 0;
 }
@@ -83,14 +248,21 @@ int io_internal_open_get (struct io_handler *self,
 	if (err == -1)
 		return -errno;;
 
-	data->in = fdopen(err, "r");
-	if (data->in == NULL)
-		return -errno;
+	/* the file is read once from start to end */
+	data->in_fd = err;
+	(void)posix_fadvise(err, 0, 0, POSIX_FADV_SEQUENTIAL);
+#if defined(USE_LIBURING)
+	if (data->opts.engine == IO_INTERNAL_ENGINE_URING) {
+		err = io_internal_uring_start_get(data);
+		if (err)
+			return err;
+	}
+#endif
 
 #ifdef USE_XATTR
 	transfer->type = io_internal_file_get_type(name);
 #endif
-	if (fstat(err, &s) == -1)
+	if (fstat(data->in_fd, &s) == -1)
 		return 0;
 
 	transfer->length = s.st_size;
@@ -104,20 +276,205 @@ int io_internal_file_delete (struct io_handler __unused *self, const char *name)
 	fprintf(stderr, "Deleting file \"%s\"\n", name);
 	if (unlink(name) == -1) 
 		return -errno;
+	io_internal_dircache_changed(name);
 
 	return 0;
 }
 
-void io_internal_file_close (struct io_handler __unused *self,
-			    struct io_transfer_data *transfer,
-			    const char *name)
+static int io_internal_file_sync_dir (struct io_internal_data *data,
+				     const char *name)
+{
+	char *dir = io_internal_file_dirname(name);
+	int err = 0;
+	int fd;
+
+	if (!dir)
+		return -errno;
+
+	fd = open_closexec(dir, O_RDONLY|O_DIRECTORY, 0);
+	if (fd == -1)
+		err = -errno;
+	else if (data->opts.sync == IO_INTERNAL_SYNC_GROUP) {
+		data->group = io_internal_group_start(data->out_fd, fd,
+						      data->opts.sync_window);
+		err = (data->group? -EINPROGRESS: -errno);
+	} else if (fsync(fd) == -1)
+		err = -errno;
+	if (fd != -1)
+		(void)close(fd);
+	free(dir);
+
+	return err;
+}
+
+static void io_internal_file_set_attr (int fd, struct io_transfer_data *transfer)
 {
 	if (transfer->time)
-		io_internal_file_set_time(name, transfer->time);
+		io_internal_file_set_time(fd, transfer->time);
 #ifdef USE_XATTR
 	if (transfer->type)
-		io_internal_file_set_type(name, transfer->type);
+		io_internal_file_set_type(fd, transfer->type);
+#endif
+}
+
+/* Give the unnamed file its name, see io_internal_file_link_mode */
+static int io_internal_file_linkat (int fd, const char *name, int mode)
+{
+	char path[32];
+
+	switch (mode) {
+	case IO_INTERNAL_LINK_PROC:
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+		if (linkat(AT_FDCWD, path, AT_FDCWD, name, AT_SYMLINK_FOLLOW) == -1)
+			return -errno;
+		return 0;
+
+#ifdef AT_EMPTY_PATH
+	case IO_INTERNAL_LINK_EMPTY_PATH:
+		if (linkat(fd, "", AT_FDCWD, name, AT_EMPTY_PATH) == -1)
+			return -errno;
+		return 0;
+#endif
+
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/* Linking through /proc needs a mounted proc file system and linking
+ * with AT_EMPTY_PATH needs special privileges. Both are the same for
+ * all files, so this is tried once, with an unnamed file of its own:
+ * a file that was linked and unlinked again cannot be linked anymore.
+ */
+static int io_internal_file_probe_link (const char *dir, const char *name)
+{
+	int mode = __atomic_load_n(&io_internal_file_link_mode, __ATOMIC_RELAXED);
+	int fd;
+
+	if (mode != IO_INTERNAL_LINK_UNKNOWN)
+		return mode;
+
+#ifdef O_TMPFILE
+	fd = open_closexec(dir, O_WRONLY|O_TMPFILE, IO_INTERNAL_FILE_MODE);
+#else
+	fd = -1;
+#endif
+	if (fd == -1)
+		return IO_INTERNAL_LINK_NONE;
+
+	for (mode = IO_INTERNAL_LINK_PROC; mode < IO_INTERNAL_LINK_NONE; ++mode) {
+		char *probe = io_internal_file_tmpname(name);
+		int err;
+
+		if (!probe)
+			return IO_INTERNAL_LINK_NONE;
+		err = io_internal_file_linkat(fd, probe, mode);
+		if (err == 0)
+			(void)unlink(probe);
+		free(probe);
+		if (err == 0)
+			break;
+	}
+	(void)close(fd);
+	__atomic_store_n(&io_internal_file_link_mode, mode, __ATOMIC_RELAXED);
+
+	return mode;
+}
+
+/* Give the file its name, it must not exist yet */
+static int io_internal_file_link (struct io_internal_data *data,
+				  const char *name)
+{
+	int err;
+
+	if (data->out_tmpname) {
+#ifdef RENAME_NOREPLACE
+		err = 0;
+		if (renameat2(AT_FDCWD, data->out_tmpname, AT_FDCWD, name,
+			      RENAME_NOREPLACE) == -1)
+			err = -errno;
+#else
+		err = -ENOSYS;
 #endif
+		/* link() does not replace an existing file either */
+		if (err == -EINVAL || err == -ENOSYS) {
+			err = 0;
+			if (link(data->out_tmpname, name) == -1)
+				err = -errno;
+			else
+				(void)unlink(data->out_tmpname);
+		}
+		if (err)
+			return err;
+		free(data->out_tmpname);
+		data->out_tmpname = NULL;
+	} else {
+		err = io_internal_file_linkat(data->out_fd, name,
+					      io_internal_file_link_mode);
+		if (err)
+			return err;
+	}
+
+	data->out_tmp = 0;
+	return 0;
+}
+
+/* Gives the file its name and makes it durable as configured.
+ * A group sync only gets started, -EINPROGRESS is returned then,
+ * see io_internal_file_synced().
+ */
+int io_internal_file_commit (struct io_handler *self,
+			     struct io_transfer_data *transfer,
+			     const char *name)
+{
+	struct io_internal_data *data = self->private_data;
+	int err;
+
+	if (data->out_fd == -1)
+		return -EBADF;
+
+	io_internal_file_set_attr(data->out_fd, transfer);
+
+	/* with group commit, the batch covers data and name at once */
+	if (data->opts.sync == IO_INTERNAL_SYNC_FILE &&
+	    fdatasync(data->out_fd) == -1)
+		return -errno;
+
+	if (data->out_tmp) {
+		err = io_internal_file_link(data, name);
+		if (err)
+			return err;
+	}
+	io_internal_dircache_changed(name);
+
+	if (data->opts.sync != IO_INTERNAL_SYNC_NONE)
+		return io_internal_file_sync_dir(data, name);
+
+	return 0;
+}
+
+static ssize_t io_internal_file_read_fd (struct io_handler *self,
+					 void *buf, size_t bufsize)
+{
+	struct io_internal_data *data = self->private_data;
+	size_t total = 0;
+
+	while (total < bufsize) {
+		ssize_t status = read(data->in_fd, (uint8_t*)buf + total, bufsize - total);
+
+		if (status == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (status == 0) {
+			self->state |= IO_STATE_EOF;
+			break;
+		}
+		total += status;
+	}
+
+	return total;
 }
 
 ssize_t io_internal_file_read (struct io_handler *self,
@@ -126,7 +483,7 @@ ssize_t io_internal_file_read (struct io_handler *self,
 	struct io_internal_data *data = self->private_data;
 	size_t status;
 
-	if (!data->in)
+	if (!data->in && data->in_fd == -1)
 		return -EBADF;
 
 	if (bufsize == 0)
@@ -135,23 +492,72 @@ ssize_t io_internal_file_read (struct io_handler *self,
 	if (buf == NULL)
 		return -EINVAL;
 
-	status = fread(buf, bufsize, 1, data->in);
+#if defined(USE_LIBURING)
+	if (data->uring) {
+		ssize_t status = io_internal_uring_read(data, buf, bufsize);
+
+		if (status >= 0 && (size_t)status < bufsize)
+			self->state |= IO_STATE_EOF;
+		return status;
+	}
+#endif
+	if (data->in_fd != -1)
+		return io_internal_file_read_fd(self, buf, bufsize);
+
+	/* the length of a generated document may be unknown, so the
+	 * last part is usually short */
+	status = fread(buf, 1, bufsize, data->in);
 	if (feof(data->in))
 		self->state |= IO_STATE_EOF;
 
-	if (status != 1 && !feof(data->in))
-		return -ferror(data->in);
+	if (status != bufsize && ferror(data->in))
+		return -EIO;
 	else
-		return status*bufsize;
+		return status;
+}
+
+static int io_internal_file_pwrite (int fd, const uint8_t *buf, size_t len, off_t pos)
+{
+	while (len) {
+		ssize_t status = pwrite(fd, buf, len, pos);
+
+		if (status == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += status;
+		pos += status;
+		len -= status;
+	}
+
+	return 0;
+}
+
+/* Only full buffers are written here, so with O_DIRECT all offsets
+ * and sizes are aligned.
+ */
+static int io_internal_file_flush (struct io_internal_data *data)
+{
+	int err = io_internal_file_pwrite(data->out_fd, data->out_buf,
+					  data->out_len, data->out_pos);
+
+	if (err)
+		return err;
+
+	data->out_pos += data->out_len;
+	data->out_len = 0;
+	return 0;
 }
 
 ssize_t io_internal_file_write (struct io_handler *self,
 				const void *buf, size_t len)
 {
 	struct io_internal_data *data = self->private_data;
-	size_t status;
+	const uint8_t *ptr = buf;
+	size_t left = len;
 
-	if (!data->out)
+	if (data->out_fd == -1)
 		return -EBADF;
 
 	if (len == 0)
@@ -160,9 +566,120 @@ ssize_t io_internal_file_write (struct io_handler *self,
 	if (buf == NULL)
 		return -EINVAL;
 
-	status = fwrite(buf, len, 1, data->out);
-	if (status < len)
-		return -ferror(data->out);
-	else
-		return status;
+	while (left) {
+		size_t n = data->opts.bufsize - data->out_len;
+
+		if (n > left)
+			n = left;
+		memcpy(data->out_buf + data->out_len, ptr, n);
+		data->out_len += n;
+		ptr += n;
+		left -= n;
+
+		if (data->out_len == data->opts.bufsize) {
+			int err;
+#if defined(USE_LIBURING)
+			if (data->uring)
+				err = io_internal_uring_flush(data);
+			else
+#endif
+				err = io_internal_file_flush(data);
+			if (err)
+				return err;
+		}
+	}
+
+	return len;
+}
+
+/* The result of the group sync that io_internal_file_commit()
+ * started, -EINPROGRESS while it is running if wait is false.
+ */
+int io_internal_file_synced (struct io_handler *self, bool wait)
+{
+	struct io_internal_data *data = self->private_data;
+	int err;
+
+	if (!data->group)
+		return 0;
+
+	err = io_internal_group_result(data->group);
+	while (wait && err == -EINPROGRESS) {
+		struct pollfd p = {
+			.fd = io_internal_group_fd(data->group),
+			.events = POLLIN,
+		};
+
+		if (poll(&p, 1, -1) == -1 && errno != EINTR)
+			return -errno;
+		err = io_internal_group_result(data->group);
+	}
+	if (err != -EINPROGRESS) {
+		io_internal_group_release(data->group);
+		data->group = NULL;
+	}
+
+	return err;
+}
+
+/* writes all pending data, the file stays open */
+int io_internal_file_finish (struct io_handler *self)
+{
+	struct io_internal_data *data = self->private_data;
+	int err = 0;
+
+	if (data->out_fd == -1)
+		return 0;
+
+#if defined(USE_LIBURING)
+	/* all full buffers must be on disk before the tail */
+	err = io_internal_uring_wait(data);
+#endif
+	if (!err && data->out_len) {
+		/* the tail is usually not aligned */
+		int flags = fcntl(data->out_fd, F_GETFL);
+
+		if (flags != -1 && (flags & O_DIRECT))
+			(void)fcntl(data->out_fd, F_SETFL, flags & ~O_DIRECT);
+		err = io_internal_file_flush(data);
+	}
+	/* drop space that was preallocated for a wrong length */
+	if (!err && ftruncate(data->out_fd, data->out_pos) == -1)
+		err = -errno;
+
+	return err;
+}
+
+/* Closes the file, an unnamed or hidden file is dropped. */
+int io_internal_file_release (struct io_handler *self)
+{
+	struct io_internal_data *data = self->private_data;
+	int err = 0;
+
+	if (data->out_fd == -1)
+		return 0;
+
+#if defined(USE_LIBURING)
+	err = io_internal_uring_stop(data);
+#endif
+	if (data->group) {
+		io_internal_group_release(data->group);
+		data->group = NULL;
+	}
+	if (close(data->out_fd) == -1 && !err)
+		err = -errno;
+	data->out_fd = -1;
+	if (data->out_tmpname) {
+		/* the file was not committed */
+		(void)unlink(data->out_tmpname);
+		free(data->out_tmpname);
+		data->out_tmpname = NULL;
+	}
+	data->out_tmp = 0;
+	data->out_done = 0;
+	free(data->out_buf);
+	data->out_buf = NULL;
+	data->out_len = 0;
+
+	return err;
 }
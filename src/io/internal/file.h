@@ -9,10 +9,13 @@ int io_internal_open_get (struct io_handler *self,
 			  struct io_transfer_data *transfer,
 			  const char *name);
 int io_internal_file_delete (struct io_handler *self, const char *name);
-void io_internal_file_close (struct io_handler *self,
+int io_internal_file_commit (struct io_handler *self,
 			     struct io_transfer_data *transfer,
 			     const char *name);
 ssize_t io_internal_file_read (struct io_handler *self,
 			       void *buf, size_t bufsize);
 ssize_t io_internal_file_write (struct io_handler *self,
 				const void *buf, size_t len);
+int io_internal_file_synced (struct io_handler *self, bool wait);
+int io_internal_file_finish (struct io_handler *self);
+int io_internal_file_release (struct io_handler *self);
@@ -0,0 +1,292 @@
+/* Copyright (C) 2006-2010 Hendrik Sattler <post@hendrik-sattler.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* Group commit for received files:
+ * Files are queued and the first one starts the window that lets
+ * other clients queue their files, then the whole batch is synced.
+ * If all files are on the same file system, a single syncfs() covers
+ * them, otherwise each file and directory is synced in turn. Files
+ * that arrive during the sync form the next batch.
+ * With threads, a separate thread waits for the window and syncs.
+ * Without threads, the clients share one event loop and a timer of
+ * that loop ends the window. Each file has an eventfd that gets
+ * readable when its batch is done, so nobody waits for the window.
+ */
+
+#include "groupsync.h"
+#include "evloop.h"
+#include "compiler.h"
+
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(USE_THREADS)
+#include <pthread.h>
+#endif
+
+struct io_group_member {
+	int fd;
+	int dirfd;
+	dev_t dev;
+	unsigned int window;
+	int efd;
+	int err;
+	int done;
+	int refs; /* the owner and the queue */
+	struct io_group_member *next;
+};
+
+static struct io_group_member *io_group_queue = NULL;
+
+#if defined(USE_THREADS)
+static pthread_mutex_t io_group_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_group_cond = PTHREAD_COND_INITIALIZER;
+static pid_t io_group_thread_pid = 0;
+#define io_group_lock() pthread_mutex_lock(&io_group_lock)
+#define io_group_unlock() pthread_mutex_unlock(&io_group_lock)
+#else
+static struct evloop_watch *io_group_timer = NULL;
+#define io_group_lock() do {} while (0)
+#define io_group_unlock() do {} while (0)
+#endif
+
+static void io_group_free (struct io_group_member *m)
+{
+	(void)close(m->fd);
+	if (m->dirfd != -1)
+		(void)close(m->dirfd);
+	(void)close(m->efd);
+	free(m);
+}
+
+/* must be called with the lock held */
+static void io_group_unref (struct io_group_member *m)
+{
+	if (--m->refs == 0)
+		io_group_free(m);
+}
+
+static int io_group_sync_one (struct io_group_member *m)
+{
+	if (fdatasync(m->fd) == -1)
+		return -errno;
+	if (m->dirfd != -1 && fsync(m->dirfd) == -1)
+		return -errno;
+	return 0;
+}
+
+static void io_group_sync_batch (struct io_group_member *batch)
+{
+	struct io_group_member *m;
+	int same_fs = 1;
+
+	for (m = batch->next; m; m = m->next)
+		if (m->dev != batch->dev)
+			same_fs = 0;
+
+	if (same_fs) {
+		int err = 0;
+
+		if (syncfs(batch->fd) == -1)
+			err = -errno;
+		for (m = batch; m; m = m->next)
+			m->err = err;
+	} else {
+		for (m = batch; m; m = m->next)
+			m->err = io_group_sync_one(m);
+	}
+}
+
+/* syncs everything that is queued right now */
+static void io_group_run (void)
+{
+	struct io_group_member *batch;
+	struct io_group_member *m;
+
+	io_group_lock();
+	batch = io_group_queue;
+	io_group_queue = NULL;
+	io_group_unlock();
+	if (!batch)
+		return;
+
+	io_group_sync_batch(batch);
+
+	io_group_lock();
+	while (batch) {
+		uint64_t n = 1;
+
+		m = batch;
+		batch = m->next;
+		m->done = 1;
+		(void)write(m->efd, &n, sizeof(n));
+		io_group_unref(m);
+	}
+	io_group_unlock();
+}
+
+#if defined(USE_THREADS)
+static void* io_group_thread (void __unused *arg)
+{
+	while (1) {
+		struct io_group_member *m;
+		struct timespec t;
+
+		io_group_lock();
+		while (!io_group_queue)
+			pthread_cond_wait(&io_group_cond, &io_group_lock);
+		/* the window of the first file in the queue */
+		for (m = io_group_queue; m->next; m = m->next)
+			;
+		t.tv_sec = m->window / 1000;
+		t.tv_nsec = (m->window % 1000) * 1000000L;
+		io_group_unlock();
+
+		/* collect more files for this batch */
+		while (nanosleep(&t, &t) == -1 && errno == EINTR)
+			;
+		io_group_run();
+	}
+
+	return NULL;
+}
+
+/* must be called with the lock held */
+static int io_group_schedule (struct io_group_member __unused *m)
+{
+	pthread_t t;
+	pthread_attr_t attr;
+	int err;
+
+	/* a thread of the parent process does not exist after fork() */
+	if (io_group_thread_pid != getpid()) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		err = pthread_create(&t, &attr, io_group_thread, NULL);
+		pthread_attr_destroy(&attr);
+		if (err)
+			return -err;
+		io_group_thread_pid = getpid();
+	}
+	pthread_cond_signal(&io_group_cond);
+
+	return 0;
+}
+
+#else
+static void io_group_tick (struct evloop_watch *w, uint32_t __unused events,
+			   void __unused *arg)
+{
+	evloop_del(w);
+	io_group_timer = NULL;
+	io_group_run();
+}
+
+static int io_group_schedule (struct io_group_member *m)
+{
+	struct evloop *loop = evloop_current();
+
+	if (io_group_timer)
+		return 0;
+
+	/* not called from an event loop */
+	if (!loop)
+		return -ENOTSUP;
+
+	io_group_timer = evloop_add_timer(loop, m->window, io_group_tick, NULL);
+	if (!io_group_timer)
+		return -errno;
+	return 0;
+}
+#endif
+
+struct io_group_member* io_internal_group_start (int fd, int dirfd,
+						 unsigned int window)
+{
+	struct io_group_member *m;
+	struct stat s;
+	int err;
+
+	if (fstat(fd, &s) == -1)
+		return NULL;
+
+	m = malloc(sizeof(*m));
+	if (!m)
+		return NULL;
+	m->dev = s.st_dev;
+	m->window = window;
+	m->err = 0;
+	m->done = 0;
+	m->refs = 2;
+	m->next = NULL;
+
+	/* the files may be closed before the batch is done */
+	m->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	m->dirfd = (dirfd == -1)? -1: fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+	m->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m->fd == -1 || (dirfd != -1 && m->dirfd == -1) || m->efd == -1) {
+		err = errno;
+		if (m->fd != -1)
+			(void)close(m->fd);
+		if (m->dirfd != -1)
+			(void)close(m->dirfd);
+		if (m->efd != -1)
+			(void)close(m->efd);
+		free(m);
+		errno = err;
+		return NULL;
+	}
+
+	io_group_lock();
+	m->next = io_group_queue;
+	io_group_queue = m;
+	err = io_group_schedule(m);
+	io_group_unlock();
+
+	/* nothing ends the window, so it ends right now */
+	if (err)
+		io_group_run();
+
+	return m;
+}
+
+int io_internal_group_fd (struct io_group_member *m)
+{
+	return m->efd;
+}
+
+int io_internal_group_result (struct io_group_member *m)
+{
+	int err;
+
+	io_group_lock();
+	err = (m->done? m->err: -EINPROGRESS);
+	io_group_unlock();
+
+	return err;
+}
+
+void io_internal_group_release (struct io_group_member *m)
+{
+	io_group_lock();
+	io_group_unref(m);
+	io_group_unlock();
+}
@@ -0,0 +1,22 @@
+#include <sys/types.h>
+
+struct io_group_member;
+
+/* Queue fd and the directory entries in dirfd for a group sync.
+ * All files that are queued within window milliseconds share one
+ * sync call. Both descriptors are duplicated.
+ * @return the member or NULL on error (errno is set)
+ */
+struct io_group_member* io_internal_group_start (int fd, int dirfd,
+						 unsigned int window);
+
+/* The eventfd that gets readable when the sync is done */
+int io_internal_group_fd (struct io_group_member *m);
+
+/* @return -EINPROGRESS until the sync is done, then 0 or a negative
+ *         error number
+ */
+int io_internal_group_result (struct io_group_member *m);
+
+/* The member may still be in a running batch and is freed with it */
+void io_internal_group_release (struct io_group_member *m);
@@ -0,0 +1,481 @@
+/* Copyright (C) 2006-2010 Hendrik Sattler <post@hendrik-sattler.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* io_uring engine for the file I/O:
+ * Each thread uses one ring for all of its transfers. A transfer has
+ * two buffers: while one is written to disk (PUT) or filled from disk
+ * (GET), the other one is filled from or sent to the client. The
+ * preallocation of a PUT is linked ahead of its first write.
+ */
+
+#include "common.h"
+#include "uring.h"
+
+#include <liburing.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(USE_THREADS)
+#include <pthread.h>
+#endif
+
+#define IO_URING_ENTRIES 64
+
+/* how long a stopped transfer waits for its requests (ms) */
+#define IO_URING_DRAIN_TIMEOUT 1000
+
+struct io_internal_ring {
+	struct io_uring ring;
+#if defined(USE_THREADS)
+	/* the write-behind thread may use the ring of another thread */
+	pthread_mutex_t lock;
+#endif
+};
+
+struct io_uring_req {
+	int pending;
+	int res;
+	struct io_internal_uring *owner;
+};
+
+struct io_internal_uring {
+	struct io_internal_ring *ring;
+	int fd;
+	int write;
+
+	uint8_t *buf[2];
+	size_t len[2];
+	off_t pos[2];
+	struct io_uring_req req[2];
+	struct io_uring_req falloc;
+	off_t falloc_len; /* not yet submitted */
+	int cur;
+
+	/* stopped with requests still pending, freed on their completion */
+	int orphan;
+
+	/* GET only: read offset in the current buffer and the file
+	 * offset of the next read request */
+	size_t off;
+	off_t next;
+};
+
+static __thread struct io_internal_ring *io_uring_local = NULL;
+static __thread int io_uring_failed = 0;
+
+#if defined(USE_THREADS)
+#define io_uring_lock(r) pthread_mutex_lock(&(r)->lock)
+#define io_uring_unlock(r) pthread_mutex_unlock(&(r)->lock)
+#else
+#define io_uring_lock(r) (void)(r)
+#define io_uring_unlock(r) (void)(r)
+#endif
+
+/* The ring of a thread lives as long as the thread, so it is never
+ * released. If the kernel does not support io_uring, NULL is returned
+ * and the synchronous file I/O is used.
+ */
+static struct io_internal_ring* io_uring_get_ring (void)
+{
+	struct io_internal_ring *r;
+
+	if (io_uring_local || io_uring_failed)
+		return io_uring_local;
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		return NULL;
+	memset(r, 0, sizeof(*r));
+	if (io_uring_queue_init(IO_URING_ENTRIES, &r->ring, 0) < 0) {
+		free(r);
+		io_uring_failed = 1;
+		return NULL;
+	}
+#if defined(USE_THREADS)
+	pthread_mutex_init(&r->lock, NULL);
+#endif
+	io_uring_local = r;
+
+	return r;
+}
+
+static int io_uring_busy (const struct io_internal_uring *u)
+{
+	return u->req[0].pending || u->req[1].pending || u->falloc.pending;
+}
+
+static void io_uring_free (struct io_internal_uring *u)
+{
+	free(u->buf[0]);
+	free(u->buf[1]);
+	free(u);
+}
+
+/* must be called with the ring locked */
+static void io_uring_complete (struct io_internal_ring *r, struct io_uring_cqe *cqe)
+{
+	struct io_uring_req *done = io_uring_cqe_get_data(cqe);
+	struct io_internal_uring *u = done->owner;
+
+	done->res = cqe->res;
+	done->pending = 0;
+	io_uring_cqe_seen(&r->ring, cqe);
+
+	if (u->orphan && !io_uring_busy(u))
+		io_uring_free(u);
+}
+
+/* must be called with the ring locked */
+static struct io_uring_sqe* io_uring_get_req (struct io_internal_ring *r,
+					      struct io_uring_req *req)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+
+	if (!sqe) {
+		/* submission queue is full */
+		(void)io_uring_submit(&r->ring);
+		sqe = io_uring_get_sqe(&r->ring);
+		if (!sqe)
+			return NULL;
+	}
+	io_uring_sqe_set_data(sqe, req);
+	req->pending = 1;
+	req->res = 0;
+
+	return sqe;
+}
+
+/* Wait for one request. Completions of other transfers that use the
+ * same ring are recorded on the way.
+ */
+static int io_uring_wait_req (struct io_internal_ring *r, struct io_uring_req *req)
+{
+	int err = 0;
+
+	io_uring_lock(r);
+	if (req->pending)
+		err = io_uring_submit(&r->ring);
+	if (err > 0)
+		err = 0;
+	while (!err && req->pending) {
+		struct io_uring_cqe *cqe;
+
+		err = io_uring_wait_cqe(&r->ring, &cqe);
+		if (err == -EINTR) {
+			err = 0;
+			continue;
+		}
+		if (err)
+			break;
+		io_uring_complete(r, cqe);
+	}
+	io_uring_unlock(r);
+
+	return err;
+}
+
+/* Wait a limited time for all requests of a transfer, returns whether
+ * some are still pending.
+ */
+static int io_uring_drain (struct io_internal_uring *u)
+{
+	struct io_internal_ring *r = u->ring;
+	struct __kernel_timespec ts = { 0, 100 * 1000 * 1000 };
+	int tries = IO_URING_DRAIN_TIMEOUT / 100;
+	int busy;
+
+	io_uring_lock(r);
+	(void)io_uring_submit(&r->ring);
+	while (io_uring_busy(u) && tries) {
+		struct io_uring_cqe *cqe;
+		int err = io_uring_wait_cqe_timeout(&r->ring, &cqe, &ts);
+
+		if (err == -ETIME)
+			--tries;
+		else if (err == 0)
+			io_uring_complete(r, cqe);
+		else if (err != -EINTR)
+			break;
+	}
+	busy = io_uring_busy(u);
+	if (busy)
+		u->orphan = 1;
+	io_uring_unlock(r);
+
+	return busy;
+}
+
+static int io_uring_submit_rw (struct io_internal_uring *u, int i)
+{
+	struct io_internal_ring *r = u->ring;
+	struct io_uring_sqe *sqe;
+	int err;
+
+	io_uring_lock(r);
+	if (u->write && u->falloc_len) {
+		/* the preallocation must be done before the first write */
+		if (io_uring_sq_space_left(&r->ring) < 2)
+			(void)io_uring_submit(&r->ring);
+		sqe = io_uring_get_req(r, &u->falloc);
+		if (sqe) {
+			io_uring_prep_fallocate(sqe, u->fd, 0, 0, u->falloc_len);
+			/* a failed preallocation must not cancel the write */
+#if defined(IOSQE_IO_HARDLINK)
+			io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+#else
+			io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+#endif
+		}
+		u->falloc_len = 0;
+	}
+	sqe = io_uring_get_req(r, &u->req[i]);
+	if (!sqe) {
+		io_uring_unlock(r);
+		return -EAGAIN;
+	}
+	if (u->write)
+		io_uring_prep_write(sqe, u->fd, u->buf[i], u->len[i], u->pos[i]);
+	else
+		io_uring_prep_read(sqe, u->fd, u->buf[i], u->len[i], u->pos[i]);
+	err = io_uring_submit(&r->ring);
+	io_uring_unlock(r);
+
+	if (err < 0) {
+		u->req[i].pending = 0;
+		return err;
+	}
+	return 0;
+}
+
+/* wait for a buffer to be written, a short write is completed here */
+static int io_uring_write_done (struct io_internal_uring *u, int i)
+{
+	int err = io_uring_wait_req(u->ring, &u->req[i]);
+	size_t done;
+
+	if (err)
+		return err;
+	/* cancelled by a failed preallocation linked ahead of it */
+	if (u->req[i].res == -ECANCELED)
+		u->req[i].res = 0;
+	if (u->req[i].res < 0)
+		return u->req[i].res;
+
+	done = u->req[i].res;
+	while (done < u->len[i]) {
+		ssize_t status = pwrite(u->fd, u->buf[i] + done, u->len[i] - done,
+					u->pos[i] + done);
+		if (status == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += status;
+	}
+	u->len[i] = 0;
+	u->req[i].res = 0;
+
+	return 0;
+}
+
+static int io_uring_wait_all (struct io_internal_uring *u)
+{
+	int err = 0;
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		int status;
+
+		if (u->write)
+			status = io_uring_write_done(u, i);
+		else
+			status = io_uring_wait_req(u->ring, &u->req[i]);
+		if (status && !err)
+			err = status;
+	}
+	/* preallocation is non-critical */
+	(void)io_uring_wait_req(u->ring, &u->falloc);
+
+	return err;
+}
+
+static struct io_internal_uring* io_uring_new (int fd, int write)
+{
+	struct io_internal_ring *r = io_uring_get_ring();
+	struct io_internal_uring *u;
+
+	if (!r)
+		return NULL;
+
+	u = malloc(sizeof(*u));
+	if (!u)
+		return NULL;
+	memset(u, 0, sizeof(*u));
+	u->ring = r;
+	u->fd = fd;
+	u->write = write;
+	u->req[0].owner = u;
+	u->req[1].owner = u;
+	u->falloc.owner = u;
+
+	return u;
+}
+
+int io_internal_uring_start_put (struct io_internal_data *data, off_t length)
+{
+	struct io_internal_uring *u = io_uring_new(data->out_fd, 1);
+	int err;
+
+	if (!u)
+		return 0;
+
+	u->buf[0] = data->out_buf;
+	err = posix_memalign((void**)&u->buf[1], IO_INTERNAL_ALIGN, data->opts.bufsize);
+	if (err) {
+		free(u);
+		return -err;
+	}
+
+	/* sent to the kernel with the first write */
+	u->falloc_len = length;
+	data->uring = u;
+
+	return 0;
+}
+
+int io_internal_uring_start_get (struct io_internal_data *data)
+{
+	struct io_internal_uring *u = io_uring_new(data->in_fd, 0);
+	size_t size = data->opts.bufsize;
+	int err = 0;
+	int i;
+
+	if (!u)
+		return 0;
+	data->uring = u;
+
+	/* read ahead into both buffers */
+	for (i = 0; i < 2 && !err; ++i) {
+		u->buf[i] = malloc(size);
+		if (!u->buf[i]) {
+			err = -errno;
+			break;
+		}
+		u->len[i] = size;
+		u->pos[i] = u->next;
+		u->next += size;
+		err = io_uring_submit_rw(u, i);
+	}
+	if (err)
+		(void)io_internal_uring_stop(data);
+
+	return err;
+}
+
+int io_internal_uring_flush (struct io_internal_data *data)
+{
+	struct io_internal_uring *u = data->uring;
+	int i = u->cur;
+	int err;
+
+	u->len[i] = data->out_len;
+	u->pos[i] = data->out_pos;
+	err = io_uring_submit_rw(u, i);
+	if (err)
+		return err;
+	data->out_pos += data->out_len;
+
+	/* continue with the other buffer when it is written */
+	u->cur = i ^ 1;
+	err = io_uring_write_done(u, u->cur);
+	data->out_buf = u->buf[u->cur];
+	data->out_len = 0;
+
+	return err;
+}
+
+ssize_t io_internal_uring_read (struct io_internal_data *data, void *buf, size_t bufsize)
+{
+	struct io_internal_uring *u = data->uring;
+	size_t total = 0;
+
+	while (total < bufsize) {
+		int i = u->cur;
+		size_t n;
+		int err = io_uring_wait_req(u->ring, &u->req[i]);
+
+		if (err)
+			return err;
+		if (u->req[i].res < 0)
+			return u->req[i].res;
+
+		n = u->req[i].res - u->off;
+		if (n == 0) {
+			/* a short read means end of file */
+			if ((size_t)u->req[i].res < u->len[i])
+				break;
+
+			/* refill this buffer and continue with the other one */
+			u->pos[i] = u->next;
+			u->next += u->len[i];
+			err = io_uring_submit_rw(u, i);
+			if (err)
+				return err;
+			u->cur = i ^ 1;
+			u->off = 0;
+			continue;
+		}
+
+		if (n > bufsize - total)
+			n = bufsize - total;
+		memcpy((uint8_t*)buf + total, u->buf[i] + u->off, n);
+		u->off += n;
+		total += n;
+	}
+
+	return total;
+}
+
+int io_internal_uring_stop (struct io_internal_data *data)
+{
+	struct io_internal_uring *u = data->uring;
+	int err;
+
+	if (!u)
+		return 0;
+
+	err = io_uring_wait_all(u);
+	if (u->write)
+		data->out_buf = NULL;
+	data->uring = NULL;
+
+	/* the kernel may still use the buffers, they are freed with
+	 * the last completion then */
+	if (!io_uring_busy(u) || !io_uring_drain(u))
+		io_uring_free(u);
+
+	return err;
+}
+
+int io_internal_uring_wait (struct io_internal_data *data)
+{
+	if (!data->uring)
+		return 0;
+
+	return io_uring_wait_all(data->uring);
+}
@@ -0,0 +1,16 @@
+#include <sys/types.h>
+#include "io.h"
+
+struct io_internal_data;
+
+/* io_uring engine for the file I/O: all functions return 0 or a
+ * negative error number.
+ */
+#if defined(USE_LIBURING)
+int io_internal_uring_start_put (struct io_internal_data *data, off_t length);
+int io_internal_uring_start_get (struct io_internal_data *data);
+int io_internal_uring_flush (struct io_internal_data *data);
+int io_internal_uring_wait (struct io_internal_data *data);
+ssize_t io_internal_uring_read (struct io_internal_data *data, void *buf, size_t bufsize);
+int io_internal_uring_stop (struct io_internal_data *data);
+#endif
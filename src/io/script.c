@@ -31,33 +31,69 @@
 #include <limits.h>
 
 #include "io.h"
+#include "script_proc.h"
+#include "script_pool.h"
+#include "pipe.h"
 #include "utf.h"
 #include "compiler.h"
 
 struct io_script_data {
 	pid_t child;
 	const char* script;
-	FILE *in;
+	int in;
 	FILE *out;
+
+	/* persistent mode: the command and parameters are collected in
+	 * a memory stream and then sent as one frame */
+	int persistent;
+	struct io_script_xfer *xfer;
+	char *cmd_buf;
+	size_t cmd_len;
+
+	/* milliseconds until a script that does not exit gets killed */
+	int timeout;
+
+	/* waiting for the exit of child, see io_script_finish() */
+	int exiting;
+	int killed;
+	int pidfd;
+	struct timespec deadline;
+
+	/* exit code of a child that io_script_finish() reaped */
+	int reaped;
+	int result;
 };
 
+#define IO_SCRIPT_TIMEOUT 10000
+
+/* interval to check for the exit without pidfd (ms) */
+#define IO_SCRIPT_POLL 10
+
+static int io_script_status (int status, bool keep)
+{
+	int retval = 0;
+
+	if (WIFEXITED(status)) {
+		retval = WEXITSTATUS(status);
+		/* fprintf(stderr, "script exited with exit code %d\n", retval); */
+	} else if (WIFSIGNALED(status) && keep) {
+		retval = WTERMSIG(status);
+		/* fprintf(stderr, "script got signal %d\n", retval); */
+	}
+
+	return retval;
+}
+
 static int io_script_exit (
 	pid_t child,
-	bool keep
+	bool keep,
+	int timeout
 )
 {
 	int status;
-	int retval = 0;
 	int pid = 0;
 
-	if (!keep)
-		kill(child, SIGUSR1); /* signal 'undo' */
-
-	for (int i = 0; pid == 0 && i < 10; ++i) {
-		pid = waitpid(child, &status, WNOHANG);
-		if (pid == 0)
-			sleep(1);
-	}
+	pid = pipe_wait(child, &status, timeout);
 
 	/* it not dead yet, kill it */
 	if (pid == 0) {
@@ -66,16 +102,65 @@ static int io_script_exit (
 	}
 
 	if (pid < 0)
-		retval = -errno;
-	else if (WIFEXITED(status)) {
-		retval = WEXITSTATUS(status);
-		/* fprintf(stderr, "script exited with exit code %d\n", retval); */
-	} else if (WIFSIGNALED(status) && keep) {
-		retval = WTERMSIG(status);
-		/* fprintf(stderr, "script got signal %d\n", retval); */
+		return -errno;
+	return io_script_status(status, keep);
+}
+
+/* milliseconds until the deadline of an exiting script */
+static int io_script_remaining (struct io_script_data *data)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (data->deadline.tv_sec - now.tv_sec) * 1000 +
+		(data->deadline.tv_nsec - now.tv_nsec) / 1000000;
+	if (ms < 0)
+		return 0;
+	return (int)ms;
+}
+
+/* no more data: stdin is closed and the deadline for the exit starts */
+static int io_script_begin_exit (struct io_script_data *data)
+{
+	int err = 0;
+
+	if (data->exiting)
+		return 0;
+
+	if (data->out) {
+		if (fclose(data->out) == EOF)
+			err = -errno;
+		data->out = NULL;
 	}
 
-	return retval;
+	clock_gettime(CLOCK_MONOTONIC, &data->deadline);
+	data->deadline.tv_sec += data->timeout / 1000;
+	data->deadline.tv_nsec += (data->timeout % 1000) * 1000000L;
+	if (data->deadline.tv_nsec >= 1000000000L) {
+		data->deadline.tv_nsec -= 1000000000L;
+		++data->deadline.tv_sec;
+	}
+	/* without pidfd, io_script_wait_fd() polls */
+	data->pidfd = pipe_pidfd(data->child);
+	data->exiting = 1;
+
+	return err;
+}
+
+/* the child is gone, forget about it */
+static void io_script_reset_child (struct io_script_data *data)
+{
+	if (data->pidfd != -1) {
+		(void)close(data->pidfd);
+		data->pidfd = -1;
+	}
+	data->exiting = 0;
+	data->killed = 0;
+	if (data->child != (pid_t)-1) {
+		data->child = (pid_t)-1;
+		io_script_pool_refill();
+	}
 }
 
 static int io_script_close (
@@ -87,6 +172,21 @@ static int io_script_close (
 	struct io_script_data *data = self->private_data;
 	int retval = 0;
 
+	if (data->persistent) {
+		if (data->out) {
+			(void)fclose(data->out);
+			data->out = NULL;
+			free(data->cmd_buf);
+			data->cmd_buf = NULL;
+		}
+		if (data->xfer) {
+			retval = io_script_xfer_finish(data->xfer, keep);
+			data->xfer = NULL;
+		}
+		self->state = 0;
+		return retval;
+	}
+
 	/* kill STDIN first to signal the script that there will be no more
 	 * data */
 	if (data->out) {
@@ -96,16 +196,32 @@ static int io_script_close (
 			data->out = NULL;
 	}
 
-	if (data->child != (pid_t)-1) {
-		retval = io_script_exit(data->child, keep);
-		data->child = (pid_t)-1;
+	if (data->reaped) {
+		/* io_script_finish() already waited */
+		retval = data->result;
+		data->reaped = 0;
+
+	} else if (data->child != (pid_t)-1) {
+		int timeout = data->timeout;
+
+		if (data->exiting)
+			timeout = io_script_remaining(data);
+		if (!keep) {
+			kill(data->child, SIGUSR1); /* signal 'undo' */
+			/* nobody waits for the result */
+			pipe_reap(data->child, data->pidfd, timeout);
+			data->pidfd = -1;
+		} else {
+			retval = io_script_exit(data->child, keep, timeout);
+		}
+		io_script_reset_child(data);
 	}
 
-	if (data->in) {
-		if (fclose(data->in) == EOF)
+	if (data->in != -1) {
+		if (close(data->in) == -1)
 			retval = -errno;
 		else
-			data->in = NULL;
+			data->in = -1;
 	}
 	self->state = 0;
 
@@ -229,25 +345,63 @@ static int io_script_prepare_cmd (
 	if (err)
 		return err;
 
-	err = pipe_open(data->script, args, p, &data->child);
-	if (err)
-		return err;
+	if (data->persistent) {
+		data->out = open_memstream(&data->cmd_buf, &data->cmd_len);
+		if (!data->out)
+			return -errno;
+		fprintf(data->out, "%s\n", cmd);
+		self->state |= IO_STATE_OPEN;
+		return 0;
+	}
 
-	data->in = fdopen(p[0], "r");
-	if (data->in)
-		data->out = fdopen(p[1], "w");
-	if (!data->in || !data->out) {
+	/* a warm script saves the process start */
+	if (io_script_pool_take(cmd, p, &data->child) != 0) {
+		err = pipe_open(data->script, args, p, &data->child);
+		if (err)
+			return err;
+	}
+
+	/* input is buffered by io_readline() */
+	data->out = fdopen(p[1], "w");
+	if (!data->out) {
 		err = errno;
 		pipe_close(p);
 		io_script_close(self, transfer, true);
 		return -err;
 	}
+	data->in = p[0];
 
 	self->state |= IO_STATE_OPEN;
 
 	return err;
 }
 
+/* In persistent mode, send the collected command to the script */
+static int io_script_start_cmd (struct io_handler *self)
+{
+	struct io_script_data *data = self->private_data;
+	int err = 0;
+
+	if (!data->persistent)
+		return 0;
+
+	if (fclose(data->out) == EOF)
+		err = -errno;
+	data->out = NULL;
+
+	if (!err) {
+		data->xfer = io_script_xfer_new(data->script, data->cmd_buf, data->cmd_len);
+		if (!data->xfer)
+			err = -errno;
+	}
+	free(data->cmd_buf);
+	data->cmd_buf = NULL;
+
+	if (err)
+		self->state = 0;
+	return err;
+}
+
 static void str_subst(char *str, char a, char b)
 {
 	while(*str) {
@@ -338,7 +492,6 @@ static int io_script_open (
 	enum io_type t
 )
 {
-	struct io_script_data *data = self->private_data;
 	const char *cmd;
 	int ht = IO_HT_FROM;
 	int err;
@@ -374,12 +527,12 @@ static int io_script_open (
 	}
 
 	err = io_script_prepare_cmd(self, transfer, cmd);
-	if (!err)
+	if (!err) {
 		io_script_write_headers(self, transfer, ht);
+		err = io_script_start_cmd(self);
+	}
 	if (err)
 		return err;
-	if (feof(data->in))
-		self->state |= IO_STATE_EOF;
 
 	switch (t) {
 	case IO_TYPE_PUT:
@@ -402,28 +555,47 @@ static void io_script_cleanup (struct io_handler *self)
 	}
 }
 
-static ssize_t io_script_read(struct io_handler *self, void *buf, size_t bufsize)
+static ssize_t io_script_fill(struct io_handler *self, void *buf, size_t bufsize)
 {
 	struct io_script_data *data = self->private_data;
-	size_t status;
+	ssize_t status;
 
-	if (!data->in)
+	if (data->in == -1 && !data->xfer)
 		return -EBADF;
 
-	if (bufsize == 0)
-		return 0;
-
 	if (buf == NULL)
 		return -EINVAL;
 
-	status = fread(buf, bufsize, 1, data->in);
-	if (feof(data->in))
+	if (data->xfer)
+		status = io_script_xfer_read(data->xfer, buf, bufsize);
+	else {
+		do {
+			status = read(data->in, buf, bufsize);
+		} while (status == -1 && errno == EINTR);
+		if (status == -1)
+			status = -errno;
+	}
+
+	if (status == 0)
 		self->state |= IO_STATE_EOF;
+	return status;
+}
 
-	if (status != 1 && !feof(data->in))
-		return -ferror(data->in);
-	else
-		return status*bufsize;
+static ssize_t io_script_read(struct io_handler *self, void *buf, size_t bufsize)
+{
+	size_t total = 0;
+
+	while (total < bufsize) {
+		ssize_t status = io_script_fill(self, (uint8_t*)buf + total, bufsize - total);
+
+		if (status < 0)
+			return (total? (ssize_t)total: status);
+		if (status == 0)
+			break;
+		total += status;
+	}
+
+	return total;
 }
 
 static ssize_t io_script_write(struct io_handler *self, const void *buf, size_t len)
@@ -431,7 +603,7 @@ static ssize_t io_script_write(struct io_handler *self, const void *buf, size_t
 	struct io_script_data *data = self->private_data;
 	size_t status;
 
-	if (!data->out)
+	if (!data->out && !data->xfer)
 		return -EBADF;
 
 	if (len == 0)
@@ -440,6 +612,13 @@ static ssize_t io_script_write(struct io_handler *self, const void *buf, size_t
 	if (buf == NULL)
 		return -EINVAL;
 
+	if (data->xfer) {
+		int err = io_script_xfer_write(data->xfer, buf, len);
+		if (err)
+			return err;
+		return len;
+	}
+
 	status = fwrite(buf, len, 1, data->out);
 	if (status < len)
 		return -ferror(data->out);
@@ -447,9 +626,90 @@ static ssize_t io_script_write(struct io_handler *self, const void *buf, size_t
 		return status;
 }
 
-static int io_script_create_dir(struct io_handler *self, const uint8_t *dir)
+/* Check for the exit of the script without waiting,
+ * the exit code is returned by io_close().
+ * In persistent mode, this waits for the end of the transfer.
+ */
+static int io_script_finish (struct io_handler *self,
+			     struct io_transfer_data __unused *transfer)
 {
 	struct io_script_data *data = self->private_data;
+	int status;
+	int err;
+	pid_t pid;
+
+	if (data->persistent) {
+		if (!data->xfer)
+			return 0;
+		return io_script_xfer_end(data->xfer);
+	}
+	if (data->child == (pid_t)-1)
+		return 0;
+
+	err = io_script_begin_exit(data);
+	if (err)
+		return err;
+
+	pid = waitpid(data->child, &status, WNOHANG);
+	if (pid == 0) {
+		if (!data->killed && io_script_remaining(data) == 0) {
+			/* it not dead yet, kill it */
+			(void)kill(data->child, SIGKILL);
+			data->killed = 1;
+		}
+		return -EINPROGRESS;
+	}
+
+	if (pid < 0)
+		data->result = -errno;
+	else
+		data->result = io_script_status(status, true);
+	data->reaped = 1;
+	io_script_reset_child(data);
+
+	return (data->result < 0)? data->result: 0;
+}
+
+static int io_script_wait_fd (struct io_handler *self, int *timeout)
+{
+	struct io_script_data *data = self->private_data;
+
+	if (data->xfer)
+		return io_script_xfer_wait_fd(data->xfer);
+	if (!data->exiting)
+		return -1;
+
+	if (!data->killed)
+		*timeout = io_script_remaining(data);
+	if (data->pidfd == -1 && (*timeout < 0 || *timeout > IO_SCRIPT_POLL))
+		*timeout = IO_SCRIPT_POLL;
+
+	return data->pidfd;
+}
+
+/* wait for the result of a command without data */
+static int io_script_finish_cmd (struct io_handler *self)
+{
+	struct io_script_data *data = self->private_data;
+	int err;
+
+	if (!data->persistent) {
+		err = io_script_exit(data->child, true, data->timeout);
+		io_script_reset_child(data);
+		return err;
+	}
+
+	err = io_script_start_cmd(self);
+	if (!err) {
+		err = io_script_xfer_finish(data->xfer, true);
+		data->xfer = NULL;
+		self->state = 0;
+	}
+	return err;
+}
+
+static int io_script_create_dir(struct io_handler *self, const uint8_t *dir)
+{
 	struct io_transfer_data transfer;
 	int err;
 
@@ -457,7 +717,7 @@ static int io_script_create_dir(struct io_handler *self, const uint8_t *dir)
 	err = io_script_prepare_cmd(self, &transfer, "createdir");
 	if (!err) {
 		io_script_write_headers(self, &transfer, IO_HT_FROM | IO_HT_PATH);
-		err = io_script_exit(data->child, true);
+		err = io_script_finish_cmd(self);
 	}
 	if (err > 0)
 		err = -EFAULT;
@@ -465,6 +725,9 @@ static int io_script_create_dir(struct io_handler *self, const uint8_t *dir)
 	return err;
 }
 
+/* Without persistent mode, the script runs until io_finish() or
+ * io_close() as for any other transfer.
+ */
 static int io_script_delete(struct io_handler *self, struct io_transfer_data *transfer)
 {
 	struct io_script_data *data = self->private_data;
@@ -472,7 +735,10 @@ static int io_script_delete(struct io_handler *self, struct io_transfer_data *tr
 
 	if (!err) {
 		io_script_write_headers(self, transfer, IO_HT_FROM | IO_HT_NAME | IO_HT_PATH);
-		err = io_script_exit(data->child, true);
+		if (data->persistent)
+			err = io_script_finish_cmd(self);
+		else
+			err = io_script_begin_exit(data);
 	}
 	if (err > 0)
 		err = -EFAULT;
@@ -482,8 +748,55 @@ static int io_script_delete(struct io_handler *self, struct io_transfer_data *tr
 static struct io_handler* io_script_dup(struct io_handler *self)
 {
 	struct io_script_data *data = self->private_data;
+	struct io_handler *h = io_script_init(data->script);
 
-	return io_script_init(data->script);
+	if (h) {
+		struct io_script_data *newdata = h->private_data;
+		newdata->persistent = data->persistent;
+		newdata->timeout = data->timeout;
+	}
+	return h;
+}
+
+static int io_script_set_option (struct io_handler *self,
+				 const char *name, const char *value)
+{
+	struct io_script_data *data = self->private_data;
+
+	if (strcmp(name, "persistent") == 0) {
+		data->persistent = (!value || strcmp(value, "0") != 0);
+
+	} else if (strcmp(name, "timeout") == 0) {
+		char *end = NULL;
+		unsigned long ms;
+
+		if (!value)
+			return -EINVAL;
+		ms = strtoul(value, &end, 10);
+		if (end == value || *end != 0)
+			return -EINVAL;
+		if (ms > 3600 * 1000)
+			return -ERANGE;
+		data->timeout = ms;
+
+	} else if (strcmp(name, "pool") == 0) {
+		char *end = NULL;
+		unsigned long n;
+
+		if (!value)
+			return -EINVAL;
+		n = strtoul(value, &end, 10);
+		if (end == value || *end != 0)
+			return -EINVAL;
+		if (n == 0 || n > 16)
+			return -ERANGE;
+		return io_script_pool_init(data->script, n);
+
+	} else {
+		return -ENOTSUP;
+	}
+
+	return 0;
 }
 
 static struct io_handler_ops io_script_ops = {
@@ -492,11 +805,16 @@ static struct io_handler_ops io_script_ops = {
 
 	.open = io_script_open,
 	.close = io_script_close,
+	.finish = io_script_finish,
+	.wait_fd = io_script_wait_fd,
 	.delete = io_script_delete,
 	.read = io_script_read,
 	.write = io_script_write,
+	.fill = io_script_fill,
 
 	.create_dir = io_script_create_dir,
+
+	.set_option = io_script_set_option,
 };
 
 struct io_handler * io_script_init(const char* script) {
@@ -518,6 +836,9 @@ struct io_handler * io_script_init(const char* script) {
 
 	memset(data, 0, sizeof(*data));
 	data->child = (pid_t)-1;
+	data->in = -1;
+	data->pidfd = -1;
+	data->timeout = IO_SCRIPT_TIMEOUT;
 	data->script = script;
 
 	return handle;
@@ -0,0 +1,290 @@
+/* Copyright (C) 2006-2010 Hendrik Sattler <post@hendrik-sattler.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* Pool of already started scripts:
+ * The command is the first argument of the script, so there are a
+ * few processes per command. They block on their first read from
+ * stdin until a request takes them. Used entries are refilled by a
+ * separate thread. Without threads, a timer of the event loop starts
+ * one process per tick, so a request never waits for a refill.
+ * Everything is started on the first request, so processes and the
+ * thread belong to the process that handles the clients.
+ * Processes that are not needed are killed and reaped later without
+ * waiting for them.
+ */
+
+#include "script_pool.h"
+#include "pipe.h"
+#include "evloop.h"
+#include "compiler.h"
+
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(USE_THREADS)
+#include <pthread.h>
+#endif
+
+struct io_script_warm {
+	pid_t pid;
+	int fds[2];
+};
+
+static const char *io_script_pool_cmds[] = {
+	"put", "get", "listdir", "capability", "createdir", "delete"
+};
+#define IO_SCRIPT_POOL_CMDS (sizeof(io_script_pool_cmds) / sizeof(*io_script_pool_cmds))
+
+/* killed processes that were not reaped yet */
+#define IO_SCRIPT_POOL_DEAD 16
+
+/* refill interval without threads (ms) */
+#define IO_SCRIPT_POOL_TICK 10
+
+static const char *io_script_pool_script = NULL;
+static unsigned int io_script_pool_size = 0;
+static struct io_script_warm *io_script_pool[IO_SCRIPT_POOL_CMDS];
+static unsigned int io_script_pool_count[IO_SCRIPT_POOL_CMDS];
+static pid_t io_script_pool_dead[IO_SCRIPT_POOL_DEAD];
+static unsigned int io_script_pool_dead_count = 0;
+
+#if defined(USE_THREADS)
+static pthread_once_t io_script_pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t io_script_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_script_pool_cond = PTHREAD_COND_INITIALIZER;
+#define io_script_pool_lock() pthread_mutex_lock(&io_script_pool_lock)
+#define io_script_pool_unlock() pthread_mutex_unlock(&io_script_pool_lock)
+#else
+static int io_script_pool_started = 0;
+static struct evloop_watch *io_script_pool_timer = NULL;
+#define io_script_pool_lock() do {} while (0)
+#define io_script_pool_unlock() do {} while (0)
+#endif
+
+int io_script_pool_init (const char *script, unsigned int size)
+{
+	unsigned int i;
+
+	if (io_script_pool_size)
+		return -EEXIST;
+
+	for (i = 0; i < IO_SCRIPT_POOL_CMDS; ++i) {
+		io_script_pool[i] = calloc(size, sizeof(**io_script_pool));
+		if (!io_script_pool[i]) {
+			while (i--)
+				free(io_script_pool[i]);
+			return -ENOMEM;
+		}
+	}
+	io_script_pool_script = script;
+	io_script_pool_size = size;
+
+	return 0;
+}
+
+static int io_script_pool_spawn (unsigned int cmd, struct io_script_warm *w)
+{
+	char* args[] = {(char*)io_script_pool_script,
+			(char*)io_script_pool_cmds[cmd], NULL};
+
+	return pipe_open(io_script_pool_script, args, w->fds, &w->pid);
+}
+
+/* Find a command that needs more processes,
+ * must be called with the pool locked.
+ */
+static int io_script_pool_missing (void)
+{
+	unsigned int i;
+
+	for (i = 0; i < IO_SCRIPT_POOL_CMDS; ++i)
+		if (io_script_pool_count[i] < io_script_pool_size)
+			return i;
+	return -1;
+}
+
+/* Reap the killed processes that exited,
+ * must be called with the pool locked.
+ */
+static void io_script_pool_reap (void)
+{
+	unsigned int i = 0;
+
+	while (i < io_script_pool_dead_count) {
+		if (waitpid(io_script_pool_dead[i], NULL, WNOHANG) == 0)
+			++i;
+		else
+			io_script_pool_dead[i] = io_script_pool_dead[--io_script_pool_dead_count];
+	}
+}
+
+/* Kill a process that is not needed,
+ * must be called with the pool locked.
+ */
+static void io_script_pool_discard (struct io_script_warm *w)
+{
+	pipe_close(w->fds);
+	(void)kill(w->pid, SIGKILL);
+	io_script_pool_reap();
+	/* if the list is full, it stays a zombie */
+	if (io_script_pool_dead_count < IO_SCRIPT_POOL_DEAD)
+		io_script_pool_dead[io_script_pool_dead_count++] = w->pid;
+}
+
+static void io_script_pool_add (unsigned int cmd, struct io_script_warm *w)
+{
+	io_script_pool_lock();
+	if (io_script_pool_count[cmd] < io_script_pool_size)
+		io_script_pool[cmd][io_script_pool_count[cmd]++] = *w;
+	else
+		io_script_pool_discard(w);
+	io_script_pool_unlock();
+}
+
+#if ! defined(USE_THREADS)
+/* start one missing process per tick */
+static void io_script_pool_tick (struct evloop_watch *w, uint32_t __unused events,
+				 void __unused *arg)
+{
+	struct io_script_warm warm;
+	int cmd = io_script_pool_missing();
+
+	io_script_pool_reap();
+	if (cmd == -1 || io_script_pool_spawn(cmd, &warm)) {
+		evloop_del(w);
+		io_script_pool_timer = NULL;
+		return;
+	}
+	io_script_pool_add(cmd, &warm);
+}
+#endif
+
+void io_script_pool_refill (void)
+{
+#if ! defined(USE_THREADS)
+	struct evloop *loop = evloop_current();
+	int cmd;
+
+	if (!io_script_pool_started || io_script_pool_timer)
+		return;
+
+	if (loop) {
+		io_script_pool_timer = evloop_add_timer(loop, IO_SCRIPT_POOL_TICK,
+							io_script_pool_tick, NULL);
+		if (io_script_pool_timer)
+			return;
+	}
+
+	/* not called from an event loop */
+	while ((cmd = io_script_pool_missing()) != -1) {
+		struct io_script_warm w;
+
+		if (io_script_pool_spawn(cmd, &w))
+			break;
+		io_script_pool_add(cmd, &w);
+	}
+#endif
+}
+
+#if defined(USE_THREADS)
+static void* io_script_pool_thread (void *arg)
+{
+	(void)arg;
+
+	while (1) {
+		struct io_script_warm w;
+		int cmd;
+
+		pthread_mutex_lock(&io_script_pool_lock);
+		while ((cmd = io_script_pool_missing()) == -1)
+			pthread_cond_wait(&io_script_pool_cond, &io_script_pool_lock);
+		pthread_mutex_unlock(&io_script_pool_lock);
+
+		if (io_script_pool_spawn(cmd, &w)) {
+			/* do not spin when the system is out of resources */
+			sleep(1);
+			continue;
+		}
+		io_script_pool_add(cmd, &w);
+	}
+
+	return NULL;
+}
+
+static void io_script_pool_start (void)
+{
+	pthread_t t;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	(void)pthread_create(&t, &attr, io_script_pool_thread, NULL);
+	pthread_attr_destroy(&attr);
+}
+#endif
+
+int io_script_pool_take (const char *cmd, int fds[2], pid_t *pid)
+{
+	unsigned int i;
+
+	if (!io_script_pool_size)
+		return -ENOENT;
+
+#if defined(USE_THREADS)
+	(void)pthread_once(&io_script_pool_once, io_script_pool_start);
+#else
+	io_script_pool_started = 1;
+#endif
+
+	for (i = 0; i < IO_SCRIPT_POOL_CMDS; ++i)
+		if (strcmp(cmd, io_script_pool_cmds[i]) == 0)
+			break;
+	if (i == IO_SCRIPT_POOL_CMDS)
+		return -ENOENT;
+
+	io_script_pool_lock();
+	io_script_pool_reap();
+	while (io_script_pool_count[i]) {
+		struct io_script_warm w = io_script_pool[i][--io_script_pool_count[i]];
+
+		/* a script that already exited cannot be used */
+		if (waitpid(w.pid, NULL, WNOHANG) != 0) {
+			pipe_close(w.fds);
+			continue;
+		}
+#if defined(USE_THREADS)
+		pthread_cond_signal(&io_script_pool_cond);
+#endif
+		io_script_pool_unlock();
+		io_script_pool_refill();
+
+		fds[0] = w.fds[0];
+		fds[1] = w.fds[1];
+		*pid = w.pid;
+		return 0;
+	}
+#if defined(USE_THREADS)
+	pthread_cond_signal(&io_script_pool_cond);
+#endif
+	io_script_pool_unlock();
+	io_script_pool_refill();
+
+	return -ENOENT;
+}
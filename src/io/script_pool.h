@@ -0,0 +1,17 @@
+#include <sys/types.h>
+
+/* Warm scripts for the one-shot script mode, see script_pool.c */
+
+/** Keep size processes per command ready */
+int io_script_pool_init (const char *script, unsigned int size);
+
+/** Take a started script for cmd
+ * @return 0 or -ENOENT if none is available
+ */
+int io_script_pool_take (const char *cmd, int fds[2], pid_t *pid);
+
+/** Start the missing scripts (only needed without threads)
+ * Called from an event loop callback, this only arms a timer of
+ * that loop.
+ */
+void io_script_pool_refill (void);
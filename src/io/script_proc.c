@@ -0,0 +1,606 @@
+/* Copyright (C) 2006-2010 Hendrik Sattler <post@hendrik-sattler.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* Persistent script mode:
+ * The script is started once per thread with the argument "persistent"
+ * and handles all transfers of that thread. All messages in both
+ * directions are frames of the form
+ *   "<id> <kind> <length>\n" followed by <length> bytes
+ * where <id> identifies the transfer, so frames of different transfers
+ * may be interleaved. obexpushd sends "cmd" (command name in the first
+ * line, then the parameters as in the normal script mode), "data",
+ * "end" and "abort" frames. The script answers with "data" frames and
+ * exactly one "end" frame with the exit status as decimal text.
+ * Both pipes are non-blocking. The output of the script is read by the
+ * event loop of the thread as it arrives and queued for its transfer,
+ * frames that the pipe does not take are sent when it is writable.
+ * Only a transfer that waits for its own data polls the pipes itself,
+ * and then it keeps both directions going.
+ */
+
+#include "script_proc.h"
+#include "pipe.h"
+#include "evloop.h"
+#include "compiler.h"
+
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+/* time for a script to exit after its stdin was closed (ms) */
+#define IO_SCRIPT_PROC_GRACE 1000
+
+/* a writer waits when this much is not taken by the script yet */
+#define IO_SCRIPT_PROC_QUEUE (256 * 1024)
+
+/* largest frame that is accepted from the script */
+#define IO_SCRIPT_PROC_FRAME (16 * 1024 * 1024)
+
+/* longest frame header line */
+#define IO_SCRIPT_PROC_HEADER 64
+
+struct io_script_frame {
+	size_t len;
+	size_t pos;
+	struct io_script_frame *next;
+	uint8_t data[];
+};
+
+struct io_script_proc {
+	const char *script;
+	pid_t child;
+	int in;
+	int out;
+
+	/* in is watched by the event loop of the thread, out only
+	 * while frames are queued */
+	struct evloop_watch *watch_in;
+	struct evloop_watch *watch_out;
+
+	/* received data that is not a complete frame yet */
+	uint8_t *ibuf;
+	size_t ilen;
+	size_t isize;
+
+	/* frames that the pipe did not take yet */
+	uint8_t *obuf;
+	size_t olen;
+	size_t opos;
+	size_t osize;
+
+	unsigned int next_id;
+	struct io_script_xfer *xfers;
+};
+
+struct io_script_xfer {
+	struct io_script_proc *proc; /* NULL when the script is gone */
+	unsigned int id;
+
+	/* received data frames */
+	struct io_script_frame *first;
+	struct io_script_frame *last;
+
+	int end_sent;
+	int ended;
+	int status;
+
+	/* readable when ended, see io_script_xfer_wait_fd() */
+	int efd;
+
+	struct io_script_xfer *next;
+};
+
+/* the script of this thread, started with the first transfer */
+static __thread struct io_script_proc *io_script_proc = NULL;
+
+static void io_script_xfer_ended (struct io_script_xfer *x, int status)
+{
+	x->ended = 1;
+	x->status = status;
+	if (x->efd != -1)
+		(void)eventfd_write(x->efd, 1);
+}
+
+static void io_script_xfer_unlink (struct io_script_xfer *x)
+{
+	struct io_script_xfer **i;
+
+	if (!x->proc)
+		return;
+	for (i = &x->proc->xfers; *i; i = &(*i)->next) {
+		if (*i == x) {
+			*i = x->next;
+			break;
+		}
+	}
+	x->proc = NULL;
+}
+
+/* The script died or is out of sync: fail all its transfers */
+static void io_script_proc_stop (struct io_script_proc *p)
+{
+	while (p->xfers) {
+		struct io_script_xfer *x = p->xfers;
+
+		io_script_xfer_unlink(x);
+		if (!x->ended)
+			io_script_xfer_ended(x, -EPIPE);
+	}
+	if (p->watch_in)
+		evloop_del(p->watch_in);
+	if (p->watch_out)
+		evloop_del(p->watch_out);
+
+	/* closing stdin asks the script to exit */
+	(void)close(p->out);
+	(void)close(p->in);
+	pipe_reap(p->child, -1, IO_SCRIPT_PROC_GRACE);
+
+	if (io_script_proc == p)
+		io_script_proc = NULL;
+	free(p->ibuf);
+	free(p->obuf);
+	free(p);
+}
+
+static void io_script_proc_dispatch (struct io_script_proc *p, unsigned int id,
+				     const char *kind, const uint8_t *buf, size_t len)
+{
+	struct io_script_xfer *x;
+	struct io_script_frame *f;
+
+	/* frames of aborted transfers are dropped */
+	for (x = p->xfers; x; x = x->next) {
+		if (x->id == id)
+			break;
+	}
+	if (!x || x->ended)
+		return;
+
+	if (strcmp(kind, "data") == 0 && len) {
+		f = malloc(sizeof(*f) + len);
+		if (!f) {
+			io_script_xfer_ended(x, -ENOMEM);
+			return;
+		}
+		memcpy(f->data, buf, len);
+		f->len = len;
+		f->pos = 0;
+		f->next = NULL;
+		if (x->last)
+			x->last->next = f;
+		else
+			x->first = f;
+		x->last = f;
+
+	} else if (strcmp(kind, "end") == 0) {
+		char status[16];
+
+		if (len >= sizeof(status))
+			len = sizeof(status) - 1;
+		memcpy(status, buf, len);
+		status[len] = 0;
+		io_script_xfer_ended(x, (int)strtol(status, NULL, 10));
+	}
+}
+
+/* Hand all complete frames in the input buffer to their transfers */
+static int io_script_proc_parse (struct io_script_proc *p)
+{
+	size_t pos = 0;
+	int err = 0;
+
+	while (pos < p->ilen) {
+		uint8_t *start = p->ibuf + pos;
+		uint8_t *eol = memchr(start, '\n', p->ilen - pos);
+		char header[IO_SCRIPT_PROC_HEADER + 1];
+		char kind[16];
+		unsigned int id;
+		size_t hlen;
+		size_t len;
+
+		if (!eol) {
+			if (p->ilen - pos > IO_SCRIPT_PROC_HEADER)
+				err = -EPROTO;
+			break;
+		}
+		hlen = (size_t)(eol - start) + 1;
+		if (hlen > IO_SCRIPT_PROC_HEADER) {
+			err = -EPROTO;
+			break;
+		}
+		memcpy(header, start, hlen);
+		header[hlen] = 0;
+		if (sscanf(header, "%u %15s %zu", &id, kind, &len) != 3 ||
+		    len > IO_SCRIPT_PROC_FRAME)
+		{
+			err = -EPROTO;
+			break;
+		}
+		if (p->ilen - pos - hlen < len)
+			break;
+
+		io_script_proc_dispatch(p, id, kind, start + hlen, len);
+		pos += hlen + len;
+	}
+
+	p->ilen -= pos;
+	memmove(p->ibuf, p->ibuf + pos, p->ilen);
+
+	return err;
+}
+
+/* Read what the script sent so far
+ * @return 0 or a negative error number if the script is gone
+ */
+static int io_script_proc_input (struct io_script_proc *p)
+{
+	while (1) {
+		ssize_t n;
+
+		if (p->isize - p->ilen < 4096) {
+			size_t size = p->isize + 64 * 1024;
+			uint8_t *buf = realloc(p->ibuf, size);
+
+			if (!buf)
+				return -ENOMEM;
+			p->ibuf = buf;
+			p->isize = size;
+		}
+
+		n = read(p->in, p->ibuf + p->ilen, p->isize - p->ilen);
+		if (n == 0)
+			return -EPIPE;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+		p->ilen += n;
+	}
+
+	return io_script_proc_parse(p);
+}
+
+static void io_script_proc_out_cb (struct evloop_watch __unused *w,
+				   uint32_t __unused events, void *arg);
+
+/* Send as much of the queued frames as the pipe takes */
+static int io_script_proc_flush (struct io_script_proc *p)
+{
+	while (p->olen) {
+		ssize_t n = write(p->out, p->obuf + p->opos, p->olen);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+		p->opos += n;
+		p->olen -= n;
+	}
+	if (p->olen == 0)
+		p->opos = 0;
+
+	if (p->olen && !p->watch_out && p->watch_in) {
+		struct evloop *loop = evloop_watch_loop(p->watch_in);
+
+		p->watch_out = evloop_add(loop, p->out, EPOLLOUT,
+					  io_script_proc_out_cb, p);
+	} else if (!p->olen && p->watch_out) {
+		evloop_del(p->watch_out);
+		p->watch_out = NULL;
+	}
+
+	return 0;
+}
+
+static void io_script_proc_in_cb (struct evloop_watch __unused *w,
+				  uint32_t __unused events, void *arg)
+{
+	struct io_script_proc *p = arg;
+
+	if (io_script_proc_input(p) < 0)
+		io_script_proc_stop(p);
+}
+
+static void io_script_proc_out_cb (struct evloop_watch __unused *w,
+				   uint32_t __unused events, void *arg)
+{
+	struct io_script_proc *p = arg;
+
+	if (io_script_proc_flush(p) < 0)
+		io_script_proc_stop(p);
+}
+
+/* Let the event loop of the thread read the script, if there is one */
+static void io_script_proc_watch (struct io_script_proc *p)
+{
+	struct evloop *loop = evloop_current();
+
+	if (!p->watch_in && loop)
+		p->watch_in = evloop_add(loop, p->in, EPOLLIN,
+					 io_script_proc_in_cb, p);
+}
+
+/* Wait until the script sent something or takes queued frames
+ * @return 0 or a negative error number if the script is gone,
+ *         p is released then
+ */
+static int io_script_proc_wait (struct io_script_proc *p)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = p->in, .events = POLLIN },
+		{ .fd = p->out, .events = POLLOUT },
+	};
+	int err = 0;
+
+	if (poll(pfd, (p->olen? 2: 1), -1) == -1 && errno != EINTR)
+		err = -errno;
+	if (!err)
+		err = io_script_proc_flush(p);
+	if (!err)
+		err = io_script_proc_input(p);
+	if (err)
+		io_script_proc_stop(p);
+
+	return err;
+}
+
+static int io_script_proc_send (struct io_script_proc *p, unsigned int id,
+				const char *kind, const void *buf, size_t len)
+{
+	char header[IO_SCRIPT_PROC_HEADER];
+	int hlen = snprintf(header, sizeof(header), "%u %s %zu\n", id, kind, len);
+	size_t need;
+	int err;
+
+	if (p->opos) {
+		memmove(p->obuf, p->obuf + p->opos, p->olen);
+		p->opos = 0;
+	}
+	need = p->olen + hlen + len;
+	if (need > p->osize) {
+		uint8_t *buf = realloc(p->obuf, need);
+
+		if (!buf)
+			return -ENOMEM;
+		p->obuf = buf;
+		p->osize = need;
+	}
+	memcpy(p->obuf + p->olen, header, hlen);
+	if (len)
+		memcpy(p->obuf + p->olen + hlen, buf, len);
+	p->olen += hlen + len;
+
+	err = io_script_proc_flush(p);
+	if (err)
+		io_script_proc_stop(p);
+	return err;
+}
+
+static struct io_script_proc* io_script_proc_start (const char *script)
+{
+	char* args[] = {(char*)script, (char*)"persistent", NULL};
+	int fds[2] = {-1, -1};
+	struct io_script_proc *p = malloc(sizeof(*p));
+	int err;
+
+	if (!p)
+		return NULL;
+	memset(p, 0, sizeof(*p));
+	p->script = script;
+
+	err = pipe_open(script, args, fds, &p->child);
+	if (err) {
+		free(p);
+		errno = -err;
+		return NULL;
+	}
+	p->in = fds[0];
+	p->out = fds[1];
+	(void)fcntl(p->in, F_SETFL, fcntl(p->in, F_GETFL) | O_NONBLOCK);
+	(void)fcntl(p->out, F_SETFL, fcntl(p->out, F_GETFL) | O_NONBLOCK);
+
+	return p;
+}
+
+struct io_script_xfer* io_script_xfer_new (const char *script,
+					   const void *cmd, size_t len)
+{
+	struct io_script_proc *p = io_script_proc;
+	struct io_script_xfer *x = malloc(sizeof(*x));
+	int err;
+
+	if (!x)
+		return NULL;
+	memset(x, 0, sizeof(*x));
+	x->efd = -1;
+
+	if (!p) {
+		p = io_script_proc_start(script);
+		if (!p) {
+			err = errno;
+			free(x);
+			errno = err;
+			return NULL;
+		}
+		io_script_proc = p;
+	}
+	io_script_proc_watch(p);
+
+	if (++p->next_id == 0)
+		++p->next_id;
+	x->id = p->next_id;
+	x->proc = p;
+	x->next = p->xfers;
+	p->xfers = x;
+
+	err = io_script_proc_send(p, x->id, "cmd", cmd, len);
+	if (err) {
+		io_script_xfer_unlink(x);
+		free(x);
+		errno = -err;
+		return NULL;
+	}
+	return x;
+}
+
+int io_script_xfer_write (struct io_script_xfer *x, const void *buf, size_t len)
+{
+	struct io_script_proc *p = x->proc;
+	int err;
+
+	if (x->ended || !p)
+		return -EPIPE;
+
+	err = io_script_proc_send(p, x->id, "data", buf, len);
+
+	/* do not queue more than the script takes */
+	while (!err && x->proc && p->olen > IO_SCRIPT_PROC_QUEUE)
+		err = io_script_proc_wait(p);
+	if (!err && !x->proc)
+		err = -EPIPE;
+
+	return err;
+}
+
+ssize_t io_script_xfer_read (struct io_script_xfer *x, void *buf, size_t bufsize)
+{
+	size_t total = 0;
+	int err = 0;
+
+	while (total < bufsize) {
+		struct io_script_frame *f = x->first;
+
+		if (f) {
+			size_t n = f->len - f->pos;
+
+			if (n > bufsize - total)
+				n = bufsize - total;
+			memcpy((uint8_t*)buf + total, f->data + f->pos, n);
+			f->pos += n;
+			total += n;
+			if (f->pos == f->len) {
+				x->first = f->next;
+				if (!x->first)
+					x->last = NULL;
+				free(f);
+			}
+		} else if (x->ended) {
+			if (x->status < 0)
+				err = x->status;
+			break;
+		} else if (total) {
+			/* do not wait for more */
+			break;
+		} else if (x->proc) {
+			/* the frames of other transfers get queued */
+			(void)io_script_proc_wait(x->proc);
+		}
+	}
+
+	if (total == 0 && err)
+		return err;
+	return total;
+}
+
+/* Send the end of the transfer once */
+static int io_script_xfer_send_end (struct io_script_xfer *x)
+{
+	int err = 0;
+
+	if (!x->end_sent && !x->ended && x->proc) {
+		x->end_sent = 1;
+		err = io_script_proc_send(x->proc, x->id, "end", NULL, 0);
+	}
+	return err;
+}
+
+int io_script_xfer_end (struct io_script_xfer *x)
+{
+	struct io_script_proc *p = x->proc;
+	eventfd_t value;
+
+	(void)io_script_xfer_send_end(x);
+	if (x->efd != -1)
+		(void)eventfd_read(x->efd, &value);
+
+	if (!x->ended && p) {
+		io_script_proc_watch(p);
+		if (io_script_proc_flush(p) < 0 || io_script_proc_input(p) < 0)
+			io_script_proc_stop(p);
+	}
+	if (!x->ended && x->proc && !x->proc->watch_in) {
+		/* not in an event loop, the caller waits right here */
+		while (!x->ended && x->proc)
+			(void)io_script_proc_wait(x->proc);
+	}
+	if (!x->ended)
+		return -EINPROGRESS;
+
+	return (x->status < 0)? x->status: 0;
+}
+
+int io_script_xfer_wait_fd (struct io_script_xfer *x)
+{
+	if (x->efd == -1) {
+		x->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (x->efd != -1 && x->ended)
+			(void)eventfd_write(x->efd, 1);
+	}
+	return x->efd;
+}
+
+int io_script_xfer_finish (struct io_script_xfer *x, bool keep)
+{
+	int status = 0;
+
+	if (keep) {
+		int err = io_script_xfer_send_end(x);
+
+		while (!err && !x->ended && x->proc)
+			err = io_script_proc_wait(x->proc);
+		status = (x->ended? x->status: -EPIPE);
+
+	} else if (!x->ended && x->proc) {
+		/* nobody waits for the result, later frames get dropped */
+		(void)io_script_proc_send(x->proc, x->id, "abort", NULL, 0);
+	}
+
+	io_script_xfer_unlink(x);
+	while (x->first) {
+		struct io_script_frame *f = x->first;
+		x->first = f->next;
+		free(f);
+	}
+	if (x->efd != -1)
+		(void)close(x->efd);
+	free(x);
+
+	return status;
+}
@@ -0,0 +1,40 @@
+#include <sys/types.h>
+#include <stdbool.h>
+
+/* A long running script that handles many transfers, see script_proc.c */
+struct io_script_proc;
+struct io_script_xfer;
+
+/** Start a new transfer on the process of the calling thread,
+ * it is started if there is none
+ * @param cmd command line and parameters, terminated by an empty line
+ * @return the transfer or NULL on error (errno is set)
+ */
+struct io_script_xfer* io_script_xfer_new (const char *script,
+					   const void *cmd, size_t len);
+
+int io_script_xfer_write (struct io_script_xfer *x, const void *buf, size_t len);
+
+/** Read data of the transfer, waits only if nothing was received yet
+ * @return number of bytes, 0 at the end of data
+ */
+ssize_t io_script_xfer_read (struct io_script_xfer *x, void *buf, size_t bufsize);
+
+/** Send the end of the transfer without waiting for the answer
+ * @return -EINPROGRESS until the script ended the transfer,
+ *         then 0 or a negative error number
+ */
+int io_script_xfer_end (struct io_script_xfer *x);
+
+/** A descriptor that gets readable when the script ended the transfer
+ * @return the descriptor or -1 on error
+ */
+int io_script_xfer_wait_fd (struct io_script_xfer *x);
+
+/** End the transfer and release it
+ * With keep, this waits for the script to end the transfer. Without
+ * it, the transfer is aborted and not waited for.
+ * @param keep false if the script shall undo the transfer
+ * @return the status that was reported by the script or a negative error
+ */
+int io_script_xfer_finish (struct io_script_xfer *x, bool keep);
@@ -0,0 +1,601 @@
+/* Copyright (C) 2006-2010 Hendrik Sattler <post@hendrik-sattler.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* Write-behind layer for any I/O handler:
+ * Written data is copied to a per-client ring buffer and a single
+ * I/O thread passes it on to the real handler. When there is no room
+ * for another packet, the handler gets IO_STATE_BUSY and the response
+ * to the client is delayed until the eventfd from io_wait_fd() is
+ * readable (OBEX flow control). The same applies to io_finish() until
+ * all data was written. The thread is started on first use, so it
+ * runs in the process that serves the client.
+ * The thread writes one chunk per turn and then serves the next
+ * client, so a slow transfer does not hold up the others. An aborted
+ * transfer is handed over to the thread, which closes and frees it
+ * after its current chunk.
+ */
+
+#include "io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "compiler.h"
+
+/* room that is needed for the largest OBEX packet */
+#define IO_WB_HEADROOM (64 * 1024)
+
+/* maximum size of a write in one turn of the I/O thread */
+#define IO_WB_CHUNK (64 * 1024)
+
+enum io_wb_wait {
+	IO_WB_WAIT_NONE = 0,
+	IO_WB_WAIT_SPACE,
+	IO_WB_WAIT_IDLE,
+};
+
+struct io_wb_data {
+	struct io_handler *inner;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	uint8_t *buf;
+	size_t size;
+	size_t head; /* total bytes put into the ring */
+	size_t tail; /* total bytes written by the I/O thread */
+	int busy;    /* queued for or handled by the I/O thread */
+	int error;
+
+	/* signalled by the I/O thread */
+	int efd;
+	enum io_wb_wait waiting;
+	int inner_wait; /* io_finish() of the inner handler is pending */
+
+	/* released by the I/O thread, see io_wb_detach() */
+	int orphan;
+	struct io_transfer_data orphan_transfer;
+
+	struct io_wb_data *next;
+};
+
+static pthread_mutex_t io_wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_wb_cond = PTHREAD_COND_INITIALIZER;
+static struct io_wb_data *io_wb_first = NULL;
+static struct io_wb_data *io_wb_last = NULL;
+static pid_t io_wb_thread_pid = 0;
+
+/* must be called with data->lock held */
+static void io_wb_wakeup (struct io_wb_data *data, enum io_wb_wait reason)
+{
+	uint64_t n = 1;
+
+	if (data->waiting == IO_WB_WAIT_NONE)
+		return;
+	if (data->waiting == reason || data->error || !data->busy) {
+		data->waiting = IO_WB_WAIT_NONE;
+		(void)write(data->efd, &n, sizeof(n));
+	}
+}
+
+/* must be called with data->lock held */
+static void io_wb_wait (struct io_wb_data *data, enum io_wb_wait reason)
+{
+	uint64_t n;
+
+	/* drop a stale wakeup */
+	(void)read(data->efd, &n, sizeof(n));
+	data->waiting = reason;
+}
+
+static void io_wb_free (struct io_wb_data *data)
+{
+	close(data->efd);
+	pthread_cond_destroy(&data->cond);
+	pthread_mutex_destroy(&data->lock);
+	free(data->orphan_transfer.name);
+	free(data->orphan_transfer.path);
+	free(data->buf);
+	free(data);
+}
+
+/* the transfer was aborted while the I/O thread wrote */
+static void io_wb_release (struct io_wb_data *data)
+{
+	struct io_transfer_data *transfer = NULL;
+
+	if (data->orphan_transfer.name)
+		transfer = &data->orphan_transfer;
+	(void)io_close(data->inner, transfer, false);
+	io_destroy(data->inner);
+	io_wb_free(data);
+}
+
+/* Write one contiguous chunk,
+ * returns 1 if there is more to write for this client.
+ */
+static int io_wb_turn (struct io_wb_data *data)
+{
+	int orphan;
+
+	pthread_mutex_lock(&data->lock);
+	if (data->tail != data->head && !data->error) {
+		size_t offset = data->tail % data->size;
+		size_t len = data->head - data->tail;
+		ssize_t status;
+
+		/* only the contiguous part, the rest follows */
+		if (len > data->size - offset)
+			len = data->size - offset;
+		if (len > IO_WB_CHUNK)
+			len = IO_WB_CHUNK;
+
+		pthread_mutex_unlock(&data->lock);
+		status = io_write(data->inner, data->buf + offset, len);
+		pthread_mutex_lock(&data->lock);
+
+		if (status < 0)
+			data->error = (int)status;
+		else
+			data->tail += len;
+		if (data->size - (data->head - data->tail) >= IO_WB_HEADROOM)
+			io_wb_wakeup(data, IO_WB_WAIT_SPACE);
+		pthread_cond_broadcast(&data->cond);
+
+		if (data->tail != data->head && !data->error) {
+			pthread_mutex_unlock(&data->lock);
+			return 1;
+		}
+	}
+	data->busy = 0;
+	io_wb_wakeup(data, IO_WB_WAIT_IDLE);
+	pthread_cond_broadcast(&data->cond);
+	orphan = data->orphan;
+	pthread_mutex_unlock(&data->lock);
+
+	if (orphan)
+		io_wb_release(data);
+	return 0;
+}
+
+/* must be called with io_wb_lock held */
+static void io_wb_append (struct io_wb_data *data)
+{
+	if (io_wb_last)
+		io_wb_last->next = data;
+	else
+		io_wb_first = data;
+	io_wb_last = data;
+}
+
+static void* io_wb_thread (void __unused *arg)
+{
+	do {
+		struct io_wb_data *data;
+
+		pthread_mutex_lock(&io_wb_lock);
+		while (!io_wb_first)
+			pthread_cond_wait(&io_wb_cond, &io_wb_lock);
+		data = io_wb_first;
+		io_wb_first = data->next;
+		if (!io_wb_first)
+			io_wb_last = NULL;
+		data->next = NULL;
+		pthread_mutex_unlock(&io_wb_lock);
+
+		/* the others get their turn first */
+		if (io_wb_turn(data)) {
+			pthread_mutex_lock(&io_wb_lock);
+			io_wb_append(data);
+			pthread_mutex_unlock(&io_wb_lock);
+		}
+	} while (1);
+
+	return NULL;
+}
+
+/* must be called with io_wb_lock held */
+static int io_wb_thread_start (void)
+{
+	pthread_t t;
+	pthread_attr_t attr;
+	int err;
+
+	/* a thread of the parent process does not exist after fork() */
+	if (io_wb_thread_pid == getpid())
+		return 0;
+
+	io_wb_first = io_wb_last = NULL;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&t, &attr, io_wb_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (err)
+		return -err;
+
+	io_wb_thread_pid = getpid();
+	return 0;
+}
+
+/* must be called with data->lock held
+ * returns a negative error number if the caller must drain the data
+ * itself after releasing the lock
+ */
+static int io_wb_schedule (struct io_wb_data *data)
+{
+	int err;
+
+	if (data->busy)
+		return 0;
+
+	data->busy = 1;
+	pthread_mutex_lock(&io_wb_lock);
+	err = io_wb_thread_start();
+	if (err == 0) {
+		io_wb_append(data);
+		pthread_cond_signal(&io_wb_cond);
+	}
+	pthread_mutex_unlock(&io_wb_lock);
+
+	return err;
+}
+
+/* wait until the I/O thread wrote everything */
+static int io_wb_sync (struct io_wb_data *data)
+{
+	int err;
+
+	pthread_mutex_lock(&data->lock);
+	while (data->busy)
+		pthread_cond_wait(&data->cond, &data->lock);
+	err = data->error;
+	pthread_mutex_unlock(&data->lock);
+
+	return err;
+}
+
+static ssize_t io_wb_write (struct io_handler *self, const void *buf, size_t len)
+{
+	struct io_wb_data *data = self->private_data;
+	const uint8_t *ptr = buf;
+	size_t left = len;
+	int err = 0;
+	int inline_drain = 0;
+
+	self->state &= ~IO_STATE_BUSY;
+	pthread_mutex_lock(&data->lock);
+	if (data->error)
+		err = data->error;
+	else if (len > data->size - (data->head - data->tail))
+		/* the caller did not wait for IO_STATE_BUSY to clear */
+		err = -ENOBUFS;
+
+	while (!err && left) {
+		size_t offset = data->head % data->size;
+		size_t n = data->size - offset;
+
+		if (n > left)
+			n = left;
+		memcpy(data->buf + offset, ptr, n);
+		data->head += n;
+		ptr += n;
+		left -= n;
+	}
+	if (!err) {
+		inline_drain = (io_wb_schedule(data) < 0);
+		if (!inline_drain &&
+		    data->size - (data->head - data->tail) < IO_WB_HEADROOM)
+		{
+			/* this delays the response to the client */
+			io_wb_wait(data, IO_WB_WAIT_SPACE);
+			self->state |= IO_STATE_BUSY;
+		}
+	}
+	pthread_mutex_unlock(&data->lock);
+
+	if (inline_drain) {
+		while (io_wb_turn(data))
+			;
+		err = data->error;
+	}
+	if (err)
+		return err;
+	return len;
+}
+
+static int io_wb_open (struct io_handler *self, struct io_transfer_data *transfer,
+		       enum io_type t)
+{
+	struct io_wb_data *data = self->private_data;
+	int err;
+
+	(void)io_wb_sync(data);
+	data->head = data->tail = 0;
+	data->error = 0;
+
+	err = io_open(data->inner, transfer, t);
+	self->state = io_state(data->inner);
+
+	return err;
+}
+
+static int io_wb_finish (struct io_handler *self, struct io_transfer_data *transfer)
+{
+	struct io_wb_data *data = self->private_data;
+	int err;
+
+	data->inner_wait = 0;
+	pthread_mutex_lock(&data->lock);
+	if (data->busy) {
+		io_wb_wait(data, IO_WB_WAIT_IDLE);
+		pthread_mutex_unlock(&data->lock);
+		return -EINPROGRESS;
+	}
+	err = data->error;
+	pthread_mutex_unlock(&data->lock);
+	if (err)
+		return err;
+
+	err = io_finish(data->inner, transfer);
+	data->inner_wait = (err == -EINPROGRESS);
+	self->state = io_state(data->inner);
+
+	return err;
+}
+
+static int io_wb_wait_fd (struct io_handler *self, int *timeout)
+{
+	struct io_wb_data *data = self->private_data;
+
+	if (data->inner_wait)
+		return io_wait_fd(data->inner, timeout);
+	else
+		return data->efd;
+}
+
+static struct io_wb_data* io_wb_data_new (struct io_handler *inner, size_t size);
+
+/* Stop the I/O thread at the next chunk without waiting for it:
+ * a busy data is handed over to the thread together with a copy of
+ * the transfer to close, the handler gets a new one.
+ * Returns 1 if data was handed over.
+ */
+static int io_wb_detach (struct io_handler *self, struct io_transfer_data *transfer)
+{
+	struct io_wb_data *data = self->private_data;
+	struct io_wb_data *fresh = NULL;
+	struct io_handler *inner;
+	int orphan = 0;
+
+	pthread_mutex_lock(&data->lock);
+	if (data->busy && !data->error)
+		data->error = -ECANCELED;
+	orphan = data->busy;
+	pthread_mutex_unlock(&data->lock);
+	if (!orphan)
+		return 0;
+
+	/* without memory, the caller waits for the thread */
+	inner = io_dup(data->inner);
+	if (inner)
+		fresh = io_wb_data_new(inner, data->size);
+	if (!fresh) {
+		io_destroy(inner);
+		return 0;
+	}
+	if (transfer && transfer->name) {
+		data->orphan_transfer.name = (uint8_t*)strdup((char*)transfer->name);
+		if (transfer->path)
+			data->orphan_transfer.path = (uint8_t*)strdup((char*)transfer->path);
+	}
+
+	pthread_mutex_lock(&data->lock);
+	orphan = data->busy;
+	data->orphan = orphan;
+	pthread_mutex_unlock(&data->lock);
+
+	if (!orphan) {
+		/* the thread was faster */
+		io_destroy(fresh->inner);
+		io_wb_free(fresh);
+		free(data->orphan_transfer.name);
+		free(data->orphan_transfer.path);
+		memset(&data->orphan_transfer, 0, sizeof(data->orphan_transfer));
+		return 0;
+	}
+	self->private_data = fresh;
+	return 1;
+}
+
+static int io_wb_close (struct io_handler *self, struct io_transfer_data *transfer,
+			bool keep)
+{
+	struct io_wb_data *data;
+	int err;
+	int ret;
+
+	if (!keep && io_wb_detach(self, transfer)) {
+		self->state = 0;
+		return 0;
+	}
+
+	/* after io_finish(), there is nothing left to wait for */
+	data = self->private_data;
+	err = io_wb_sync(data);
+	data->inner_wait = 0;
+
+	ret = io_close(data->inner, transfer, keep && !err);
+	self->state = io_state(data->inner);
+	data->head = data->tail = 0;
+	data->error = 0;
+
+	return (err? err: ret);
+}
+
+static int io_wb_delete (struct io_handler *self, struct io_transfer_data *transfer)
+{
+	struct io_wb_data *data = self->private_data;
+
+	return io_delete(data->inner, transfer);
+}
+
+static ssize_t io_wb_read (struct io_handler *self, void *buf, size_t bufsize)
+{
+	struct io_wb_data *data = self->private_data;
+	ssize_t status = io_read(data->inner, buf, bufsize);
+
+	self->state = io_state(data->inner);
+	return status;
+}
+
+static ssize_t io_wb_fill (struct io_handler *self, void *buf, size_t bufsize)
+{
+	struct io_wb_data *data = self->private_data;
+	ssize_t status = io_fill(data->inner, buf, bufsize);
+
+	self->state = io_state(data->inner);
+	return status;
+}
+
+static int io_wb_check_dir (struct io_handler *self, const uint8_t *dir)
+{
+	struct io_wb_data *data = self->private_data;
+
+	return io_check_dir(data->inner, dir);
+}
+
+static int io_wb_create_dir (struct io_handler *self, const uint8_t *dir)
+{
+	struct io_wb_data *data = self->private_data;
+
+	return io_create_dir(data->inner, dir);
+}
+
+static int io_wb_set_option (struct io_handler *self, const char *name, const char *value)
+{
+	struct io_wb_data *data = self->private_data;
+
+	return io_set_option(data->inner, name, value);
+}
+
+static void io_wb_cleanup (struct io_handler *self)
+{
+	struct io_wb_data *data = self->private_data;
+
+	if (data) {
+		if (io_wb_detach(self, NULL)) {
+			data = self->private_data;
+		} else {
+			(void)io_wb_sync(data);
+		}
+		io_destroy(data->inner);
+		io_wb_free(data);
+		self->private_data = NULL;
+	}
+}
+
+static struct io_handler* io_wb_dup (struct io_handler *self)
+{
+	struct io_wb_data *data = self->private_data;
+	struct io_handler *inner = io_dup(data->inner);
+	struct io_handler *h;
+
+	if (!inner)
+		return NULL;
+
+	h = io_writebehind_init(inner, data->size);
+	if (!h)
+		io_destroy(inner);
+	return h;
+}
+
+static struct io_handler_ops io_wb_ops = {
+	.dup = io_wb_dup,
+	.cleanup = io_wb_cleanup,
+
+	.open = io_wb_open,
+	.close = io_wb_close,
+	.finish = io_wb_finish,
+	.wait_fd = io_wb_wait_fd,
+	.delete = io_wb_delete,
+	.read = io_wb_read,
+	.write = io_wb_write,
+	.fill = io_wb_fill,
+
+	.check_dir = io_wb_check_dir,
+	.create_dir = io_wb_create_dir,
+
+	.set_option = io_wb_set_option,
+};
+
+static struct io_wb_data* io_wb_data_new (struct io_handler *inner, size_t size)
+{
+	struct io_wb_data *data = malloc(sizeof(*data));
+
+	if (!data)
+		return NULL;
+	memset(data, 0, sizeof(*data));
+
+	data->buf = malloc(size);
+	if (!data->buf) {
+		free(data);
+		return NULL;
+	}
+	data->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (data->efd == -1) {
+		free(data->buf);
+		free(data);
+		return NULL;
+	}
+	data->size = size;
+	data->inner = inner;
+	pthread_mutex_init(&data->lock, NULL);
+	pthread_cond_init(&data->cond, NULL);
+
+	return data;
+}
+
+struct io_handler* io_writebehind_init (struct io_handler *inner, size_t size)
+{
+	struct io_handler *handle;
+	struct io_wb_data *data;
+
+	if (!inner || size < 2 * IO_WB_HEADROOM) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	handle = malloc(sizeof(*handle));
+	if (!handle)
+		return NULL;
+	memset(handle, 0, sizeof(*handle));
+
+	data = io_wb_data_new(inner, size);
+	if (!data) {
+		free(handle);
+		return NULL;
+	}
+
+	handle->ops = &io_wb_ops;
+	handle->private_data = data;
+
+	return handle;
+}
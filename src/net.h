@@ -37,6 +37,11 @@ struct net_handler_ops {
 
 	int (*get_listen_fd)(struct net_handler*);
 
+	/* Accept a connection on a listener that is not handled by
+	 * OBEX_ServerAccept(), returns the new transport handle.
+	 */
+	obex_t* (*accept)(struct net_handler*, obex_event_t);
+
 	enum net_life_status (*get_life_status)(struct net_handler*);
 };
 
@@ -51,6 +56,7 @@ struct net_handler* bluetooth_setup(char* device_addr, uint8_t);
 struct net_handler* irda_setup(char*);
 #if OPENOBEX_TCPOBEX
 struct net_handler* tcp_setup(const char*, uint16_t);
+void tcp_set_reuseport(struct net_handler*, int);
 #else /* OPENOBEX_TCPOBEX */
 struct net_handler* inet_setup();
 #endif /* OPENOBEX_TCPOBEX */
@@ -61,6 +67,9 @@ struct net_data {
 	obex_t* obex;
 	struct net_handler *handler;
 
+	/* the accepted transport handle if obex is a session handle on top of it */
+	obex_t* link;
+
 	/* auth */
 	int auth_success;
 #define AUTH_LEVEL_OBEX      (1 << 0)
@@ -79,6 +88,7 @@ uint8_t net_security_init (
 int net_security_check (struct net_data* data);
 void net_security_cleanup (struct net_data* data);
 void net_get_peer (struct net_data* data, char* buffer, size_t bufsiz);
+obex_t* net_accept (struct net_data* data, obex_event_t eventcb);
 void net_disconnect (struct net_data* data);
 void net_cleanup (struct net_data* data);
 int net_get_listen_fd(struct net_data* data);
@@ -87,6 +87,19 @@ void net_init (
 	}
 }
 
+obex_t* net_accept (
+	struct net_data* data,
+	obex_event_t eventcb
+)
+{
+	struct net_handler *h = data->handler;
+
+	if (h && h->ops->accept)
+		return h->ops->accept(h, eventcb);
+	else
+		return OBEX_ServerAccept(data->obex, eventcb, NULL);
+}
+
 void net_disconnect (
 	struct net_data* data
 )
@@ -94,6 +107,15 @@ void net_disconnect (
 	(void)OBEX_TransportDisconnect(data->obex);
 }
 
+/* handle that owns the transport connection */
+static obex_t* net_get_link (struct net_data* data)
+{
+	if (data->link)
+		return data->link;
+	else
+		return data->obex;
+}
+
 uint8_t net_security_init (
 	struct net_data* data,
 	struct auth_handler* auth,
@@ -104,7 +126,7 @@ uint8_t net_security_init (
 
 	if ((data->auth_level & AUTH_LEVEL_TRANSPORT) &&
 	    h && h->ops->security_check &&
-	    !h->ops->security_check(h, data->obex))
+	    !h->ops->security_check(h, net_get_link(data)))
 	{
 		return OBEX_RSP_FORBIDDEN;
 	}
@@ -129,7 +151,7 @@ int net_security_check (struct net_data* data)
 
 	if ((data->auth_level & AUTH_LEVEL_TRANSPORT) &&
 	    h && h->ops->security_check)
-		transport = h->ops->security_check(h, data->obex);
+		transport = h->ops->security_check(h, net_get_link(data));
 
 	if ((data->auth_level & AUTH_LEVEL_OBEX))
 		obex = data->auth_success;
@@ -142,18 +164,20 @@ void net_get_peer (struct net_data* data, char* buffer, size_t bufsiz)
 	struct net_handler *h = data->handler;
 
 	if (h && h->ops->get_peer)
-		(void)h->ops->get_peer(h, data->obex, buffer, bufsiz);
+		(void)h->ops->get_peer(h, net_get_link(data), buffer, bufsiz);
 }
 
 int net_get_listen_fd(struct net_data* data)
 {
 	struct net_handler *h = data->handler;
+	int fd = -1;
 
 	if (h && h->ops->get_listen_fd)
-		return h->ops->get_listen_fd(h);
-	else
-		return OBEX_GetFD(data->obex);
-	
+		fd = h->ops->get_listen_fd(h);
+	if (fd == -1)
+		fd = OBEX_GetFD(data->obex);
+
+	return fd;
 }
 
 enum net_life_status net_get_life_status(struct net_data* data)
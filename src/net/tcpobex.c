@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 
@@ -19,8 +21,151 @@ struct tcp_args {
 	char* address;
 	uint16_t port;
 	char* intf;
+
+	/* own listening socket when sharing the port with other processes */
+	int reuseport;
+	int fd;
+	obex_event_t eventcb;
+	obex_ctrans_t ctrans;
+};
+
+union tcp_addr {
+	struct sockaddr     raw;
+	struct sockaddr_in  in4;
+	struct sockaddr_in6 in6;
 };
 
+static
+int tcp_get_addr (
+	struct tcp_args* args,
+	union tcp_addr* addr
+)
+{
+	char* addrstr = args->address;
+
+	if (!args->address || strcmp(args->address, "*") == 0)
+		addrstr = "::";
+
+	if (!args->intf) {
+		char* intf = strchr(addrstr, '%');
+		if (intf) {
+			*intf = 0;
+			args->intf = strdup(intf+1);
+		}
+	}
+	if (inet_pton(AF_INET6, addrstr, &addr->in6.sin6_addr) == 1) {
+		addr->raw.sa_family = AF_INET6;
+		addr->in6.sin6_port = htons(args->port);
+		addr->in6.sin6_flowinfo = 0;
+		addr->in6.sin6_scope_id = 0;
+		if (IN6_IS_ADDR_LINKLOCAL(&addr->in6.sin6_addr)) {
+			if (args->intf)
+				addr->in6.sin6_scope_id = if_nametoindex(args->intf);
+		}
+		return sizeof(addr->in6);
+
+	} else if (inet_pton(AF_INET, addrstr, &addr->in4.sin_addr) == 1) {
+		addr->raw.sa_family = AF_INET;
+		addr->in4.sin_port = htons(args->port);
+		return sizeof(addr->in4);
+
+	} else {
+		return -EINVAL;
+	}
+}
+
+static
+int tcp_ctrans_listen (obex_t __unused *handle, void __unused *customdata)
+{
+	return 0;
+}
+
+static
+int tcp_ctrans_disconnect (obex_t __unused *handle, void __unused *customdata)
+{
+	return 0;
+}
+
+static
+int tcp_ctrans_write (obex_t __unused *handle, void __unused *customdata,
+		      uint8_t __unused *buf, int __unused buflen)
+{
+	return -1;
+}
+
+/* The listener handle never transfers data, it only signals that
+ * a connection can be accepted with tcp_accept().
+ */
+static
+int tcp_ctrans_handleinput (obex_t *handle, void *customdata, int timeout)
+{
+	struct tcp_args* args = customdata;
+	struct pollfd pfd = {
+		.fd = args->fd,
+		.events = POLLIN,
+	};
+	int ret;
+
+	if (args->fd == -1)
+		return -1;
+
+	ret = poll(&pfd, 1, (timeout < 0)? -1: timeout * 1000);
+	if (ret <= 0)
+		return ret;
+
+	args->eventcb(handle, NULL, OBEX_MODE_SERVER, OBEX_EV_ACCEPTHINT, 0, 0);
+	return 1;
+}
+
+static
+obex_t* tcp_init_reuseport (
+	struct tcp_args* args,
+	union tcp_addr* addr,
+	socklen_t addrlen,
+	obex_event_t eventcb
+)
+{
+	obex_t* handle;
+	int one = 1;
+
+	args->fd = socket(addr->raw.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (args->fd == -1)
+		return NULL;
+
+	if (setsockopt(args->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+	    setsockopt(args->fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1 ||
+	    bind(args->fd, &addr->raw, addrlen) == -1 ||
+	    listen(args->fd, SOMAXCONN) == -1)
+	{
+		perror("Setting up shared TCP socket");
+		goto err_out;
+	}
+
+	handle = OBEX_Init(OBEX_TRANS_CUSTOM, eventcb, OBEX_FL_KEEPSERVER);
+	if (!handle)
+		goto err_out;
+
+	args->eventcb = eventcb;
+	args->ctrans.listen = tcp_ctrans_listen;
+	args->ctrans.disconnect = tcp_ctrans_disconnect;
+	args->ctrans.write = tcp_ctrans_write;
+	args->ctrans.handleinput = tcp_ctrans_handleinput;
+	args->ctrans.customdata = args;
+	if (OBEX_RegisterCTransport(handle, &args->ctrans) == -1 ||
+	    OBEX_ServerRegister(handle, NULL, 0) == -1)
+	{
+		OBEX_Cleanup(handle);
+		goto err_out;
+	}
+
+	return handle;
+
+err_out:
+	(void)close(args->fd);
+	args->fd = -1;
+	return NULL;
+}
+
 static
 obex_t* tcp_init (
 	struct net_handler *h,
@@ -28,47 +173,23 @@ obex_t* tcp_init (
 )
 {
 	struct tcp_args* args = h->args;
-	obex_t* handle = OBEX_Init(OBEX_TRANS_INET,eventcb,OBEX_FL_KEEPSERVER);
-	
-	if (!handle)
+	obex_t* handle;
+	union tcp_addr addr;
+	int addrlen;
+
+	addrlen = tcp_get_addr(args, &addr);
+	if (addrlen < 0)
 		return NULL;
 
-	{
-		union {
-			struct sockaddr     raw;
-			struct sockaddr_in  in4;
-			struct sockaddr_in6 in6;
-		} addr;
-		char* addrstr = args->address;
-		int af = AF_UNSPEC;
-
-		if (!args->address || strcmp(args->address, "*") == 0)
-			addrstr = "::";
-			
-		if (!args->intf) {
-			char* intf = strchr(addrstr, '%');
-			if (intf) {
-				*intf = 0;
-				args->intf = strdup(intf+1);
-			}
-		}
-		if (inet_pton(AF_INET6, addrstr, &addr.in6.sin6_addr) == 1) {
-			addr.raw.sa_family = AF_INET6;
-			addr.in6.sin6_port = htons(args->port);
-			addr.in6.sin6_flowinfo = 0;
-			addr.in6.sin6_scope_id = 0;
-			if (IN6_IS_ADDR_LINKLOCAL(&addr.in6.sin6_addr)) {
-				if (args->intf)
-					addr.in6.sin6_scope_id = if_nametoindex(args->intf);
-			}
-
-		} else if (inet_pton(AF_INET, args->address, &addr.in4.sin_addr) == 1) {
-			addr.raw.sa_family = af = AF_INET;
-			addr.in4.sin_port = htons(args->port);
-
-		} else {
+	if (args->reuseport) {
+		handle = tcp_init_reuseport(args, &addr, addrlen, eventcb);
+		if (!handle)
+			return NULL;
+
+	} else {
+		handle = OBEX_Init(OBEX_TRANS_INET,eventcb,OBEX_FL_KEEPSERVER);
+		if (!handle)
 			return NULL;
-		}
 
 		if (TcpOBEX_ServerRegister(handle, &addr.raw, sizeof(addr)) == -1) {
 			perror("TcpOBEX_ServerRegister");
@@ -76,13 +197,70 @@ obex_t* tcp_init (
 
 		}
 		OBEX_SetTransportMTU(handle, OBEX_MAXIMUM_MTU, OBEX_MAXIMUM_MTU);
-		fprintf(stderr, "Listening on tcp/%s:%d\n",
-			(args->address? args->address: "*"),
-			args->port);
 	}
+	fprintf(stderr, "Listening on tcp/%s:%d\n",
+		(args->address? args->address: "*"),
+		args->port);
+
 	return handle;
 }
 
+static
+obex_t* tcp_accept (
+	struct net_handler *h,
+	obex_event_t eventcb
+)
+{
+	struct tcp_args* args = h->args;
+	obex_t* handle;
+	int fd;
+
+	if (args->fd == -1)
+		return NULL;
+
+	/* the accepted socket does not inherit O_NONBLOCK */
+	fd = accept4(args->fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	handle = OBEX_Init(OBEX_TRANS_FD, eventcb, 0);
+	if (!handle) {
+		(void)close(fd);
+		return NULL;
+	}
+	if (FdOBEX_TransportSetup(handle, fd, fd, OBEX_MAXIMUM_MTU) == -1) {
+		OBEX_Cleanup(handle);
+		(void)close(fd);
+		return NULL;
+	}
+	OBEX_SetTransportMTU(handle, OBEX_MAXIMUM_MTU, OBEX_MAXIMUM_MTU);
+
+	return handle;
+}
+
+static
+int tcp_get_listen_fd (
+	struct net_handler *h
+)
+{
+	struct tcp_args* args = h->args;
+
+	return args->fd;
+}
+
+static
+void tcp_cleanup (
+	struct net_handler *h
+)
+{
+	struct tcp_args* args = h->args;
+
+	if (args->fd != -1) {
+		(void)close(args->fd);
+		args->fd = -1;
+	}
+}
+
 static
 int tcp_security_check(
 	struct net_handler __unused *h,
@@ -159,8 +337,11 @@ int tcp_get_peer(
 static
 struct net_handler_ops tcp_ops = {
 	.init = tcp_init,
+	.cleanup = tcp_cleanup,
 	.get_peer = tcp_get_peer,
 	.security_check = tcp_security_check,
+	.get_listen_fd = tcp_get_listen_fd,
+	.accept = tcp_accept,
 };
 
 struct net_handler* tcp_setup(
@@ -188,6 +369,18 @@ struct net_handler* tcp_setup(
 		args->address = NULL;
 	args->port = port;
 	args->intf = NULL;
+	args->reuseport = 0;
+	args->fd = -1;
 
 	return h;
 }
+
+void tcp_set_reuseport (
+	struct net_handler* h,
+	int enable
+)
+{
+	struct tcp_args* args = h->args;
+
+	args->reuseport = enable;
+}
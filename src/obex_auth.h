@@ -49,6 +49,19 @@ struct obex_auth_response {
 	size_t ulen;
 };
 
+/** A pending check of an OBEX authentication response
+ */
+struct obex_auth_check {
+	const struct obex_auth_response *resp;
+
+	/** the password to check against */
+	const uint8_t *pass;
+	size_t len;
+
+	/** set to 1 if the response matches, else 0 */
+	int result;
+};
+
 /*
  * OBEX authentication helper
  */
@@ -59,6 +72,8 @@ int OBEX_AuthUnpackResponse(const obex_headerdata_t h, uint32_t size,
 			    struct obex_auth_response *resp);
 int OBEX_AuthCheckResponse(const struct obex_auth_response *resp,
 			   const uint8_t *pass, size_t len);
+int OBEX_AuthCheckResponses(struct obex_auth_check *check,
+			    unsigned int count);
 int OBEX_AuthUnpackChallenge(const obex_headerdata_t h, uint32_t hsize,
 			     struct obex_auth_challenge *chal,
 			     size_t csize);
@@ -51,6 +51,19 @@ int OBEX_AuthCheckResponse(const struct obex_auth_response *resp,
 	return obex_auth_check_response(resp, pass, len);
 }
 
+/**
+	Check several OBEX authentication responses at once
+	\param check the responses with their passwords, result is set for each
+	\param count number of elements in check
+	\return 0 on success, else a negative error code value
+ */
+int OBEX_AuthCheckResponses(struct obex_auth_check *check,
+			    unsigned int count)
+{
+	obex_return_val_if_fail(check != NULL || count == 0, -EINVAL);
+	return obex_auth_check_responses(check, count);
+}
+
 /**
 	Unpack the OBEX authentication challenge header
 	\param h header data that contains the response header
@@ -0,0 +1,169 @@
+/* Multi-buffer MD5:
+ * The digests of several messages are computed together, one message
+ * per lane of a vector. This is the same algorithm as in md5.c, only
+ * the state words are vectors. The widest implementation that the CPU
+ * supports is selected at run time: 16 lanes with AVX-512, 8 lanes
+ * with AVX2 and 4 lanes otherwise (SSE2 on x86, or whatever the
+ * compiler makes of the generic vectors). A single message uses one
+ * lane, which is the same work as a scalar implementation.
+ */
+
+#include "md5mb.h"
+
+#include <string.h>
+
+#define F1(x, y, z) (z ^ (x & (y ^ z)))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) (x ^ y ^ z)
+#define F4(x, y, z) (y ^ (x | ~z))
+
+#define MD5STEP(f,w,x,y,z,in,s) \
+	 (w += f(x,y,z) + in, w = (w<<s | w>>(32-s)) + x)
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(__GNUC__ >= 5 || defined(__clang__))
+#define MD5MB_X86 1
+#endif
+
+static size_t md5mb_len (const struct md5mb_job *job)
+{
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < MD5MB_PARTS; ++i)
+		len += job->part[i].len;
+	return len;
+}
+
+/* number of blocks after padding */
+static size_t md5mb_blocks (const struct md5mb_job *job)
+{
+	return (md5mb_len(job) + 8) / 64 + 1;
+}
+
+/* Get block n of the padded message as little-endian words */
+static void md5mb_block (const struct md5mb_job *job, size_t n, uint32_t w[16])
+{
+	uint8_t block[64];
+	size_t start = 64 * n;
+	size_t pos = 0;
+	size_t len;
+	unsigned int i;
+
+	memset(block, 0, sizeof(block));
+	for (i = 0; i < MD5MB_PARTS; ++i) {
+		size_t plen = job->part[i].len;
+
+		if (pos + plen > start && pos < start + 64) {
+			size_t from = (start > pos)? start - pos: 0;
+			size_t to = (pos + plen < start + 64)? plen: start + 64 - pos;
+
+			memcpy(block + (pos + from - start), job->part[i].data + from, to - from);
+		}
+		pos += plen;
+	}
+
+	len = pos;
+	if (len >= start && len < start + 64)
+		block[len - start] = 0x80;
+	if (n == md5mb_blocks(job) - 1) {
+		uint64_t bits = (uint64_t)len << 3;
+
+		for (i = 0; i < 8; ++i)
+			block[56 + i] = (bits >> (8 * i)) & 0xFF;
+	}
+
+	for (i = 0; i < 16; ++i)
+		w[i] = (uint32_t)block[4 * i] |
+			(uint32_t)block[4 * i + 1] << 8 |
+			(uint32_t)block[4 * i + 2] << 16 |
+			(uint32_t)block[4 * i + 3] << 24;
+}
+
+#define MD5MB_LANES 1
+#define MD5MB_VEC md5mb_v1
+#define MD5MB_FUNC md5mb_1
+#define MD5MB_ATTR
+#include "md5mb_lanes.h"
+#undef MD5MB_LANES
+#undef MD5MB_VEC
+#undef MD5MB_FUNC
+#undef MD5MB_ATTR
+
+#define MD5MB_LANES 4
+#define MD5MB_VEC md5mb_v4
+#define MD5MB_FUNC md5mb_4
+#define MD5MB_ATTR
+#include "md5mb_lanes.h"
+#undef MD5MB_LANES
+#undef MD5MB_VEC
+#undef MD5MB_FUNC
+#undef MD5MB_ATTR
+
+#if defined(MD5MB_X86)
+#define MD5MB_LANES 8
+#define MD5MB_VEC md5mb_v8
+#define MD5MB_FUNC md5mb_8
+#define MD5MB_ATTR __attribute__((target("avx2")))
+#include "md5mb_lanes.h"
+#undef MD5MB_LANES
+#undef MD5MB_VEC
+#undef MD5MB_FUNC
+#undef MD5MB_ATTR
+
+#define MD5MB_LANES 16
+#define MD5MB_VEC md5mb_v16
+#define MD5MB_FUNC md5mb_16
+#define MD5MB_ATTR __attribute__((target("avx512f")))
+#include "md5mb_lanes.h"
+#undef MD5MB_LANES
+#undef MD5MB_VEC
+#undef MD5MB_FUNC
+#undef MD5MB_ATTR
+#endif
+
+/* maximum number of lanes, 0 if not checked yet */
+static unsigned int md5mb_width = 0;
+
+static unsigned int md5mb_get_width (void)
+{
+	unsigned int width = __atomic_load_n(&md5mb_width, __ATOMIC_RELAXED);
+
+	if (width)
+		return width;
+
+	width = 4;
+#if defined(MD5MB_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		width = 16;
+	else if (__builtin_cpu_supports("avx2"))
+		width = 8;
+#endif
+	__atomic_store_n(&md5mb_width, width, __ATOMIC_RELAXED);
+
+	return width;
+}
+
+void md5mb (struct md5mb_job *job, unsigned int count)
+{
+	unsigned int width = md5mb_get_width();
+
+	while (count) {
+		unsigned int n = (count < width)? count: width;
+
+		if (n == 1)
+			md5mb_1(job, n);
+#if defined(MD5MB_X86)
+		else if (n > 8)
+			md5mb_16(job, n);
+		else if (n > 4)
+			md5mb_8(job, n);
+#endif
+		else
+			md5mb_4(job, n);
+
+		job += n;
+		count -= n;
+	}
+}
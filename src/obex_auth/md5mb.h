@@ -0,0 +1,18 @@
+#include <unistd.h>
+#include <inttypes.h>
+
+/* MD5 of several independent messages at once, see md5mb.c */
+
+#define MD5MB_PARTS 3
+
+struct md5mb_job {
+	/* the message is the concatenation of all parts */
+	struct {
+		const uint8_t *data;
+		size_t len;
+	} part[MD5MB_PARTS];
+
+	uint8_t digest[16];
+};
+
+void md5mb (struct md5mb_job *job, unsigned int count);
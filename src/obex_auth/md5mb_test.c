@@ -0,0 +1,69 @@
+/* Known-answer test of md5mb() against md5.c
+ *
+ * Messages of all lengths around the block boundaries are split into
+ * parts at different points and hashed in batches of all sizes up to
+ * more than the widest vector, so that every implementation and the
+ * masking of finished lanes is used.
+ */
+
+#include "md5.h"
+#include "md5mb.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_MAX_LEN 200
+#define TEST_MAX_BATCH 40
+
+static uint8_t test_data[TEST_MAX_LEN];
+
+static void test_job (struct md5mb_job *job, size_t len, unsigned int n)
+{
+	size_t a = (n * 7) % (len + 1);
+	size_t b = a + (n * 13) % (len - a + 1);
+
+	memset(job, 0, sizeof(*job));
+	job->part[0].data = test_data;
+	job->part[0].len = a;
+	job->part[1].data = test_data + a;
+	job->part[1].len = b - a;
+	job->part[2].data = test_data + b;
+	job->part[2].len = len - b;
+}
+
+int main (void)
+{
+	struct md5mb_job job[TEST_MAX_BATCH];
+	unsigned int failed = 0;
+	unsigned int count;
+	size_t i;
+
+	for (i = 0; i < sizeof(test_data); ++i)
+		test_data[i] = (uint8_t)(i * 31 + 7);
+
+	for (count = 1; count <= TEST_MAX_BATCH; ++count) {
+		size_t len;
+
+		for (len = 0; len + count <= TEST_MAX_LEN; ++len) {
+			unsigned int k;
+
+			/* the lanes of one run have different lengths */
+			for (k = 0; k < count; ++k)
+				test_job(&job[k], len + k, k + (unsigned int)len);
+			md5mb(job, count);
+
+			for (k = 0; k < count; ++k) {
+				uint8_t digest[16];
+
+				MD5(digest, test_data, len + k);
+				if (memcmp(digest, job[k].digest, sizeof(digest)) != 0) {
+					fprintf(stderr, "md5mb: wrong digest for length %zu"
+						" in a batch of %u\n", len + k, count);
+					++failed;
+				}
+			}
+		}
+	}
+
+	return (failed == 0)? 0: 1;
+}
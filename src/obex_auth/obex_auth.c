@@ -21,6 +21,7 @@
 #else
 #include "md5.h"
 #endif
+#include "md5mb.h"
 
 #if !defined(_WIN32)
 #include "arpa/inet.h"
@@ -67,6 +68,7 @@ int obex_auth_add_challenges (obex_t* handle,
 {
 	int err = 0;
 	obex_headerdata_t ah;
+	uint8_t* start;
 	uint8_t* ptr;
 	unsigned int realm_check = 1;
 	uint32_t total = 0;
@@ -81,19 +83,22 @@ int obex_auth_add_challenges (obex_t* handle,
 		    chal[i].realm.len)
 			total += 3 + chal[i].realm.len;
 		else {
-			if (--realm_check == 0)
+			/* only one challenge may be without realm */
+			if (realm_check == 0)
 				return -EINVAL;
+			--realm_check;
 		}
 	}
-	ptr = malloc(total);
-	if (!ptr)
+	start = malloc(total);
+	if (!start)
 		return -ENOMEM;
+	ptr = start;
 
 	for (i = 0; i < count; ++i) {
 		/* add nonce */
 		*ptr++ = 0x00;
 		*ptr++ = sizeof(chal[0].nonce);
-		memcpy(ptr, chal[0].nonce, sizeof(chal[0].nonce));
+		memcpy(ptr, chal[i].nonce, sizeof(chal[0].nonce));
 		ptr += sizeof(chal[0].nonce);
 
 		if (chal[i].opts) {
@@ -122,14 +127,14 @@ int obex_auth_add_challenges (obex_t* handle,
 		}
 	};
 
-	ah.bs = ptr;
+	ah.bs = start;
 	errno = 0;
 	if (0 > OBEX_ObjectAddHeader(handle, obj, OBEX_HDR_AUTHCHAL, ah,
 				     (uint32_t)(ptr-ah.bs),
 				     OBEX_FL_FIT_ONE_PACKET))
 		err = ((errno != 0)? -errno: -EINVAL);
 	ah.bs = NULL;
-	free(ptr);
+	free(start);
 
 	return err;
 }
@@ -189,6 +194,41 @@ int obex_auth_check_response (const struct obex_auth_response* resp,
 	return 1;
 }
 
+int obex_auth_check_responses (struct obex_auth_check* check,
+			       unsigned int count)
+{
+	struct md5mb_job job[16];
+	unsigned int i = 0;
+
+	while (i < count) {
+		unsigned int n = count - i;
+		unsigned int k;
+
+		if (n > sizeof(job)/sizeof(*job))
+			n = sizeof(job)/sizeof(*job);
+
+		for (k = 0; k < n; ++k) {
+			const struct obex_auth_check *c = &check[i + k];
+
+			job[k].part[0].data = c->resp->nonce;
+			job[k].part[0].len = sizeof(c->resp->nonce);
+			job[k].part[1].data = (const uint8_t*)":";
+			job[k].part[1].len = 1;
+			job[k].part[2].data = c->pass;
+			job[k].part[2].len = c->len;
+		}
+		md5mb(job, n);
+		for (k = 0; k < n; ++k) {
+			struct obex_auth_check *c = &check[i + k];
+
+			c->result = (memcmp(job[k].digest, c->resp->digest,
+					    sizeof(job[k].digest)) == 0);
+		}
+		i += n;
+	}
+
+	return 0;
+}
 
 /* Functions for an OBEX client.
  */
@@ -19,6 +19,11 @@ int obex_auth_check_response (
 	size_t len
 );
 
+int obex_auth_check_responses (
+	struct obex_auth_check* check, /*array*/
+	unsigned int count
+);
+
 int obex_auth_unpack_challenge (
 	const obex_headerdata_t h,
 	uint32_t hsize,
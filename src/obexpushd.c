@@ -22,6 +22,8 @@
 #include "utf.h"
 #include "net.h"
 #include "action.h"
+#include "scheduler.h"
+#include "bufpool.h"
 
 #include <unistd.h>
 #include <stdlib.h>
@@ -41,6 +43,8 @@
 #include <time.h>
 #include <locale.h>
 #include <langinfo.h>
+#include <getopt.h>
+#include <sys/prctl.h>
 
 #define PROGRAM_NAME "obexpushd"
 #include "version.h"
@@ -52,6 +56,19 @@ static int nofork = 0;
 static int id = 0;
 static struct auth_handler* auth = NULL;
 static struct io_handler* io = NULL;
+#if defined(USE_THREADS)
+static unsigned int thread_count = 0; /* 0 means number of CPUs */
+#endif
+static unsigned int client_limit = 256;
+#if OPENOBEX_TCPOBEX
+static unsigned int worker_count = 0;
+static pid_t *worker_pid = NULL;
+#endif
+static unsigned int client_count = 0;
+static unsigned int reject_count = 0;
+
+/* time in milliseconds that a rejected client has to send a request */
+#define REJECT_TIMEOUT 3000
 
 #define EOL(n) ((n) == '\n' || (n) == '\r')
 
@@ -146,6 +163,7 @@ file_data_t* create_client (struct net_data *net) {
 	if (data) {
 		memset(data,0,sizeof(*data));
 		data->id = id++;
+		data->mtu = OBEX_DEFAULT_MTU;
 		data->net_data = net;
 		data->auth = auth_copy(auth);
 		data->io = io_dup(io);
@@ -179,63 +197,189 @@ void cleanup_client (file_data_t *data) {
 		io_destroy(data->io);
 		data->io = NULL;
 	}
+	if (data->buffer) {
+		bufpool_put(data->buffer, data->buffer_size);
+		data->buffer = NULL;
+	}
 	free(data);
 }
 
-static void* handle_client (void* arg) {
-	obex_t *obex = arg;
-	struct net_data *old_net = OBEX_GetUserData(obex);
-	file_data_t *data = create_client(old_net);
+static
+file_data_t* client_new (struct net_data *listener, obex_t *link,
+			  obex_event_t eventcb) {
+	file_data_t *data = create_client(listener);
+	struct net_data *net;
+	char buffer[256];
+
+	if (!data)
+		return NULL;
+
+	/* create new net_data for this client */
+	net = net_data_new();
+	if (!net) {
+		cleanup_client(data);
+		return NULL;
+	}
+	memcpy(net, listener, sizeof(*net));
+	net->link = link;
+	net->obex = sched_session_new(data, link, eventcb);
+	if (!net->obex) {
+		free(net);
+		cleanup_client(data);
+		return NULL;
+	}
+	data->net_data = net;
 
-	if (data) {
-		/* create new net_data for this client */
-		struct net_data *net = net_data_new();
+	OBEX_SetUserData(net->obex, data);
 
-		if (net) {
-			char buffer[256];
+	memset(buffer, 0, sizeof(buffer));
+	net_get_peer(data->net_data, buffer, sizeof(buffer));
+	dbg_printf(data, "Connection from \"%s\"\n", buffer);
+	data->transfer.peername = strdup(buffer);
 
-			memcpy(net, data->net_data, sizeof(*net));
-			net->obex = obex;
-			data->net_data = net;
+	return data;
+}
 
-			OBEX_SetUserData(obex, data);
+/* Reserve a slot for a new client, fails if client_limit is reached */
+static
+int client_admit (void) {
+	unsigned int n = __atomic_add_fetch(&client_count, 1, __ATOMIC_RELAXED);
 
-			memset(buffer, 0, sizeof(buffer));
-			net_get_peer(data->net_data, buffer, sizeof(buffer));
-			dbg_printf(data, "Connection from \"%s\"\n", buffer);
-			data->transfer.peername = strdup(buffer);
+	if (n > client_limit) {
+		(void)__atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
 
-			do {
-				if (OBEX_HandleInput(data->net_data->obex, 10) < 0)
-					break;
-			} while (1);
-		}
+static
+void client_release (void) {
+	(void)__atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+}
 
-		if (data->net_data) {
-			OBEX_Cleanup(data->net_data->obex);
-			free(data->net_data);
-		}
-		cleanup_client(data);
+/* Same for a rejected client, there are never more of them than of
+ * admitted clients */
+static
+int reject_admit (void) {
+	unsigned int n = __atomic_add_fetch(&reject_count, 1, __ATOMIC_RELAXED);
+
+	if (n > client_limit) {
+		(void)__atomic_sub_fetch(&reject_count, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+static
+void reject_release (void) {
+	(void)__atomic_sub_fetch(&reject_count, 1, __ATOMIC_RELAXED);
+}
+
+static
+void client_free (file_data_t *data) {
+	if (data->rejected)
+		reject_release();
+	else
+		client_release();
+	if (data->net_data) {
+		OBEX_Cleanup(data->net_data->obex);
+		sched_session_free(data);
+		if (data->net_data->link)
+			OBEX_Cleanup(data->net_data->link);
+		free(data->net_data);
 	}
+	cleanup_client(data);
+}
+
+static void* handle_client (void* arg) {
+	file_data_t *data = arg;
+
+	do {
+		if (OBEX_HandleInput(data->net_data->obex, 10) < 0)
+			break;
+	} while (1);
+	client_free(data);
+
 	return NULL;
 }
 
-int obexpushd_create_instance (void* (*cb)(void*), void *cbdata);
+/* Takes ownership of data, also on failure */
+int obexpushd_add_client (file_data_t *data);
 int obexpushd_start (struct net_data *data, unsigned int count);
 
 static
-void create_instance (void* (*cb)(void*), void *cbdata) {
+void add_client (file_data_t *data) {
 	if (nofork >= 2) {
-		(void)cb(cbdata);
+		(void)handle_client(data);
 	} else {
-		int err = obexpushd_create_instance(cb, cbdata);
+		int err = obexpushd_add_client(data);
 		if (err != 0) {
 			errno = -err;
-			perror("Failed to create instance");
+			perror("Failed to add client");
 		}
 	}
 }
 
+static
+void reject_eventcb (obex_t* handle, obex_object_t* obj,
+		     int __unused mode, int event,
+		     int __unused obex_cmd, int __unused obex_rsp)
+{
+	file_data_t *data = OBEX_GetUserData(handle);
+
+	switch (event) {
+	case OBEX_EV_REQHINT:
+		(void)OBEX_ObjectSetRsp(obj, OBEX_RSP_SERVICE_UNAVAILABLE,
+					OBEX_RSP_SERVICE_UNAVAILABLE);
+		break;
+
+	case OBEX_EV_REQDONE:
+	case OBEX_EV_LINKERR:
+	case OBEX_EV_PARSEERR:
+	case OBEX_EV_ABORT:
+		if (data)
+			sched_session_disconnect(data);
+		break;
+	}
+}
+
+/* Answer the first request of a client that cannot be served right now
+ * with "503 Service Unavailable" and close the connection. Like any
+ * other client, it is handed over to a scheduler, so the listener does
+ * not wait for it. A client that sends nothing is closed after
+ * REJECT_TIMEOUT.
+ */
+static
+void reject_client (struct net_data *listener) {
+	obex_t *client = net_accept(listener, reject_eventcb);
+	file_data_t *data = NULL;
+	int fd;
+
+	if (!client)
+		return;
+
+	dbg_printf(NULL, "Too many clients, rejecting new connection\n");
+	if (!reject_admit()) {
+		(void)OBEX_TransportDisconnect(client);
+		OBEX_Cleanup(client);
+		return;
+	}
+
+	fd = OBEX_GetFD(client);
+	if (fd >= 0)
+		(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+	data = client_new(listener, client, reject_eventcb);
+	if (!data) {
+		reject_release();
+		(void)OBEX_TransportDisconnect(client);
+		OBEX_Cleanup(client);
+		return;
+	}
+	data->rejected = 1;
+	sched_session_expire(data, REJECT_TIMEOUT);
+	add_client(data);
+}
+
 static
 void eventcb (obex_t* handle, obex_object_t __unused *obj,
 	      int mode, int event,
@@ -245,14 +389,31 @@ void eventcb (obex_t* handle, obex_object_t __unused *obj,
 		   obex_event_string(event), obex_command_string(obex_cmd));
 
 	if (event == OBEX_EV_ACCEPTHINT) {
-		obex_t *client = OBEX_ServerAccept(handle, client_eventcb, NULL);
-		if (client) {
+		struct net_data *listener = OBEX_GetUserData(handle);
+		obex_t *client;
+
+		if (!client_admit()) {
+			reject_client(listener);
+			return;
+		}
+		client = net_accept(listener, client_eventcb);
+		if (!client) {
+			client_release();
+
+		} else {
+			file_data_t *data;
 			int fd;
 
 			fd = OBEX_GetFD(client);
 			if (fd >= 0)
 				(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
-			create_instance(handle_client, client);
+			data = client_new(listener, client, client_eventcb);
+			if (data) {
+				add_client(data);
+			} else {
+				client_release();
+				OBEX_Cleanup(client);
+			}
 		}
 
 	} else {
@@ -321,9 +482,19 @@ static void print_help (char* me) {
 	       " -p <file>      write pid to file when getting detached\n"
 	       " -A             use transport layer specific access rules if available\n"
 	       " -a <file>      authenticate against credentials from file (EXPERIMENTAL)\n"
+	       " -R <file>      like -a but with realms and their credential files from file\n"
 	       " -o <directory> change base directory\n"
 	       " -s <file>      define script/program for input/output\n"
+	       " -O <options>   comma separated list of I/O options (see manual page)\n"
 	       " -t <protocol>  add a protocol (OPP, FTP)\n"
+#if defined(USE_THREADS)
+	       " -T <count>     number of worker threads (default: number of CPUs)\n"
+#endif
+	       " -C <count>     maximum number of concurrent clients (default: 256)\n"
+	       " -L <ms>        maximum time to flush data on disconnect (default: 1000)\n"
+#if OPENOBEX_TCPOBEX
+	       " -W <count>     number of worker processes sharing the TCP port\n"
+#endif
 	       " -h             this help message\n"
 	       " -v             show version\n");
 	printf("\n"
@@ -417,12 +588,165 @@ static void obexpushd_shutdown (int sig) {
 
 	(void)signal(SIGINT, SIG_DFL);
 	(void)signal(SIGTERM, SIG_DFL);
+#if OPENOBEX_TCPOBEX
+	for (i = 0; worker_pid && i < worker_count; ++i) {
+		if (worker_pid[i] > 0)
+			(void)kill(worker_pid[i], sig);
+	}
+#endif
 	for (i = 0; i < NET_INDEX_MAX; ++i)
 		net_cleanup(&data[i]);
 
 	(void)kill(getpid(), sig);
 }
 
+/* Wrap the I/O handler with a write-behind ring buffer of the given size */
+static int set_io_writebehind (struct io_handler **h, const char *value) {
+#if defined(USE_THREADS)
+	static int enabled = 0;
+	size_t size = 1024 * 1024;
+	struct io_handler *wb;
+
+	if (value) {
+		int err = io_parse_size(value, &size);
+		if (err)
+			return err;
+		/* room for two packets of the maximum size */
+		if (size < 128 * 1024)
+			return -ERANGE;
+	}
+	if (enabled)
+		return -EEXIST;
+
+	wb = io_writebehind_init(*h, size);
+	if (!wb)
+		return -errno;
+	*h = wb;
+	enabled = 1;
+
+	return 0;
+#else
+	(void)h;
+	(void)value;
+	return -ENOTSUP;
+#endif
+}
+
+/* Apply a list of "name[=value]" settings, separated by comma */
+static int set_io_options (struct io_handler **h, char *options) {
+	char *saveptr = NULL;
+	char *opt;
+
+	for (opt = strtok_r(options, ",", &saveptr);
+	     opt != NULL;
+	     opt = strtok_r(NULL, ",", &saveptr))
+	{
+		char *value = strchr(opt, '=');
+		int err;
+
+		if (value)
+			*value++ = 0;
+		if (strcmp(opt, "writebehind") == 0)
+			err = set_io_writebehind(h, value);
+		else
+			err = io_set_option(*h, opt, value);
+		if (err) {
+			fprintf(stderr, "Invalid I/O option \"%s\": %s\n", opt, strerror(-err));
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+#if OPENOBEX_TCPOBEX
+static pid_t start_worker (unsigned int n) {
+	pid_t parent = getpid();
+	pid_t p = fork();
+	size_t i;
+
+	if (p != 0)
+		return p;
+
+	if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1 || getppid() != parent)
+		exit(EXIT_FAILURE);
+	free(worker_pid);
+	worker_pid = NULL;
+	worker_count = 0;
+
+	/* only the TCP listener can be shared between processes */
+	if (n > 0) {
+		for (i = 0; i < NET_INDEX_MAX; ++i) {
+			if (i != IDX_INET)
+				data[i].handler = NULL;
+		}
+	}
+
+	if (obexpushd_start(data, NET_INDEX_MAX) != 0)
+		perror("Failed to start");
+	exit(EXIT_FAILURE);
+}
+
+/* Each worker has its own listening socket on the same TCP port
+ * and the kernel distributes new connections among them.
+ */
+static int supervise_workers (void) {
+	unsigned int alive = 0;
+	unsigned int i;
+
+	worker_pid = calloc(worker_count, sizeof(*worker_pid));
+	if (!worker_pid)
+		return -errno;
+
+	for (i = 0; i < worker_count; ++i) {
+		worker_pid[i] = start_worker(i);
+		if (worker_pid[i] == -1)
+			perror("Failed to start worker");
+		else
+			++alive;
+	}
+
+	while (alive > 0) {
+		int status;
+		pid_t p = waitpid(-1, &status, 0);
+
+		if (p == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		for (i = 0; i < worker_count; ++i) {
+			if (worker_pid[i] == p)
+				break;
+		}
+		if (i == worker_count)
+			continue;
+
+		if (WIFEXITED(status)) {
+			if (WEXITSTATUS(status) == EXIT_SUCCESS) {
+				worker_pid[i] = -1;
+				--alive;
+				continue;
+			}
+			fprintf(stderr, "worker %u exited with exit code %d\n", i, WEXITSTATUS(status));
+		} else if (WIFSIGNALED(status)) {
+			fprintf(stderr, "worker %u got signal %d\n", i, WTERMSIG(status));
+		}
+
+		/* do not restart too fast if it dies immediately */
+		(void)sleep(1);
+		worker_pid[i] = start_worker(i);
+		if (worker_pid[i] == -1) {
+			perror("Failed to restart worker");
+			--alive;
+		}
+	}
+
+	return 0;
+}
+#endif
+
 int main (int argc, char** argv) {
 	size_t i;
 	char* pidfile = NULL;
@@ -430,6 +754,17 @@ int main (int argc, char** argv) {
 	int c = 0;
 	struct net_handler* handle[NET_INDEX_MAX];
 	uint8_t protocols = 0;
+	char* io_options[16];
+	unsigned int io_options_count = 0;
+	static const struct option long_options[] = {
+		{ "max-clients", required_argument, NULL, 'C' },
+		{ "linger",      required_argument, NULL, 'L' },
+		{ "threads",     required_argument, NULL, 'T' },
+		{ "workers",     required_argument, NULL, 'W' },
+		{ "help",        no_argument,       NULL, 'h' },
+		{ "version",     no_argument,       NULL, 'v' },
+		{ NULL, 0, NULL, 0 }
+	};
 
 	(void)setlocale(LC_CTYPE, "");
 	io = io_file_init(".");
@@ -440,7 +775,8 @@ int main (int argc, char** argv) {
 	memset(data, 0, sizeof(data));
 
 	while (c != -1) {
-		c = getopt(argc,argv,"B::I::N::G:SAa:dhnp:r:o:s:t:v");
+		c = getopt_long(argc, argv, "B::I::N::G:SAa:R:C:L:dhnp:r:o:O:s:t:T:W:v",
+				long_options, NULL);
 		switch (c) {
 		case -1: /* processed all options, no error */
 			break;
@@ -543,6 +879,18 @@ int main (int argc, char** argv) {
 			auth_level |= AUTH_LEVEL_OBEX;
 			break;
 
+		case 'R':
+			if (auth)
+				auth_destroy(auth);
+			auth = auth_file_config(optarg);
+			if (!auth) {
+				fprintf(stderr, "Reading realms from %s failed: %s\n",
+					optarg, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			auth_level |= AUTH_LEVEL_OBEX;
+			break;
+
 		case 'r':
 			fprintf(stderr, "This version does not support obex server authentication.\n");
 			return EXIT_FAILURE;
@@ -560,6 +908,15 @@ int main (int argc, char** argv) {
 			io = io_script_init(optarg);
 			break;
 
+		case 'O':
+			/* applied after the I/O handler is known */
+			if (io_options_count == sizeof(io_options)/sizeof(*io_options)) {
+				fprintf(stderr, "Too many -O options\n");
+				exit(EXIT_FAILURE);
+			}
+			io_options[io_options_count++] = optarg;
+			break;
+
 		case 't':
 			if (optarg) {
 				if (strcasecmp(optarg, "FTP") == 0)
@@ -567,6 +924,55 @@ int main (int argc, char** argv) {
 			}
 			break;
 
+#if defined(USE_THREADS)
+		case 'T':
+		{
+			long n = strtol(optarg, NULL, 10);
+			if (n <= 0 || n > 1024) {
+				fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			thread_count = (unsigned int)n;
+			break;
+		}
+#endif
+
+		case 'C':
+		{
+			long n = strtol(optarg, NULL, 10);
+			if (n <= 0 || n > 65536) {
+				fprintf(stderr, "Invalid number of clients: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			client_limit = (unsigned int)n;
+			break;
+		}
+
+		case 'L':
+		{
+			char *end = NULL;
+			long n = strtol(optarg, &end, 10);
+			if (end == optarg || *end != 0 || n < 0 || n > 60000) {
+				fprintf(stderr, "Invalid linger time: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			sched_set_linger((unsigned int)n);
+			break;
+		}
+
+#if OPENOBEX_TCPOBEX
+		case 'W':
+		{
+			long n = strtol(optarg, NULL, 10);
+			if (n <= 0 || n > 1024) {
+				fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			worker_count = (unsigned int)n;
+			break;
+		}
+#endif
+
 		case 'h':
 			print_help(PROGRAM_NAME);
 			exit(EXIT_SUCCESS);
@@ -582,6 +988,10 @@ int main (int argc, char** argv) {
 		fprintf(stderr, "Invalid output options\n");
 		exit(EXIT_SUCCESS);
 	}
+	for (i = 0; i < io_options_count; ++i) {
+		if (set_io_options(&io, io_options[i]) != 0)
+			exit(EXIT_FAILURE);
+	}
 
 	/* check that at least one listener was enabled */
 	for (i = 0; i < NET_INDEX_MAX; ++i) {
@@ -596,6 +1006,16 @@ int main (int argc, char** argv) {
 		}
 	}
 
+#if OPENOBEX_TCPOBEX
+	if (worker_count) {
+		if (!handle[IDX_INET]) {
+			fprintf(stderr, "Worker processes need a network listener\n");
+			exit(EXIT_FAILURE);
+		}
+		tcp_set_reuseport(handle[IDX_INET], 1);
+	}
+#endif
+
 	/* fork if allowed (detach from terminal) */
 	if (nofork < 1 && !handle[IDX_STDIO]) {
 		if (daemon(1,0) < 0) {
@@ -618,6 +1038,8 @@ int main (int argc, char** argv) {
 	/* setup the signal handlers */
 	(void)signal(SIGINT, obexpushd_shutdown);
 	(void)signal(SIGTERM, obexpushd_shutdown);
+	/* a script that exited must not kill us on the next write */
+	(void)signal(SIGPIPE, SIG_IGN);
 
 	protocols |= (1 << NET_OBEX_PUSH);
 
@@ -630,6 +1052,18 @@ int main (int argc, char** argv) {
 		data[i].enabled_protocols = protocols;
 	}
 
+#if OPENOBEX_TCPOBEX
+	if (worker_count) {
+		int err = supervise_workers();
+		if (err) {
+			errno = -err;
+			perror("Failed to supervise workers");
+			exit(EXIT_FAILURE);
+		}
+		exit(EXIT_SUCCESS);
+	}
+#endif
+
 	if (obexpushd_start(data, NET_INDEX_MAX) != 0)
 		perror("Failed to start");
 
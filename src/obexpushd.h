@@ -18,6 +18,7 @@ enum obex_target {
 };
 
 struct obex_target_ops;
+struct sched_session;
 
 /* private data for a client connection */
 typedef struct {
@@ -25,12 +26,19 @@ typedef struct {
 	unsigned int count;
 	uint8_t error;
 
-	uint8_t buffer[1000];
+	/* maximum packet size that the client accepts */
+	uint16_t mtu;
+	/* transfer buffer from bufpool, allocated with first use */
+	uint8_t *buffer;
+	size_t buffer_size;
 	enum obex_target target;
 	const struct obex_target_ops *target_ops;
 	int command;
 
 	struct net_data* net_data;
+	struct sched_session *session;
+	/* only answered with an error, see reject_client() */
+	int rejected;
 	struct auth_handler *auth;
 
 	struct io_handler *io;
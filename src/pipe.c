@@ -22,15 +22,21 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #if defined(USE_SPAWN)
 #include <spawn.h>
 #endif
 #include "closexec.h"
+#include "evloop.h"
+#include "compiler.h"
 
 void pipe_close (int client_fds[2])
 {
@@ -116,3 +122,139 @@ int pipe_open (
 		*pid = p;
 	return 0;
 }
+
+int pipe_pidfd (pid_t child)
+{
+#if defined(SYS_pidfd_open)
+	return (int)syscall(SYS_pidfd_open, child, 0);
+#else
+	(void)child;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+pid_t pipe_wait (pid_t child, int *status, int timeout)
+{
+	struct timespec start, now;
+	long delay = 1;
+	pid_t pid;
+	int fd = pipe_pidfd(child);
+
+	if (fd != -1) {
+		struct pollfd p = { .fd = fd, .events = POLLIN };
+		int err;
+
+		/* the descriptor gets readable when the child exits */
+		do {
+			err = poll(&p, 1, timeout);
+		} while (err == -1 && errno == EINTR);
+		(void)close(fd);
+		return waitpid(child, status, WNOHANG);
+	}
+
+	/* older kernels: poll with increasing delays */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((pid = waitpid(child, status, WNOHANG)) == 0) {
+		struct timespec t;
+		long elapsed;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_nsec - start.tv_nsec) / 1000000;
+		if (elapsed >= timeout)
+			break;
+		if (delay > timeout - elapsed)
+			delay = timeout - elapsed;
+		t.tv_sec = delay / 1000;
+		t.tv_nsec = (delay % 1000) * 1000000;
+		(void)nanosleep(&t, NULL);
+		if (delay < 100)
+			delay *= 2;
+	}
+
+	return pid;
+}
+
+struct pipe_reaper {
+	pid_t child;
+	int pidfd;
+	struct evloop_watch *watch;
+	struct evloop_watch *timer;
+};
+
+static void pipe_reaper_cb (struct evloop_watch *w, uint32_t __unused events,
+			    void *arg)
+{
+	struct pipe_reaper *r = arg;
+	int status;
+
+	if (w == r->timer) {
+		/* it not dead yet, kill it */
+		(void)kill(r->child, SIGKILL);
+		evloop_del(r->timer);
+		r->timer = NULL;
+		return;
+	}
+	if (waitpid(r->child, &status, WNOHANG) == 0)
+		return;
+
+	if (r->timer)
+		evloop_del(r->timer);
+	evloop_del(r->watch);
+	(void)close(r->pidfd);
+	free(r);
+}
+
+static int pipe_reap_later (pid_t child, int pidfd, int timeout)
+{
+	struct evloop *loop = evloop_current();
+	struct pipe_reaper *r;
+
+	if (!loop || pidfd == -1)
+		return -ENOTSUP;
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		return -errno;
+	r->child = child;
+	r->pidfd = pidfd;
+	r->watch = evloop_add(loop, pidfd, EPOLLIN, pipe_reaper_cb, r);
+	r->timer = NULL;
+	if (r->watch)
+		r->timer = evloop_add_timer(loop, timeout, pipe_reaper_cb, r);
+	if (!r->timer) {
+		int err = -errno;
+
+		if (r->watch)
+			evloop_del(r->watch);
+		free(r);
+		return err;
+	}
+
+	return 0;
+}
+
+void pipe_reap (pid_t child, int pidfd, int timeout)
+{
+	int status;
+
+	if (waitpid(child, &status, WNOHANG) != 0) {
+		if (pidfd != -1)
+			(void)close(pidfd);
+		return;
+	}
+
+	if (pidfd == -1)
+		pidfd = pipe_pidfd(child);
+	if (pipe_reap_later(child, pidfd, timeout) == 0)
+		return;
+
+	if (pidfd != -1)
+		(void)close(pidfd);
+	if (pipe_wait(child, &status, timeout) == 0) {
+		/* it not dead yet, kill it */
+		(void)kill(child, SIGKILL);
+		(void)waitpid(child, &status, 0);
+	}
+}
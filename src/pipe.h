@@ -2,3 +2,18 @@
 
 int pipe_open (const char* command, char** args, int client_fds[2], pid_t *pid);
 void pipe_close (int client_fds[2]);
+
+/* A descriptor that gets readable when child exits, -1 if unsupported */
+int pipe_pidfd (pid_t child);
+
+/* Wait until the child exits or the timeout (ms) expires,
+ * returns the pid, 0 on timeout or -1 on error.
+ */
+pid_t pipe_wait (pid_t child, int *status, int timeout);
+
+/* Let a child that was asked to exit go without waiting for it:
+ * it is reaped by the current event loop and killed if it still runs
+ * after timeout ms. Outside of an event loop, this waits right here.
+ * pidfd is taken over, it may be -1.
+ */
+void pipe_reap (pid_t child, int pidfd, int timeout);
@@ -1,17 +1,93 @@
+#include "queue.h"
+
 #include <pthread.h>
+#include <sys/eventfd.h>
 
 #if defined(USE_LIBGCRYPT)
 #include <gcrypt.h>
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 #endif
 
-int obexpushd_create_instance (void* (*cb)(void*), void *cbdata) {
-	pthread_t t;
+/* Accepted clients are handed over to a fixed number of worker
+ * threads, each of them running a session scheduler. The queue never
+ * overflows as the number of clients is limited by client_limit in
+ * the first place, and so is the number of rejected clients. Every queued client increments the eventfd counter
+ * which is watched by all workers.
+ */
+static struct queue *pool_queue = NULL;
+static int pool_event = -1;
+
+static void obexpushd_pool_cb (struct evloop_watch __unused *w,
+			       uint32_t __unused events, void *arg)
+{
+	struct sched *s = arg;
+	eventfd_t value;
+	file_data_t *data;
+
+	/* another worker may have been faster */
+	if (eventfd_read(pool_event, &value) == -1)
+		return;
+
+	data = queue_pop(pool_queue);
+	if (data && sched_add(s, data) < 0)
+		client_free(data);
+}
+
+static void* obexpushd_worker_thread (void __unused *arg) {
+	struct sched *s = sched_new(client_free);
+
+	if (!s) {
+		perror("Failed to create scheduler");
+		return NULL;
+	}
+	if (!evloop_add(sched_get_loop(s), pool_event, EPOLLIN, obexpushd_pool_cb, s)) {
+		perror("Failed to watch client queue");
+		sched_destroy(s);
+		return NULL;
+	}
+
+	do {
+		(void)sched_dispatch(s, -1);
+	} while (1);
+
+	return NULL;
+}
+
+static int obexpushd_pool_start (unsigned int threads) {
 	pthread_attr_t attr;
+	unsigned int i;
+
+	pool_queue = queue_new(2 * client_limit);
+	if (!pool_queue)
+		return -errno;
+	pool_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (pool_event == -1)
+		return -errno;
+
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	if (pthread_create(&t, &attr, cb, cbdata) != 0)
-		return -errno;
+	for (i = 0; i < threads; ++i) {
+		pthread_t t;
+		int err = pthread_create(&t, &attr, obexpushd_worker_thread, NULL);
+		if (err) {
+			pthread_attr_destroy(&attr);
+			return -err;
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	return 0;
+}
+
+int obexpushd_add_client (file_data_t *data) {
+	int err = queue_push(pool_queue, data);
+
+	if (err) {
+		client_free(data);
+		return err;
+	}
+	(void)eventfd_write(pool_event, 1);
+
 	return 0;
 }
 
@@ -44,6 +120,7 @@ static void* obexpushd_listen_thread (void* arg) {
 
 int obexpushd_start (struct net_data *data, unsigned int count) {
 	unsigned int i;
+	int err;
 	pthread_t *thread = calloc(count, sizeof(*thread));
 
 	if (!thread)
@@ -56,6 +133,16 @@ int obexpushd_start (struct net_data *data, unsigned int count) {
 	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
 #endif
 
+	if (thread_count == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = (n > 0)? (unsigned int)n: 1;
+	}
+	err = obexpushd_pool_start(thread_count);
+	if (err) {
+		free(thread);
+		return err;
+	}
+
 	/* initialize all enabled listeners */
 	for (i = 0; i < count; ++i) {
 		if (!data[i].handler)
@@ -0,0 +1,140 @@
+/* Copyright (C) 2006-2010 Hendrik Sattler <post@hendrik-sattler.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Array based queue where each cell carries a sequence number
+ * (D. Vyukov, "Bounded MPMC queue"). Producers and consumers only
+ * contend on their own position counter.
+ */
+
+#define QUEUE_CACHELINE 64
+
+struct queue_cell {
+	size_t seq;
+	void *data;
+};
+
+struct queue {
+	struct queue_cell *cells;
+	size_t mask;
+
+	char pad0[QUEUE_CACHELINE];
+	size_t tail;
+	char pad1[QUEUE_CACHELINE];
+	size_t head;
+	char pad2[QUEUE_CACHELINE];
+};
+
+struct queue* queue_new (size_t capacity)
+{
+	struct queue *q;
+	size_t size = 2;
+	size_t i;
+
+	while (size < capacity)
+		size <<= 1;
+
+	q = malloc(sizeof(*q));
+	if (!q)
+		return NULL;
+	memset(q, 0, sizeof(*q));
+
+	q->cells = malloc(size * sizeof(*q->cells));
+	if (!q->cells) {
+		free(q);
+		return NULL;
+	}
+	for (i = 0; i < size; ++i) {
+		q->cells[i].seq = i;
+		q->cells[i].data = NULL;
+	}
+	q->mask = size - 1;
+
+	return q;
+}
+
+void queue_destroy (struct queue *q)
+{
+	if (q) {
+		free(q->cells);
+		free(q);
+	}
+}
+
+int queue_push (struct queue *q, void *data)
+{
+	struct queue_cell *cell;
+	size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		size_t seq;
+		long diff;
+
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return -EAGAIN;
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void* queue_pop (struct queue *q)
+{
+	struct queue_cell *cell;
+	size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	void *data;
+
+	for (;;) {
+		size_t seq;
+		long diff;
+
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	data = cell->data;
+	__atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+	return data;
+}
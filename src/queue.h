@@ -0,0 +1,28 @@
+#ifndef OBEXPUSHD_QUEUE_H
+#define OBEXPUSHD_QUEUE_H
+
+#include <stddef.h>
+
+/* Bounded lock-free multi-producer/multi-consumer queue of pointers */
+struct queue;
+
+/** Create a new queue
+ *
+ * @param capacity minimum number of entries, rounded up to a power of two
+ */
+struct queue* queue_new (size_t capacity);
+void queue_destroy (struct queue *q);
+
+/** Append an element
+ *
+ * @return 0 on success or -EAGAIN if the queue is full
+ */
+int queue_push (struct queue *q, void *data);
+
+/** Remove the oldest element
+ *
+ * @return the element or NULL if the queue is empty
+ */
+void* queue_pop (struct queue *q);
+
+#endif /* OBEXPUSHD_QUEUE_H */
@@ -0,0 +1,684 @@
+/* Copyright (C) 2006-2010 Hendrik Sattler <post@hendrik-sattler.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "scheduler.h"
+#include "net.h"
+#include "auth.h"
+#include "compiler.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+/* default linger time and check interval in milliseconds */
+#define SCHED_LINGER 1000
+#define SCHED_LINGER_TICK 10
+
+struct sched {
+	struct evloop *loop;
+	sched_done_t done;
+
+	/* sessions that wait for the end of the round */
+	struct sched_session *deferred;
+};
+
+struct sched_session {
+	obex_ctrans_t ctrans;
+	int fd;
+	int closed;
+
+	/* framing state, OpenOBEX only takes one packet per feed */
+	uint8_t hdr[3];
+	size_t hdr_len;
+	size_t left;
+
+	/* output that did not fit into the socket send buffer */
+	uint8_t *out;
+	size_t out_len;
+	size_t out_pos;
+	size_t out_size;
+
+	file_data_t *data;
+	struct sched *sched;
+	struct evloop_watch *watch;
+
+	/* delayed disconnect */
+	struct evloop_watch *linger;
+	unsigned int linger_left;
+
+	/* see sched_session_expire() */
+	struct evloop_watch *expire;
+	unsigned int expire_ms;
+
+	/* suspended request, see sched_session_wait() */
+	struct evloop_watch *wait;
+	struct evloop_watch *wait_timer;
+	obex_object_t *wait_obj;
+	sched_resume_t wait_cb;
+
+	/* see sched_session_defer() */
+	int deferred;
+	struct sched_session *defer_next;
+};
+
+static unsigned int sched_linger = SCHED_LINGER;
+
+/* Every thread that reads from sessions gets its own receive buffer */
+static __thread uint8_t *sched_buffer = NULL;
+
+static uint8_t* sched_get_buffer (void)
+{
+	if (!sched_buffer)
+		sched_buffer = malloc(OBEX_MAXIMUM_MTU);
+	return sched_buffer;
+}
+
+static int sched_session_feed (obex_t *handle, struct sched_session *s,
+			       uint8_t *buf, size_t len)
+{
+	while (len) {
+		size_t chunk;
+
+		if (s->hdr_len < 3) {
+			chunk = 3 - s->hdr_len;
+			if (chunk > len)
+				chunk = len;
+			memcpy(s->hdr + s->hdr_len, buf, chunk);
+			s->hdr_len += chunk;
+			if (s->hdr_len == 3) {
+				size_t size = ((size_t)s->hdr[1] << 8) | s->hdr[2];
+				s->left = (size > 3)? size - 3: 0;
+			}
+		} else {
+			chunk = s->left;
+			if (chunk > len)
+				chunk = len;
+			s->left -= chunk;
+		}
+
+		if (OBEX_CustomDataFeed(handle, buf, (int)chunk) < 0)
+			return -EIO;
+		if (s->hdr_len == 3 && s->left == 0)
+			s->hdr_len = 0;
+
+		buf += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/* Read and process all pending data of a session. Nothing is read
+ * while output is queued, the client must take the responses first.
+ * @return 0 if the session is still alive, else a negative error number
+ */
+static int sched_session_input (obex_t *handle, struct sched_session *s)
+{
+	uint8_t *buf = sched_get_buffer();
+
+	if (!buf)
+		return -ENOMEM;
+
+	while (!s->closed) {
+		ssize_t n;
+
+		if (s->out_len)
+			return 0;
+		n = recv(s->fd, buf, OBEX_MAXIMUM_MTU, MSG_DONTWAIT);
+
+		if (n == 0)
+			return -EPIPE;
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (sched_session_feed(handle, s, buf, (size_t)n) < 0)
+			return -EIO;
+	}
+
+	return -EPIPE;
+}
+
+static int sched_ctrans_listen (obex_t __unused *handle, void __unused *customdata)
+{
+	return 0;
+}
+
+static int sched_ctrans_disconnect (obex_t __unused *handle, void *customdata)
+{
+	struct sched_session *s = customdata;
+
+	if (!s->closed) {
+		s->closed = 1;
+		(void)shutdown(s->fd, SHUT_RDWR);
+	}
+
+	return 0;
+}
+
+/* @return bytes sent or a negative error number */
+static ssize_t sched_session_send (struct sched_session *s,
+				   const uint8_t *buf, size_t len)
+{
+	size_t total = 0;
+
+	while (total < len) {
+		ssize_t n = send(s->fd, buf + total, len - total,
+				 MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -errno;
+		}
+		total += n;
+	}
+
+	return total;
+}
+
+/* Send as much of the queued output as possible
+ * @return 0 or a negative error number
+ */
+static int sched_session_flush (struct sched_session *s)
+{
+	ssize_t n;
+
+	if (s->out_len == 0)
+		return 0;
+
+	n = sched_session_send(s, s->out + s->out_pos, s->out_len);
+	if (n < 0)
+		return (int)n;
+	s->out_pos += n;
+	s->out_len -= n;
+	if (s->out_len == 0)
+		s->out_pos = 0;
+
+	return 0;
+}
+
+static int sched_session_queue (struct sched_session *s,
+				const uint8_t *buf, size_t len)
+{
+	if (s->out_pos) {
+		memmove(s->out, s->out + s->out_pos, s->out_len);
+		s->out_pos = 0;
+	}
+	if (s->out_len + len > s->out_size) {
+		uint8_t *out = realloc(s->out, s->out_len + len);
+
+		if (!out)
+			return -errno;
+		s->out = out;
+		s->out_size = s->out_len + len;
+	}
+	memcpy(s->out + s->out_len, buf, len);
+	s->out_len += len;
+
+	return 0;
+}
+
+/* The socket is never blocking. What the socket does not take is
+ * queued and sent when the event loop reports it as writable.
+ */
+static int sched_ctrans_write (obex_t __unused *handle, void *customdata,
+			       uint8_t *buf, int buflen)
+{
+	struct sched_session *s = customdata;
+	ssize_t n = 0;
+
+	if (s->out_len == 0) {
+		n = sched_session_send(s, buf, buflen);
+		if (n < 0)
+			return -1;
+	}
+	if (n == buflen)
+		return buflen;
+
+	if (sched_session_queue(s, buf + n, buflen - n) < 0)
+		return -1;
+
+	if (s->watch) {
+		if (evloop_mod(s->watch, EPOLLIN | EPOLLOUT | EPOLLET) < 0)
+			return -1;
+	} else {
+		/* not driven by an event loop, the caller waits */
+		while (s->out_len) {
+			struct pollfd pfd = {
+				.fd = s->fd,
+				.events = POLLOUT,
+			};
+
+			if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+				return -1;
+			if (sched_session_flush(s) < 0)
+				return -1;
+		}
+	}
+
+	return buflen;
+}
+
+/* Used when a session is not driven by a scheduler but by
+ * calling OBEX_HandleInput() directly.
+ */
+static int sched_ctrans_handleinput (obex_t *handle, void *customdata, int timeout)
+{
+	struct sched_session *s = customdata;
+	struct pollfd pfd = {
+		.fd = s->fd,
+		.events = POLLIN,
+	};
+	int ret;
+
+	if (s->closed)
+		return -1;
+
+	ret = poll(&pfd, 1, (timeout < 0)? -1: timeout * 1000);
+	if (ret <= 0)
+		return ret;
+	if (sched_session_input(handle, s) < 0)
+		return -1;
+
+	return 1;
+}
+
+obex_t* sched_session_new (file_data_t *data, obex_t *link, obex_event_t eventcb)
+{
+	struct sched_session *s;
+	obex_t *handle;
+
+	s = malloc(sizeof(*s));
+	if (!s)
+		return NULL;
+	memset(s, 0, sizeof(*s));
+	s->fd = OBEX_GetFD(link);
+	s->data = data;
+	s->ctrans.listen = sched_ctrans_listen;
+	s->ctrans.disconnect = sched_ctrans_disconnect;
+	s->ctrans.write = sched_ctrans_write;
+	s->ctrans.handleinput = sched_ctrans_handleinput;
+	s->ctrans.customdata = s;
+
+	if (s->fd == -1) {
+		free(s);
+		return NULL;
+	}
+	(void)fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+
+	handle = OBEX_Init(OBEX_TRANS_CUSTOM, eventcb, 0);
+	if (!handle) {
+		free(s);
+		return NULL;
+	}
+
+	if (OBEX_RegisterCTransport(handle, &s->ctrans) < 0 ||
+	    OBEX_ServerRegister(handle, NULL, 0) < 0)
+	{
+		OBEX_Cleanup(handle);
+		free(s);
+		return NULL;
+	}
+	OBEX_SetTransportMTU(handle, OBEX_MAXIMUM_MTU, OBEX_MAXIMUM_MTU);
+
+	data->session = s;
+	return handle;
+}
+
+void sched_session_free (file_data_t *data)
+{
+	struct sched_session *s = data->session;
+
+	if (s) {
+		sched_session_cancel(data);
+		if (s->linger)
+			evloop_del(s->linger);
+		if (s->expire)
+			evloop_del(s->expire);
+		if (s->watch)
+			evloop_del(s->watch);
+		free(s->out);
+		free(s);
+		data->session = NULL;
+	}
+}
+
+static void sched_session_resume (struct sched_session *s);
+
+/* the authentication responses of a round are checked at once */
+static void sched_round_cb (struct evloop __unused *loop, void *arg)
+{
+	struct sched *s = arg;
+
+	if (s->deferred) {
+		auth_verify_pending();
+		while (s->deferred)
+			sched_session_resume(s->deferred);
+	}
+}
+
+struct sched* sched_new (sched_done_t done)
+{
+	struct sched *s = malloc(sizeof(*s));
+
+	if (!s)
+		return NULL;
+
+	s->loop = evloop_new();
+	if (!s->loop) {
+		free(s);
+		return NULL;
+	}
+	s->done = done;
+	s->deferred = NULL;
+	evloop_set_round(s->loop, sched_round_cb, s);
+
+	return s;
+}
+
+void sched_destroy (struct sched *s)
+{
+	if (s) {
+		evloop_destroy(s->loop);
+		free(s);
+	}
+}
+
+struct evloop* sched_get_loop (struct sched *s)
+{
+	return s->loop;
+}
+
+static void sched_session_cb (struct evloop_watch *w, uint32_t events, void *arg)
+{
+	struct sched_session *s = arg;
+	obex_t *handle = s->data->net_data->obex;
+	int err = 0;
+
+	if (events & EPOLLOUT) {
+		err = sched_session_flush(s);
+		if (!err && s->out_len == 0)
+			err = evloop_mod(w, EPOLLIN | EPOLLET);
+	}
+
+	/* input that arrived while output was queued was not read yet,
+	 * so try to read even without EPOLLIN */
+	if (!err && (events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLOUT)))
+		err = sched_session_input(handle, s);
+
+	if (err < 0 || s->closed) {
+		file_data_t *data = s->data;
+
+		/* releases the watch via sched_session_free() */
+		s->sched->done(data);
+	}
+}
+
+static void sched_expire_cb (struct evloop_watch *w, uint32_t __unused events,
+			     void *arg)
+{
+	struct sched_session *s = arg;
+
+	evloop_del(w);
+	s->expire = NULL;
+	sched_session_disconnect(s->data);
+	if (!s->linger)
+		/* releases the watches via sched_session_free() */
+		s->sched->done(s->data);
+}
+
+void sched_session_expire (file_data_t *data, unsigned int ms)
+{
+	struct sched_session *s = data->session;
+
+	if (s)
+		s->expire_ms = ms;
+}
+
+int sched_add (struct sched *s, file_data_t *data)
+{
+	struct sched_session *session = data->session;
+
+	if (!session)
+		return -EINVAL;
+
+	session->sched = s;
+	session->watch = evloop_add(s->loop, session->fd, EPOLLIN | EPOLLET,
+				    sched_session_cb, session);
+	if (!session->watch)
+		return -errno;
+
+	if (session->expire_ms) {
+		session->expire = evloop_add_timer(s->loop, session->expire_ms,
+						   sched_expire_cb, session);
+		if (!session->expire) {
+			int err = -errno;
+
+			evloop_del(session->watch);
+			session->watch = NULL;
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+void sched_set_linger (unsigned int ms)
+{
+	sched_linger = ms;
+}
+
+/* Unsent bytes in the socket send queue, -1 if unknown */
+static int sched_session_outq (struct sched_session *s)
+{
+	int n;
+
+	if (ioctl(s->fd, SIOCOUTQ, &n) == -1)
+		return -1;
+	return n;
+}
+
+/* Checks if the session can be disconnected */
+static int sched_session_lingering (struct sched_session *s)
+{
+	if (s->linger_left == 0)
+		return 0;
+	if (sched_session_flush(s) < 0)
+		return 0;
+	if (s->out_len == 0 && sched_session_outq(s) == 0)
+		return 0;
+
+	if (s->linger_left > SCHED_LINGER_TICK)
+		s->linger_left -= SCHED_LINGER_TICK;
+	else
+		s->linger_left = 0;
+	return 1;
+}
+
+static void sched_linger_cb (struct evloop_watch __unused *w, uint32_t __unused events,
+			     void *arg)
+{
+	struct sched_session *s = arg;
+	file_data_t *data = s->data;
+
+	if (sched_session_lingering(s))
+		return;
+
+	net_disconnect(data->net_data);
+	/* releases the timer via sched_session_free() */
+	s->sched->done(data);
+}
+
+void sched_session_disconnect (file_data_t *data)
+{
+	struct sched_session *s = data->session;
+
+	if (s) {
+		s->linger_left = sched_linger;
+		if (s->sched && sched_session_lingering(s)) {
+			if (!s->linger)
+				s->linger = evloop_add_timer(s->sched->loop, SCHED_LINGER_TICK,
+							     sched_linger_cb, s);
+			if (s->linger)
+				return;
+
+		} else if (!s->sched) {
+			/* not driven by an event loop, the caller waits */
+			while (sched_session_lingering(s))
+				(void)poll(NULL, 0, SCHED_LINGER_TICK);
+		}
+	}
+	net_disconnect(data->net_data);
+}
+
+void sched_session_cancel (file_data_t *data)
+{
+	struct sched_session *s = data->session;
+
+	if (!s)
+		return;
+
+	if (s->wait) {
+		evloop_del(s->wait);
+		s->wait = NULL;
+	}
+	if (s->wait_timer) {
+		evloop_del(s->wait_timer);
+		s->wait_timer = NULL;
+	}
+	if (s->deferred) {
+		struct sched_session **p = &s->sched->deferred;
+
+		while (*p != s)
+			p = &(*p)->defer_next;
+		*p = s->defer_next;
+		s->defer_next = NULL;
+		s->deferred = 0;
+	}
+	s->wait_obj = NULL;
+	s->wait_cb = NULL;
+}
+
+static void sched_session_resume (struct sched_session *s)
+{
+	file_data_t *data = s->data;
+	obex_t *handle = data->net_data->obex;
+	sched_resume_t cb = s->wait_cb;
+	obex_object_t *obj = s->wait_obj;
+
+	sched_session_cancel(data);
+	cb(data, obj);
+
+	/* the callback may wait again */
+	if (!s->wait_cb && OBEX_ResumeRequest(handle) < 0)
+		s->closed = 1;
+
+	/* the response was sent, read what arrived in the meantime */
+	if (!s->closed && !s->wait_cb && sched_session_input(handle, s) < 0)
+		s->closed = 1;
+
+	if (s->closed)
+		/* releases the watches via sched_session_free() */
+		s->sched->done(data);
+}
+
+static void sched_wait_cb (struct evloop_watch __unused *w, uint32_t __unused events,
+			   void *arg)
+{
+	sched_session_resume(arg);
+}
+
+int sched_session_wait (file_data_t *data, obex_object_t *obj,
+			int fd, int timeout, sched_resume_t cb)
+{
+	struct sched_session *s = data->session;
+	obex_t *handle = data->net_data->obex;
+
+	if (fd == -1 && timeout < 0)
+		return -EINVAL;
+
+	if (!s || !s->watch) {
+		/* not driven by an event loop */
+		struct pollfd pfd = {
+			.fd = fd,
+			.events = POLLIN,
+		};
+
+		while (poll(&pfd, (fd == -1)? 0: 1, timeout) == -1 && errno == EINTR)
+			;
+		cb(data, obj);
+		return 0;
+	}
+
+	if (fd != -1) {
+		s->wait = evloop_add(s->sched->loop, fd, EPOLLIN, sched_wait_cb, s);
+		if (!s->wait)
+			return -errno;
+	}
+	if (timeout >= 0) {
+		s->wait_timer = evloop_add_timer(s->sched->loop, timeout, sched_wait_cb, s);
+		if (!s->wait_timer) {
+			int err = -errno;
+
+			sched_session_cancel(data);
+			return err;
+		}
+	}
+	s->wait_obj = obj;
+	s->wait_cb = cb;
+	(void)OBEX_SuspendRequest(handle, obj);
+
+	return 0;
+}
+
+void sched_session_defer (file_data_t *data, obex_object_t *obj,
+			  sched_resume_t cb)
+{
+	struct sched_session *s = data->session;
+	obex_t *handle = data->net_data->obex;
+
+	if (!s || !s->watch) {
+		/* not driven by an event loop */
+		auth_verify_pending();
+		cb(data, obj);
+		return;
+	}
+
+	s->wait_obj = obj;
+	s->wait_cb = cb;
+	s->deferred = 1;
+	s->defer_next = s->sched->deferred;
+	s->sched->deferred = s;
+	(void)OBEX_SuspendRequest(handle, obj);
+}
+
+int sched_dispatch (struct sched *s, int timeout)
+{
+	return evloop_dispatch(s->loop, timeout);
+}
@@ -0,0 +1,80 @@
+#ifndef OBEXPUSHD_SCHEDULER_H
+#define OBEXPUSHD_SCHEDULER_H
+
+#include "obexpushd.h"
+#include "evloop.h"
+
+/* Session scheduler: many client sessions are driven by one event loop.
+ * Each session has its own custom transport OBEX handle and the socket
+ * of the accepted link is read by the scheduler and fed to it.
+ */
+struct sched;
+struct sched_session;
+
+/** Called when a session ended, the callee must release data */
+typedef void (*sched_done_t)(file_data_t *data);
+
+struct sched* sched_new (sched_done_t done);
+void sched_destroy (struct sched *s);
+struct evloop* sched_get_loop (struct sched *s);
+
+/** Let the scheduler drive a session
+ * On failure, the done callback is _not_ called.
+ * @return 0 on success or a negative error number
+ */
+int sched_add (struct sched *s, file_data_t *data);
+
+/** Run one round of the event loop
+ * @return see evloop_dispatch()
+ */
+int sched_dispatch (struct sched *s, int timeout);
+
+/** Create the session handle for an accepted link
+ * The session is stored in data->session and the returned handle
+ * is used for all OBEX processing. The link handle must stay valid
+ * until sched_session_free() was called.
+ */
+obex_t* sched_session_new (file_data_t *data, obex_t *link, obex_event_t eventcb);
+void sched_session_free (file_data_t *data);
+
+/** Called when a suspended request can continue */
+typedef void (*sched_resume_t)(file_data_t *data, obex_object_t *obj);
+
+/** Delay the response to a request without blocking the scheduler
+ * The request is suspended until fd is readable or timeout
+ * milliseconds passed, then cb is called to set the response. It may
+ * call this function again. A session that is not driven by a
+ * scheduler waits right here.
+ * @param fd a file descriptor or -1 for none
+ * @param timeout in milliseconds, -1 for none
+ * @return 0 or a negative error number (cb is not called then)
+ */
+int sched_session_wait (file_data_t *data, obex_object_t *obj,
+			int fd, int timeout, sched_resume_t cb);
+
+/** Delay the response to a request until the end of the current round
+ * of the event loop. Then all pending authentication responses are
+ * checked at once, see auth_verify_pending(), and cb is called to set
+ * the response. cb must not call this function again.
+ */
+void sched_session_defer (file_data_t *data, obex_object_t *obj,
+			  sched_resume_t cb);
+
+/** Forget a delayed response, e.g. when the request was aborted */
+void sched_session_cancel (file_data_t *data);
+
+/** Maximum time in milliseconds to wait for unsent data on disconnect */
+void sched_set_linger (unsigned int ms);
+
+/** Disconnect the session after ms milliseconds, whatever it does
+ * This takes effect when the session is added to a scheduler.
+ */
+void sched_session_expire (file_data_t *data, unsigned int ms);
+
+/** Disconnect the session once all sent data left the socket
+ * For a scheduler driven session, this is done by a timer and the
+ * done callback is called afterwards.
+ */
+void sched_session_disconnect (file_data_t *data);
+
+#endif /* OBEXPUSHD_SCHEDULER_H */
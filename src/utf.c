@@ -250,6 +250,7 @@ uint16_t* utf8_to_ucs2 (const uint8_t* c)
 					*d = (uint16_t)(t & 0xFFFF);
 				else
 					*d = 0xFFFD; /* Unicode replacement character */
+				++d;
 			}
 		}
 #endif // HAVE_ICONV
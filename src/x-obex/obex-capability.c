@@ -122,9 +122,10 @@ void obex_caps_mem (FILE* fd,
 	xml_close(fd, --indent, "Memory");
 }
 
+/* everything of General that comes before the memory elements */
 static
-void obex_caps_general (FILE* fd,
-			struct obex_caps_general* caps)
+void obex_caps_general_head (FILE* fd,
+			     struct obex_caps_general* caps)
 {
 	xml_open(fd, 1, "General");
 	xml_print(fd, 2, "Manufacturer", "%s",
@@ -143,8 +144,12 @@ void obex_caps_general (FILE* fd,
 		obex_caps_version(fd, 2, "HW", caps->hw);
 	if (strlen(caps->lang))
 		xml_print(fd, 2, "Language", "%s", caps->lang);
-	for (unsigned int i = 0; i < caps->mem_count; ++i)
-		obex_caps_mem(fd, 2, &caps->mem[i]);
+}
+
+static
+void obex_caps_general_tail (FILE* fd,
+			     struct obex_caps_general* caps)
+{
 	for (unsigned int i = 0; i < caps->ext_count; ++i)
 		obex_caps_ext(fd, 2, &caps->ext[i]);
 	xml_close(fd, 1, "General");
@@ -249,9 +254,8 @@ void obex_caps_service (FILE* fd,
 	xml_close(fd, 1, "Service");
 }
 
-int obex_capability (FILE* fd, struct obex_capability* caps)
+int obex_capability_head (FILE* fd, struct obex_capability* caps)
 {
-	int err = 0;
 	fprintf(fd,
 		"<?xml version=\"1.0\"");
 	if (caps->charset)
@@ -260,11 +264,33 @@ int obex_capability (FILE* fd, struct obex_capability* caps)
 		"?>\n"
 		"<!DOCTYPE folder-listing SYSTEM \"obex-capability.dtd\">\n");
 	xml_open(fd,0,"Capability Version=\"1.0\"");
-	obex_caps_general(fd,&caps->general);
+	obex_caps_general_head(fd,&caps->general);
+	return 0;
+}
+
+void obex_capability_mem (FILE* fd, struct obex_caps_mem* mem)
+{
+	obex_caps_mem(fd, 2, mem);
+}
+
+int obex_capability_tail (FILE* fd, struct obex_capability* caps)
+{
+	obex_caps_general_tail(fd,&caps->general);
 	if (caps->inbox)
 		obex_caps_inbox(fd, caps->inbox);
 	if (caps->service)
 		obex_caps_service(fd, caps->service);
 	xml_close(fd,0,"Capability");
+	return 0;
+}
+
+int obex_capability (FILE* fd, struct obex_capability* caps)
+{
+	int err = obex_capability_head(fd, caps);
+
+	for (unsigned int i = 0; !err && i < caps->general.mem_count; ++i)
+		obex_capability_mem(fd, &caps->general.mem[i]);
+	if (!err)
+		err = obex_capability_tail(fd, caps);
 	return err;
 }
@@ -112,3 +112,11 @@ struct obex_capability {
 };
 
 int obex_capability (FILE* fd, struct obex_capability* caps);
+
+/* The same output in parts: the memory elements change often, so they
+ * can be written between a head and a tail that were written once.
+ * The memory list of caps is not used by these.
+ */
+int obex_capability_head (FILE* fd, struct obex_capability* caps);
+void obex_capability_mem (FILE* fd, struct obex_caps_mem* mem);
+int obex_capability_tail (FILE* fd, struct obex_capability* caps);
@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -103,11 +104,47 @@ static int get_mime_type (
 }
 #endif
 
+/* Only the fields that are printed are requested, this is cheaper on
+ * some file systems.
+ */
 static
-void print_filename (FILE* fd, const char* filename, mode_t st_parent, int flags)
+int stat_entry (int dirfd, const char* name, struct stat *s, int flags)
 {
-	struct stat s;
-	const char *name;
+#if defined(STATX_BASIC_STATS)
+	static int no_statx = 0;
+	unsigned int mask = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_SIZE;
+	struct statx x;
+
+	if (flags & OFL_FLAG_TIMES)
+		mask |= STATX_MTIME | STATX_CTIME;
+
+	if (!no_statx) {
+		if (statx(dirfd, name, AT_STATX_SYNC_AS_STAT, mask, &x) == 0) {
+			memset(s, 0, sizeof(*s));
+			s->st_mode = x.stx_mode;
+			s->st_uid = x.stx_uid;
+			s->st_gid = x.stx_gid;
+			s->st_size = x.stx_size;
+			s->st_mtime = x.stx_mtime.tv_sec;
+			s->st_ctime = x.stx_ctime.tv_sec;
+			return 0;
+		}
+		if (errno != ENOSYS)
+			return -1;
+		no_statx = 1;
+	}
+#else
+	(void)flags;
+#endif
+	return fstatat(dirfd, name, s, 0);
+}
+
+/* path is the full name for the attributes, the mode in s is already fixed */
+static
+void print_entry (FILE* fd, const char* name, const char* path,
+		  const struct stat* s, mode_t st_parent, int flags)
+{
+	struct tm t;
 	char *esc_name;
 #ifdef USE_XATTR
 	char type[256];
@@ -116,22 +153,8 @@ void print_filename (FILE* fd, const char* filename, mode_t st_parent, int flags
 	char mod_time[17];
 	char acc_time[17];
 
-	if (filename == NULL ||
-	    stat(filename,&s) == -1)
-		return;
-	s.st_mode = mode_fixup(s.st_uid, s.st_gid, s.st_mode, flags);
-
-	name = strrchr(filename,(int)'/');
-	if (name == NULL)
-		name = filename;
-	else
-		++name;
-
-	if (name[0] == '.' && !(flags & OFL_FLAG_HIDDEN))
-		return;
-  
 	xml_indent(fd,1);
-	switch(filetype(s.st_mode)) {
+	switch(filetype(s->st_mode)) {
 	case FT_FILE:
 		fprintf(fd,"<file");
 		break;
@@ -145,45 +168,47 @@ void print_filename (FILE* fd, const char* filename, mode_t st_parent, int flags
 	}
 
 	esc_name = xml_esc_string(name);
-	fprintf(fd," name=\"%s\" size=\"%zd\"",esc_name,s.st_size);
+	fprintf(fd," name=\"%s\" size=\"%zd\"",esc_name,s->st_size);
 	free(esc_name);
 
 #ifdef USE_XATTR
-	if (!get_mime_type(name,type,sizeof(type))) {
+	if (!get_mime_type(path,type,sizeof(type))) {
 		fprintf(fd," type=\"%s\"",type);
 	}
+#else
+	(void)path;
 #endif
 
 	if (flags & OFL_FLAG_TIMES) {
-		if (strftime(create_time,15,"%Y%m%dT%H%M%SZ",gmtime(&s.st_ctime)))
+		if (strftime(create_time,15,"%Y%m%dT%H%M%SZ",gmtime_r(&s->st_ctime,&t)))
 			fprintf(fd," created=\"%s\"",create_time);
-		if (strftime(mod_time,15,"%Y%m%dT%H%M%SZ",gmtime(&s.st_mtime)))
+		if (strftime(mod_time,15,"%Y%m%dT%H%M%SZ",gmtime_r(&s->st_mtime,&t)))
 			fprintf(fd," modified=\"%s\"",mod_time);
-		if (strftime(acc_time,15,"%Y%m%dT%H%M%SZ",gmtime(&s.st_mtime)))
+		if (strftime(acc_time,15,"%Y%m%dT%H%M%SZ",gmtime_r(&s->st_mtime,&t)))
 			fprintf(fd," accessed=\"%s\"",acc_time);
 	}
 
 	if (flags & OFL_FLAG_OWNER) {
-		fprintf(fd, " owner=\"%d\"", s.st_uid);
+		fprintf(fd, " owner=\"%d\"", s->st_uid);
 	}
 
 	if (flags & OFL_FLAG_GROUP) {
-		fprintf(fd, " group=\"%d\"", s.st_gid);
+		fprintf(fd, " group=\"%d\"", s->st_gid);
 	}
 
 	if (flags & OFL_FLAG_PERMS) {	
 		fprintf(fd," user-perm=\"%s%s%s\"",
-			(s.st_mode & S_IRUSR)?"R":"",
-			((s.st_mode & S_IWUSR) && !(flags & OFL_FLAG_KEEP))?"W":"",
+			(s->st_mode & S_IRUSR)?"R":"",
+			((s->st_mode & S_IWUSR) && !(flags & OFL_FLAG_KEEP))?"W":"",
 			((st_parent & S_IWUSR) && !(flags & OFL_FLAG_NODEL))?"D":"");
 #ifndef _WIN32
 		fprintf(fd," group-perm=\"%s%s%s\"",
-			(s.st_mode & S_IRGRP)?"R":"",
-			((s.st_mode & S_IWGRP) && !(flags & OFL_FLAG_KEEP))?"W":"",
+			(s->st_mode & S_IRGRP)?"R":"",
+			((s->st_mode & S_IWGRP) && !(flags & OFL_FLAG_KEEP))?"W":"",
 			((st_parent & S_IWGRP) && !(flags & OFL_FLAG_NODEL))?"D":"");
 		fprintf(fd," other-perm=\"%s%s%s\"",
-			(s.st_mode & S_IROTH)?"R":"",
-			((s.st_mode & S_IWOTH) && !(flags & OFL_FLAG_KEEP))?"W":"",
+			(s->st_mode & S_IROTH)?"R":"",
+			((s->st_mode & S_IWOTH) && !(flags & OFL_FLAG_KEEP))?"W":"",
 			((st_parent & S_IWOTH) && !(flags & OFL_FLAG_NODEL))?"D":"");
 #endif
 	}
@@ -191,42 +216,145 @@ void print_filename (FILE* fd, const char* filename, mode_t st_parent, int flags
 	fprintf(fd," />\n");
 }
 
-static 
-void print_dir (FILE* fd, const char* dir, int flags)
+/* name is relative to dirfd, path is the full name for the attributes */
+static
+void print_filename (FILE* fd, int dirfd, const char* filename, const char* path,
+		     mode_t st_parent, int flags)
 {
-	DIR* d;
-	char* filename = NULL;
-	size_t flen;
-	mode_t mode;
-	struct dirent* entry = NULL;
-	char* seperator;
-	char *tmp;
-  
-	if (dir == NULL)
+	struct stat s;
+	const char *name;
+
+	if (filename == NULL)
 		return;
 
-	mode = filemode(dir, flags);
-	if (mode == 0)
+	name = strrchr(filename,(int)'/');
+	if (name == NULL)
+		name = filename;
+	else
+		++name;
+
+	if (name[0] == '.' && !(flags & OFL_FLAG_HIDDEN))
 		return;
 
-	seperator = (dir[strlen(dir)-1] == '/')? "" : "/";
-	d = opendir(dir);
-	flen = strlen(dir)+strlen(seperator)+1;
-	while ((entry = readdir(d))) {
-		if (strcmp(entry->d_name,".") == 0 ||
-		    strcmp(entry->d_name,"..") == 0)
-			continue;
-		tmp = realloc(filename,flen+strlen(entry->d_name));
+	if (stat_entry(dirfd, filename, &s, flags) == -1)
+		return;
+	s.st_mode = mode_fixup(s.st_uid, s.st_gid, s.st_mode, flags);
+
+	print_entry(fd, name, path, &s, st_parent, flags);
+}
+
+#ifdef USE_XATTR
+/* Put dir/name into one buffer that is reused for all entries,
+ * dlen is the length of dir without trailing slashes.
+ */
+static
+char* entry_path (char** path, size_t* psize, const char* dir, size_t dlen,
+		  const char* name)
+{
+	size_t size = dlen + 1 + strlen(name) + 1;
+
+	if (size > *psize) {
+		char *tmp = realloc(*path, size);
 		if (!tmp)
-			break;
-		else
-			filename = tmp;
-		sprintf(filename,"%s%s%s",dir,seperator,entry->d_name);
-		print_filename(fd,filename,mode,flags);
+			return NULL;
+		*path = tmp;
+		*psize = size;
 	}
-	if (filename)
-		free(filename);
-	closedir(d);
+	memcpy(*path, dir, dlen);
+	(*path)[dlen] = '/';
+	strcpy(*path + dlen + 1, name);
+
+	return *path;
+}
+#endif
+
+static
+size_t dir_len (const char* dir)
+{
+	size_t len = strlen(dir);
+
+	while (len > 1 && dir[len-1] == '/')
+		--len;
+	return len;
+}
+
+enum ofl_state {
+	OFL_STATE_HEADER,
+	OFL_STATE_ENTRIES,
+	OFL_STATE_FOOTER,
+	OFL_STATE_DONE,
+};
+
+struct obex_folder_listing {
+	enum ofl_state state;
+	char* name;
+	int flags;
+	enum ft type;
+	int has_parent;
+	mode_t parent_mode;
+
+	/* FT_FOLDER only */
+	DIR* d;
+	int dfd;
+	mode_t mode;
+	char* path;
+	size_t dlen;
+	size_t psize;
+};
+
+/* The directory is opened once and all entries are looked up relative
+ * to it, so no path needs to be resolved again.
+ */
+static
+int open_dir (struct obex_folder_listing* l)
+{
+	struct stat s;
+
+	l->dfd = open(l->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (l->dfd == -1)
+		return -errno;
+	if (fstat(l->dfd, &s) == -1 ||
+	    (l->d = fdopendir(l->dfd)) == NULL)
+	{
+		int err = -errno;
+		close(l->dfd);
+		return err;
+	}
+	l->mode = mode_fixup(s.st_uid, s.st_gid, s.st_mode, l->flags);
+
+	l->dlen = dir_len(l->name);
+
+	return 0;
+}
+
+/* returns 1 if an entry was handled, 0 at the end of the directory */
+static 
+int print_dir_entry (FILE* fd, struct obex_folder_listing* l)
+{
+	struct dirent* entry = readdir(l->d);
+	const char *name;
+
+	if (!entry)
+		return 0;
+
+	name = entry->d_name;
+	if (strcmp(name,".") == 0 ||
+	    strcmp(name,"..") == 0)
+		return 1;
+	/* no need to stat what is not listed */
+	if (name[0] == '.' && !(l->flags & OFL_FLAG_HIDDEN))
+		return 1;
+	if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_REG &&
+	    entry->d_type != DT_DIR && entry->d_type != DT_LNK)
+		return 1;
+
+#ifdef USE_XATTR
+	if (!entry_path(&l->path, &l->psize, l->name, l->dlen, name))
+		return 0;
+#endif
+	print_filename(fd,l->dfd,name,l->path,l->mode,l->flags);
+
+	return 1;
 }
 
 #include <langinfo.h>
@@ -257,12 +385,23 @@ char* get_parent_folder_name (const char* path)
 	return p;
 }
 
-int obex_folder_listing (FILE* fd, char* name, int flags)
+static
+void print_header (FILE* fd, int has_parent, int flags)
+{
+	fprintf(fd,
+		"<?xml version=\"1.0\" encoding=\"%s\"?>\n",
+		get_system_charset());
+	fprintf(fd,
+		"<!DOCTYPE folder-listing SYSTEM \"obex-folder-listing.dtd\">\n");
+	xml_open(fd,0,"folder-listing version=\"1.0\"");
+	if (has_parent && (flags & OFL_FLAG_PARENT))
+		xml_print(fd,1,"parent-folder",NULL,0);
+}
+
+static
+int check_name (char* name)
 {
-	mode_t m = 0;
-	int err = 0;
 	size_t namelen = (name? strlen(name): 0);
-	char* parent;
 
 #if _WIN32
 	/* backslash dir seperator must be converted to unix format*/
@@ -276,41 +415,325 @@ int obex_folder_listing (FILE* fd, char* name, int flags)
 	    || (namelen > 3 &&
 		(strstr(name,"/../") != NULL
 		 || strncmp(name+namelen-3,"/..",3) == 0)))
-	{
 		return -EINVAL;
+
+	return 0;
+}
+
+struct obex_folder_listing* obex_folder_listing_open (char* name, int flags)
+{
+	struct obex_folder_listing* l;
+	char* parent;
+	int err = 0;
+
+	if (check_name(name)) {
+		errno = EINVAL;
+		return NULL;
 	}
 
-	fprintf(fd,
-		"<?xml version=\"1.0\" encoding=\"%s\"?>\n",
-		get_system_charset());
-	fprintf(fd,
-		"<!DOCTYPE folder-listing SYSTEM \"obex-folder-listing.dtd\">\n");
-	xml_open(fd,0,"folder-listing version=\"1.0\"");
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return NULL;
+	l->dfd = -1;
+	l->flags = flags;
+	l->name = strdup(name);
+	if (!l->name) {
+		free(l);
+		return NULL;
+	}
 
 	parent = get_parent_folder_name(name);
 	if (parent) {
-		if (flags & OFL_FLAG_PARENT)
-			xml_print(fd,1,"parent-folder",NULL,0);
-		m = filemode(parent, flags);
+		l->has_parent = 1;
+		l->parent_mode = filemode(parent, flags);
 		free(parent);
 	}
 
-	switch (filetype(filemode(name, flags))) {
+	l->type = filetype(filemode(name, flags));
+	switch (l->type) {
 	case FT_FOLDER:
-		print_dir(fd,name,flags);
+		err = open_dir(l);
 		break;
 
 	case FT_FILE:
-		print_filename(fd,name,m,flags);
 		break;
 
 	default:
 		err = -ENOTDIR;
-		goto out;
+		break;
+	}
+	if (err) {
+		obex_folder_listing_close(l);
+		errno = -err;
+		return NULL;
 	}
 
-out:
-	xml_close(fd,0,"folder-listing");
+	return l;
+}
+
+int obex_folder_listing_step (struct obex_folder_listing* l, FILE* fd,
+			      unsigned int count)
+{
+	switch (l->state) {
+	case OFL_STATE_HEADER:
+		print_header(fd, l->has_parent, l->flags);
+		l->state = OFL_STATE_ENTRIES;
+		break;
+
+	case OFL_STATE_ENTRIES:
+		if (l->type == FT_FILE) {
+			print_filename(fd,AT_FDCWD,l->name,l->name,l->parent_mode,l->flags);
+		} else {
+			for (; count; --count)
+				if (!print_dir_entry(fd, l))
+					break;
+			/* more entries may follow */
+			if (count == 0)
+				break;
+		}
+		l->state = OFL_STATE_FOOTER;
+		break;
+
+	case OFL_STATE_FOOTER:
+		xml_close(fd,0,"folder-listing");
+		l->state = OFL_STATE_DONE;
+		break;
+
+	case OFL_STATE_DONE:
+		return 0;
+	}
+
+	return 1;
+}
+
+void obex_folder_listing_close (struct obex_folder_listing* l)
+{
+	if (l->d)
+		closedir(l->d);
+	free(l->path);
+	free(l->name);
+	free(l);
+}
+
+int obex_folder_listing (FILE* fd, char* name, int flags)
+{
+	struct obex_folder_listing* l = obex_folder_listing_open(name, flags);
+	int err;
+
+	if (!l)
+		return -errno;
+
+	do {
+		err = obex_folder_listing_step(l, fd, UINT_MAX);
+	} while (err > 0);
+	obex_folder_listing_close(l);
+
 	return err;
+}
+
+/* Sorted directory index:
+ * All entries are read and looked up once, sorted by name. A listing
+ * is then produced from the index without any access to the directory,
+ * and a name prefix is found with a binary search.
+ */
+struct ofl_entry {
+	char* name;
+	struct stat s;
+};
+
+struct obex_folder_index {
+	char* dir;
+	size_t dlen;
+	int flags;
+	int has_parent;
+	mode_t mode;
+	size_t size;
+
+	struct ofl_entry* entries;
+	size_t count;
+};
+
+static
+int compare_entries (const void* a, const void* b)
+{
+	return strcmp(((const struct ofl_entry*)a)->name,
+		      ((const struct ofl_entry*)b)->name);
+}
+
+static
+int index_add (struct obex_folder_index* idx, size_t* alloc,
+	       const char* name, const struct stat* s)
+{
+	struct ofl_entry* e;
+
+	if (idx->count == *alloc) {
+		size_t n = (*alloc? 2 * *alloc: 64);
+
+		e = realloc(idx->entries, n * sizeof(*e));
+		if (!e)
+			return -errno;
+		idx->entries = e;
+		*alloc = n;
+	}
+
+	e = &idx->entries[idx->count];
+	e->name = strdup(name);
+	if (!e->name)
+		return -errno;
+	e->s = *s;
+	++idx->count;
+	idx->size += sizeof(*e) + strlen(name) + 1;
+
+	return 0;
+}
 
+struct obex_folder_index* obex_folder_index_new (char* name, int flags)
+{
+	struct obex_folder_listing* l = obex_folder_listing_open(name, flags);
+	struct obex_folder_index* idx;
+	struct dirent* entry;
+	size_t alloc = 0;
+	int err = 0;
+
+	if (!l)
+		return NULL;
+	if (l->type != FT_FOLDER) {
+		obex_folder_listing_close(l);
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	idx = calloc(1, sizeof(*idx));
+	if (!idx) {
+		obex_folder_listing_close(l);
+		return NULL;
+	}
+	idx->flags = flags;
+	idx->has_parent = l->has_parent;
+	idx->mode = l->mode;
+	idx->dlen = l->dlen;
+	idx->dir = l->name;
+	l->name = NULL;
+	idx->size = sizeof(*idx) + idx->dlen + 1;
+
+	while (!err && (entry = readdir(l->d))) {
+		const char* n = entry->d_name;
+		struct stat s;
+
+		if (strcmp(n,".") == 0 || strcmp(n,"..") == 0)
+			continue;
+		if (n[0] == '.' && !(flags & OFL_FLAG_HIDDEN))
+			continue;
+		if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_REG &&
+		    entry->d_type != DT_DIR && entry->d_type != DT_LNK)
+			continue;
+
+		/* the times are needed for filtering */
+		if (stat_entry(l->dfd, n, &s, flags | OFL_FLAG_TIMES) == -1)
+			continue;
+		s.st_mode = mode_fixup(s.st_uid, s.st_gid, s.st_mode, flags);
+		if (filetype(s.st_mode) == FT_OTHER)
+			continue;
+
+		err = index_add(idx, &alloc, n, &s);
+	}
+	obex_folder_listing_close(l);
+	if (err) {
+		obex_folder_index_free(idx);
+		errno = -err;
+		return NULL;
+	}
+
+	if (idx->count)
+		qsort(idx->entries, idx->count, sizeof(*idx->entries), compare_entries);
+
+	return idx;
+}
+
+size_t obex_folder_index_size (const struct obex_folder_index* idx)
+{
+	return idx->size;
+}
+
+void obex_folder_index_free (struct obex_folder_index* idx)
+{
+	size_t i;
+
+	for (i = 0; i < idx->count; ++i)
+		free(idx->entries[i].name);
+	free(idx->entries);
+	free(idx->dir);
+	free(idx);
+}
+
+/* index of the first entry that starts with prefix or sorts after it,
+ * or with after set, of the first entry that sorts after all of them
+ */
+static
+size_t index_search (const struct obex_folder_index* idx, const char* prefix,
+		     int after)
+{
+	size_t plen = strlen(prefix);
+	size_t lo = 0;
+	size_t hi = idx->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int c = strncmp(idx->entries[mid].name, prefix, plen);
+
+		if (c < 0 || (after && c == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int obex_folder_listing_index (FILE* fd, const struct obex_folder_index* idx,
+			       const struct obex_folder_filter* filter)
+{
+	size_t first = 0;
+	size_t last = idx->count;
+	unsigned int skip = filter->offset;
+	unsigned int left = filter->max;
+	char* path = NULL;
+#ifdef USE_XATTR
+	size_t psize = 0;
+#endif
+	size_t i;
+
+	if (filter->prefix && filter->prefix[0]) {
+		first = index_search(idx, filter->prefix, 0);
+		last = index_search(idx, filter->prefix, 1);
+	}
+	if (!filter->since) {
+		/* every entry in the range matches */
+		if (skip > last - first)
+			skip = last - first;
+		first += skip;
+		skip = 0;
+	}
+
+	print_header(fd, idx->has_parent, idx->flags);
+	for (i = first; i < last; ++i) {
+		const struct ofl_entry* e = &idx->entries[i];
+
+		if (filter->since && e->s.st_mtime < filter->since)
+			continue;
+		if (skip) {
+			--skip;
+			continue;
+		}
+#ifdef USE_XATTR
+		if (!entry_path(&path, &psize, idx->dir, idx->dlen, e->name))
+			break;
+#endif
+		print_entry(fd, e->name, path, &e->s, idx->mode, idx->flags);
+		if (filter->max && --left == 0)
+			break;
+	}
+	xml_close(fd,0,"folder-listing");
+	free(path);
+
+	return 0;
 }
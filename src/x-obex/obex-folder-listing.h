@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <time.h>
 
 #define OFL_FLAG_PARENT (1 << 0) /* show parent folder indicator */
 #define OFL_FLAG_HIDDEN (1 << 1) /* also list hidden files/directories */
@@ -15,3 +16,50 @@
  * @param flags flags that trigger the output of various elements or attributes
  */
 int obex_folder_listing (FILE* fd, char* name, int flags);
+
+/* The same output in steps, e.g. to send it while it is generated */
+struct obex_folder_listing;
+
+/** start an OBEX folder listing
+ * @param name  name of file or directory
+ * @param flags like for obex_folder_listing()
+ * @return the listing state or NULL on error (errno is set)
+ */
+struct obex_folder_listing* obex_folder_listing_open (char* name, int flags);
+
+/** write the next part of the listing
+ * @param fd    the output
+ * @param count maximum number of directory entries to look at, must not be 0
+ * @return 1 if there is more to write, 0 at the end
+ */
+int obex_folder_listing_step (struct obex_folder_listing* l, FILE* fd,
+			      unsigned int count);
+
+void obex_folder_listing_close (struct obex_folder_listing* l);
+
+/* Listing of a part of a directory, from a sorted index of all entries */
+struct obex_folder_index;
+
+struct obex_folder_filter {
+	unsigned int offset; /* number of matching entries to skip */
+	unsigned int max;    /* maximum number of entries, 0 for all */
+	const char* prefix;  /* only names starting with it, may be NULL */
+	time_t since;        /* only entries modified at or after it, 0 for all */
+};
+
+/** read and sort all entries of a directory
+ * @param name  name of the directory
+ * @param flags like for obex_folder_listing(), they also apply to
+ *              obex_folder_listing_index()
+ * @return the index or NULL on error (errno is set)
+ */
+struct obex_folder_index* obex_folder_index_new (char* name, int flags);
+
+/** @return the approximate memory usage of the index */
+size_t obex_folder_index_size (const struct obex_folder_index* idx);
+
+void obex_folder_index_free (struct obex_folder_index* idx);
+
+/** write the OBEX folder listing of the matching entries of the index */
+int obex_folder_listing_index (FILE* fd, const struct obex_folder_index* idx,
+			       const struct obex_folder_filter* filter);